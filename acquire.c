@@ -0,0 +1,686 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the acquisition thread.
+ *
+ * The data source drivers used to be called straight from the GTK main loop: animate() called
+ * get_data() and then spent most of its time redrawing, so a slow redraw could leave a sound card
+ * or COMEDI buffer to overrun.  Now a dedicated thread calls the driver's get_data() as soon as
+ * data is available and hands the frames to the GUI through a small ring of frame slots.  The GUI
+ * talks to the thread through a proxy DataSrc that looks exactly like the driver it wraps, so
+ * neither the drivers nor the display code have to know about any of this.
+ *
+ * Every call into the driver is made with 'driver_lock' held, so the drivers themselves stay
+ * single threaded.  The sample data, on the other hand, moves from the capture thread (the only
+ * producer) to the GUI (the only consumer) without any locks:
+ *
+ * - The producer copies newly captured samples of the current frame into slot 'cur', then
+ *   publishes each channel's sample count with an atomic store, followed by the slot number in
+ *   'newest'.  Samples below a published count are never written again while the slot holds that
+ *   frame, so the consumer can display them straight out of the slot without copying.
+ *
+ * - When the driver starts a new frame, the producer moves on to another slot, skipping the one the
+ *   consumer has 'held'.  The consumer sets 'held' to the newest slot and then checks that it is
+ *   still the newest.  The producer never recycles 'cur', and only claims another slot after
+ *   publishing 'cur', so one of the two always notices if they go for the same slot.
+ *
+ * - A slot's buffers are mapped, not allocated, so that a long sweep only takes up memory as its
+ *   samples get written.  After publishing, the producer hands back the memory of the slots that
+ *   are neither 'cur', 'newest' nor 'held'.  By the argument above, the consumer will find that
+ *   such a slot isn't the newest if it goes for it, so at most three slots' worth is ever in use.
+ *
+ * - 'in_progress' is thread-local.  The capture thread's copy belongs to the driver, while the
+ *   GUI's copy tracks the frame currently installed in the view Signals, just like it always did.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include "xoscope.h"
+#include "acquire.h"
+#include "persist.h"
+#include "record.h"
+
+#define SLOTS 4                 /* frames in the ring; we need at least three */
+#define MAXCHANS 26             /* as many as there are memory channels */
+#define MAXFDS 16               /* most poll descriptors we'll take from a driver */
+
+typedef struct Slot {
+    int frame;                  /* driver's frame number for the samples in this slot */
+    gint in_progress;           /* driver's in_progress as of the last update */
+    gint triggered;             /* did get_data() report a trigger during this frame? */
+    gint num[MAXCHANS];         /* samples published so far, per channel */
+    int delay[MAXCHANS];
+    int width[MAXCHANS];        /* allocated size of data[] */
+    short *data[MAXCHANS];
+    int wwidth[MAXCHANS];       /* ...and of wide[], for drivers with a wide sample format */
+    void *wide[MAXCHANS];
+    int persisted;              /* has the finished frame gone to the persistence display? */
+    int released;               /* have the buffers' pages been handed back? */
+} Slot;
+
+static DataSrc *driver = NULL;  /* the driver we capture from */
+static DataSrc proxy;           /* what the rest of xoscope sees as 'datasrc' */
+static Signal view[MAXCHANS];   /* the GUI's copies of the driver's Signals */
+
+static GMutex driver_lock;
+static GThread *thread = NULL;
+static gint quit = 0;
+
+static Slot ring[SLOTS];
+static gint newest = -1;        /* last slot published by the producer */
+static gint held = -1;          /* slot currently installed in view[] by the consumer */
+
+/* These belong to the producer and are protected by driver_lock */
+
+static int cur = -1;            /* slot being filled */
+static int restart = 0;         /* the GUI reset the driver; start over */
+static int single_done = 0;     /* captured our single-shot trace; wait for the GUI to notice */
+static int drained = 0;         /* the sweep in progress was started just for the recorder */
+
+static int wake[2] = {-1, -1};  /* the producer writes a byte here to wake up the GUI */
+static gint wake_pending = 0;
+static int kick[2] = {-1, -1};  /* ...and the GUI writes one here to interrupt the producer */
+
+static int nchans(void)
+{
+    int n = driver->nchans();
+
+    return (n > MAXCHANS) ? MAXCHANS : n;
+}
+
+/* Copy the fields that only change when the GUI tells the driver to change them.  Called by the
+ * GUI, with driver_lock held.
+ */
+
+static void sync_views(void)
+{
+    Signal *sig;
+    int i;
+
+    for (i = 0; i < nchans(); i++) {
+        sig = driver->chan(i);
+        strcpy(view[i].name, sig->name);
+        strcpy(view[i].savestr, sig->savestr);
+        view[i].rate = sig->rate;
+        view[i].volts = sig->volts;
+        view[i].bits = sig->bits;
+        view[i].width = sig->width;
+        view[i].format = sig->format;
+    }
+}
+
+/* Producer side */
+
+static int capturing(void)
+{
+    if (scope.run == 0) single_done = 0;
+
+    return (scope.run && !single_done) || (in_progress && !drained && (scope.scroll_mode != 2));
+}
+
+/* While a recording is open, we keep reading from the driver even when the scope is stopped or
+ * has its single-shot trace, so the recording doesn't pause until the device overruns.  We just
+ * don't publish what we read, nor finish off the sweeps we start that way.
+ */
+
+static int draining(void)
+{
+    return !capturing() && record_active();
+}
+
+static int driver_fds(struct pollfd *pfds, int max)
+{
+    if (driver->poll_fds) {
+        return driver->poll_fds(pfds, max);
+    }
+
+    pfds[0].fd = driver->fd();
+    pfds[0].events = POLLIN;
+    return (pfds[0].fd >= 0) ? 1 : 0;
+}
+
+/* After poll(2) has returned events for the driver's descriptors, does it really have data? */
+
+static int driver_ready(struct pollfd *pfds, int n)
+{
+    if (driver->poll_revents == NULL) {
+        return 1;
+    }
+    return (driver->poll_revents(pfds, n) & (POLLIN | POLLERR)) != 0;
+}
+
+static int claim_slot(void)
+{
+    int i, k;
+
+    for (i = 1; i <= SLOTS; i++) {
+        k = (cur + i) % SLOTS;
+        if (k != cur && k != g_atomic_int_get(&held)) return k;
+    }
+
+    /* Can't happen with three or more slots */
+    fprintf(stderr, "acquire: no free frame slot\n");
+    exit(1);
+}
+
+/* Map a slot buffer of 'size' bytes, in place of 'old' (of 'oldsize' bytes) */
+
+static void * map_buffer(void *old, size_t oldsize, size_t size)
+{
+    void *p;
+
+    if (old != NULL) munmap(old, oldsize);
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+             -1, 0);
+    if (p == MAP_FAILED) {
+        perror("acquire: mmap");
+        exit(1);
+    }
+    return p;
+}
+
+/* Hand back the pages of the slots nobody can be looking at.  They read as zeros from then on, and
+ * only take up memory again as a new frame gets written to them.
+ */
+
+static void release_slots(void)
+{
+    int h = g_atomic_int_get(&held), last = g_atomic_int_get(&newest);
+    int i, k;
+
+    for (k = 0; k < SLOTS; k++) {
+        if (k == cur || k == h || k == last || ring[k].released) continue;
+        for (i = 0; i < MAXCHANS; i++) {
+            if (ring[k].data[i] != NULL) {
+                madvise(ring[k].data[i], (size_t) ring[k].width[i] * sizeof(short),
+                        MADV_DONTNEED);
+            }
+            if (ring[k].wide[i] != NULL) {
+                madvise(ring[k].wide[i], (size_t) ring[k].wwidth[i] * WIDE_SIZE, MADV_DONTNEED);
+            }
+        }
+        ring[k].released = 1;
+    }
+}
+
+/* Called by the capture thread, with driver_lock held, after every get_data() */
+
+static void publish(int triggered)
+{
+    Signal *sig;
+    Slot *slot;
+    int n = nchans();
+    int first, i, num, old;
+    int changed = 0;
+
+    /* The first channel anybody listens to decides when a new frame starts */
+
+    for (first = 0; first < n; first++) {
+        if (driver->chan(first)->listeners > 0) break;
+    }
+    if (first == n) return;
+
+    sig = driver->chan(first);
+    if (cur < 0 || ring[cur].frame != sig->frame || sig->num < ring[cur].num[first]) {
+        cur = claim_slot();
+        slot = &ring[cur];
+        slot->frame = sig->frame;
+        g_atomic_int_set(&slot->triggered, 0);
+        slot->persisted = 0;
+        slot->released = 0;
+        for (i = 0; i < n; i++) {
+            g_atomic_int_set(&slot->num[i], 0);
+            slot->delay[i] = driver->chan(i)->delay;
+        }
+        changed = 1;
+    }
+
+    slot = &ring[cur];
+    for (i = 0; i < n; i++) {
+        sig = driver->chan(i);
+        if (sig->listeners <= 0 || slot->data[i] == NULL) continue;
+        num = (sig->num > slot->width[i]) ? slot->width[i] : sig->num;
+        old = slot->num[i];
+        if (num > old) {
+            memcpy(slot->data[i] + old, sig->data + old, (num - old) * sizeof(short));
+            if (sig->format != SAMPLE_S16 && slot->wwidth[i] >= num) {
+                memcpy((char *) slot->wide[i] + old * WIDE_SIZE,
+                       (char *) sig->wide + old * WIDE_SIZE, (num - old) * WIDE_SIZE);
+            }
+            g_atomic_int_set(&slot->num[i], num);
+            changed = 1;
+        }
+    }
+
+    /* In accumulate mode, every frame we finish goes into the persistence display, whether or not
+     * the GUI gets around to drawing it.  This has to happen before the GUI can see it's finished.
+     */
+
+    if (scope.scroll_mode == 1 && !in_progress && !slot->persisted
+        && driver->chan(first)->width > 0 && slot->num[first] >= driver->chan(first)->width) {
+        for (i = 0; i < n; i++) {
+            if (driver->chan(i)->listeners > 0 && slot->num[i] > 0) {
+                persist_frame(&view[i], slot->data[i], slot->num[i], slot->frame, 1);
+            }
+        }
+        slot->persisted = 1;
+    }
+
+    if (triggered) {
+        g_atomic_int_set(&slot->triggered, 1);
+        if (scope.run > 1) single_done = 1;
+    }
+
+    if (!changed && slot->in_progress == in_progress) return;
+
+    g_atomic_int_set(&slot->in_progress, in_progress);
+    g_atomic_int_set(&newest, cur);
+    release_slots();
+
+    if (g_atomic_int_compare_and_exchange(&wake_pending, 0, 1)) {
+        if (write(wake[1], "", 1) != 1) g_atomic_int_set(&wake_pending, 0);
+    }
+}
+
+static gpointer capture_thread(gpointer ignored)
+{
+    struct pollfd pfds[MAXFDS + 1];
+    char junk[64];
+    int n, woke;
+
+    while (!g_atomic_int_get(&quit)) {
+
+        g_mutex_lock(&driver_lock);
+        if (restart) {
+            in_progress = 0;
+            restart = 0;
+            drained = 0;
+        }
+        n = (capturing() || draining()) ? driver_fds(pfds + 1, MAXFDS) : 0;
+        g_mutex_unlock(&driver_lock);
+
+        /* Wait until the driver has data or the GUI kicks us.  A driver with nothing to poll on
+         * gets queried every SND_QUERY_INTERVALL ms instead (which used to be the GUI's job), and
+         * so do we while stopped, to notice the scope being started again.  The poll timeout only
+         * matters if a device stops delivering data altogether.  If the poll was woken up, the
+         * driver may have to say whether that meant it has data for us.
+         */
+
+        woke = 0;
+        if (n > 0) {
+            pfds[0].fd = kick[0];
+            pfds[0].events = POLLIN;
+            woke = (poll(pfds, n + 1, 100 * SND_QUERY_INTERVALL) > 0);
+            while (read(kick[0], junk, sizeof(junk)) > 0);
+        } else {
+            g_usleep(SND_QUERY_INTERVALL * 1000);
+        }
+
+        g_mutex_lock(&driver_lock);
+        if (!restart && woke && !driver_ready(pfds + 1, n)) {
+            /* Nothing for us after all; wait some more */
+        } else if (!restart && capturing()) {
+            drained = 0;
+            publish(driver->get_data());
+        } else if (!restart && draining()) {
+            driver->get_data();
+            drained = (in_progress != 0);
+        }
+        g_mutex_unlock(&driver_lock);
+    }
+
+    return NULL;
+}
+
+/* Consumer side */
+
+/* Interrupt the capture thread's poll.  If the pipe is full, a kick is already pending. */
+
+static void kick_producer(void)
+{
+    ssize_t ret = write(kick[1], "", 1);
+
+    (void) ret;
+}
+
+/* Called from the GUI as datasrc->get_data() */
+
+static int proxy_get_data(void)
+{
+    char junk[64];
+    Slot *slot;
+    int i, k;
+
+    g_atomic_int_set(&wake_pending, 0);
+    while (read(wake[0], junk, sizeof(junk)) > 0);
+
+    do {
+        k = g_atomic_int_get(&newest);
+        if (k < 0) return 0;
+        g_atomic_int_set(&held, k);
+    } while (g_atomic_int_get(&newest) != k);
+
+    /* Read in_progress before the sample counts, so that if it says the frame is done, the counts
+     * we get are final.
+     */
+
+    slot = &ring[k];
+    in_progress = g_atomic_int_get(&slot->in_progress);
+    for (i = 0; i < MAXCHANS; i++) {
+        view[i].data = slot->data[i];
+        view[i].wide = slot->wide[i];
+        view[i].num = g_atomic_int_get(&slot->num[i]);
+        view[i].frame = slot->frame;
+        view[i].delay = slot->delay[i];
+    }
+
+    return g_atomic_int_get(&slot->triggered);
+}
+
+/* The rest of the proxy just forwards to the driver with driver_lock held.  The exception is
+ * gtk_options(), which we leave alone: the option dialogs call back into datasrc themselves.
+ */
+
+static int proxy_nchans(void)
+{
+    int n;
+
+    g_mutex_lock(&driver_lock);
+    n = nchans();
+    g_mutex_unlock(&driver_lock);
+    return n;
+}
+
+static Signal * proxy_chan(int chan)
+{
+    return (chan >= 0 && chan < MAXCHANS) ? &view[chan] : NULL;
+}
+
+static int proxy_set_trigger(int chan, int *levelp, int mode)
+{
+    int ret;
+
+    g_mutex_lock(&driver_lock);
+    ret = driver->set_trigger(chan, levelp, mode);
+    g_mutex_unlock(&driver_lock);
+    return ret;
+}
+
+static void proxy_clear_trigger(void)
+{
+    g_mutex_lock(&driver_lock);
+    driver->clear_trigger();
+    g_mutex_unlock(&driver_lock);
+}
+
+static int proxy_change_rate(int dir)
+{
+    int ret;
+
+    g_mutex_lock(&driver_lock);
+    ret = driver->change_rate(dir);
+    sync_views();
+    g_mutex_unlock(&driver_lock);
+    return ret;
+}
+
+static void proxy_set_width(int width)
+{
+    g_mutex_lock(&driver_lock);
+    driver->set_width(width);
+    sync_views();
+    g_mutex_unlock(&driver_lock);
+}
+
+/* reset() runs the driver's reset and throws away whatever is in the ring.  The driver's own
+ * listener counts are only looked at here, which is also where drivers like COMEDI look at them.
+ */
+
+static void proxy_reset(void)
+{
+    Signal *sig;
+    int i, k, n;
+
+    g_mutex_lock(&driver_lock);
+
+    n = nchans();
+    for (i = 0; i < n; i++) {
+        driver->chan(i)->listeners = view[i].listeners;
+    }
+
+    driver->reset();
+    sync_views();
+
+    /* Make room for a frame of every channel somebody is listening to */
+
+    for (k = 0; k < SLOTS; k++) {
+        for (i = 0; i < n; i++) {
+            sig = driver->chan(i);
+            if (sig->listeners > 0 && ring[k].width[i] < sig->width) {
+                ring[k].data[i] = map_buffer(ring[k].data[i],
+                                             (size_t) ring[k].width[i] * sizeof(short),
+                                             (size_t) sig->width * sizeof(short));
+                ring[k].width[i] = sig->width;
+            }
+            if (sig->listeners > 0 && sig->format != SAMPLE_S16
+                && ring[k].wwidth[i] < sig->width) {
+                ring[k].wide[i] = map_buffer(ring[k].wide[i],
+                                             (size_t) ring[k].wwidth[i] * WIDE_SIZE,
+                                             (size_t) sig->width * WIDE_SIZE);
+                ring[k].wwidth[i] = sig->width;
+            }
+            ring[k].num[i] = 0;
+        }
+        ring[k].in_progress = 0;
+        ring[k].triggered = 0;
+        ring[k].released = 0;
+    }
+
+    /* Until the capture thread publishes something, show the (empty) slot 0 */
+
+    g_atomic_int_set(&newest, -1);
+    g_atomic_int_set(&held, 0);
+    cur = -1;
+    restart = 1;
+
+    for (i = 0; i < MAXCHANS; i++) {
+        view[i].data = ring[0].data[i];
+        view[i].wide = ring[0].wide[i];
+        view[i].num = 0;
+        view[i].delay = 0;
+        if (i < n) view[i].frame = driver->chan(i)->frame;
+    }
+
+    g_mutex_unlock(&driver_lock);
+
+    /* The driver may well have new poll descriptors now */
+    kick_producer();
+}
+
+/* The GUI waits on our wake-up pipe, never on the driver's file descriptor */
+
+static int proxy_fd(void)
+{
+    return wake[0];
+}
+
+static const char * proxy_status_str(int i)
+{
+    const char *ret;
+
+    g_mutex_lock(&driver_lock);
+    ret = driver->status_str(i);
+    g_mutex_unlock(&driver_lock);
+    return ret;
+}
+
+static int proxy_option1(void)
+{
+    int ret;
+
+    g_mutex_lock(&driver_lock);
+    ret = driver->option1();
+    sync_views();
+    g_mutex_unlock(&driver_lock);
+    return ret;
+}
+
+static const char * proxy_option1str(void)
+{
+    const char *ret;
+
+    g_mutex_lock(&driver_lock);
+    ret = driver->option1str();
+    g_mutex_unlock(&driver_lock);
+    return ret;
+}
+
+static int proxy_option2(void)
+{
+    int ret;
+
+    g_mutex_lock(&driver_lock);
+    ret = driver->option2();
+    sync_views();
+    g_mutex_unlock(&driver_lock);
+    return ret;
+}
+
+static const char * proxy_option2str(void)
+{
+    const char *ret;
+
+    g_mutex_lock(&driver_lock);
+    ret = driver->option2str();
+    g_mutex_unlock(&driver_lock);
+    return ret;
+}
+
+static int proxy_set_option(char *option)
+{
+    int ret;
+
+    g_mutex_lock(&driver_lock);
+    ret = driver->set_option(option);
+    sync_views();
+    g_mutex_unlock(&driver_lock);
+    return ret;
+}
+
+static char * proxy_save_option(int i)
+{
+    char *ret;
+
+    g_mutex_lock(&driver_lock);
+    ret = driver->save_option(i);
+    g_mutex_unlock(&driver_lock);
+    return ret;
+}
+
+/* Start capturing from 'src' on a new thread, and return the DataSrc the rest of the program should
+ * use in its place.  Any previous acquisition is stopped first.
+ */
+
+DataSrc * acquire_open(DataSrc *src)
+{
+    int i;
+
+    acquire_close();
+
+    if ((pipe(wake) < 0) || (pipe(kick) < 0)) {
+        perror("acquire: pipe");
+        exit(1);
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+        fcntl(kick[i], F_SETFL, O_NONBLOCK);
+        fcntl(kick[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    driver = src;
+
+    proxy = *src;
+    proxy.nchans = proxy_nchans;
+    proxy.chan = proxy_chan;
+    if (src->set_trigger) proxy.set_trigger = proxy_set_trigger;
+    if (src->clear_trigger) proxy.clear_trigger = proxy_clear_trigger;
+    if (src->change_rate) proxy.change_rate = proxy_change_rate;
+    if (src->set_width) proxy.set_width = proxy_set_width;
+    proxy.reset = proxy_reset;
+    proxy.fd = proxy_fd;
+    proxy.get_data = proxy_get_data;
+    proxy.poll_fds = NULL;
+    if (src->status_str) proxy.status_str = proxy_status_str;
+    if (src->option1) proxy.option1 = proxy_option1;
+    if (src->option1str) proxy.option1str = proxy_option1str;
+    if (src->option2) proxy.option2 = proxy_option2;
+    if (src->option2str) proxy.option2str = proxy_option2str;
+    if (src->set_option) proxy.set_option = proxy_set_option;
+    if (src->save_option) proxy.save_option = proxy_save_option;
+
+    memset(view, 0, sizeof(view));
+    for (i = 0; i < nchans(); i++) {
+        view[i].frame = src->chan(i)->frame;
+    }
+    sync_views();
+
+    g_atomic_int_set(&newest, -1);
+    g_atomic_int_set(&held, -1);
+    cur = -1;
+    restart = 1;
+    single_done = 0;
+
+    g_atomic_int_set(&quit, 0);
+    thread = g_thread_new("acquire", capture_thread, NULL);
+
+    return &proxy;
+}
+
+/* Stop the capture thread and let go of the driver */
+
+void acquire_close(void)
+{
+    int i, k;
+
+    if (thread) {
+        g_atomic_int_set(&quit, 1);
+        kick_producer();
+        g_thread_join(thread);
+        thread = NULL;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (wake[i] >= 0) close(wake[i]);
+        if (kick[i] >= 0) close(kick[i]);
+        wake[i] = -1;
+        kick[i] = -1;
+    }
+    g_atomic_int_set(&wake_pending, 0);
+
+    for (k = 0; k < SLOTS; k++) {
+        for (i = 0; i < MAXCHANS; i++) {
+            if (ring[k].data[i] != NULL) {
+                munmap(ring[k].data[i], (size_t) ring[k].width[i] * sizeof(short));
+            }
+            ring[k].data[i] = NULL;
+            ring[k].width[i] = 0;
+            if (ring[k].wide[i] != NULL) {
+                munmap(ring[k].wide[i], (size_t) ring[k].wwidth[i] * WIDE_SIZE);
+            }
+            ring[k].wide[i] = NULL;
+            ring[k].wwidth[i] = 0;
+            ring[k].num[i] = 0;
+        }
+    }
+
+    driver = NULL;
+}
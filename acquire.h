@@ -0,0 +1,10 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * acquisition thread routines available outside of acquire.c
+ *
+ */
+
+DataSrc *       acquire_open(DataSrc *driver);
+void            acquire_close(void);
@@ -19,6 +19,9 @@
 #include <alsa/asoundlib.h>
 #include <linux/soundcard.h>
 #include "xoscope.h"            /* program defaults */
+#include "convert.h"
+#include "trigger.h"
+#include "record.h"
 
 char    alsaDevice[32] = "\0";
 
@@ -53,16 +56,64 @@ double  alsa_volts = 0.0;
 static snd_pcm_t *handle        = NULL;
 snd_pcm_format_t pcm_format = 0;
 
+/* If the device lets us, we read the samples straight out of its DMA area (mmap) instead of having
+ * snd_pcm_readi() copy them into our buffer first.
+ */
+static int use_mmap = 0;
+
+#if SC_16BIT
+/* Interfaces with 24-bit (or better) converters can hand us more than 16 bits of every sample, if
+ * we ask for it with the format= option.  Whatever we get goes into the Signals' wide[] arrays; if
+ * the device can't do the format, we fall back to 16 bits.
+ */
+static const struct {
+    const char *name;
+    snd_pcm_format_t pcm;
+} sc_formats[] = {
+    {"s16", SND_PCM_FORMAT_S16_LE},
+    {"s24", SND_PCM_FORMAT_S24_LE},
+    {"s32", SND_PCM_FORMAT_S32_LE},
+    {"float", SND_PCM_FORMAT_FLOAT_LE},
+};
+#define NSC_FORMATS (sizeof(sc_formats) / sizeof(sc_formats[0]))
+
+static int sc_want_format = 0;          /* index into sc_formats */
+#endif
+
+static int sc_format = SAMPLE_S16;      /* what sc_sig[].wide holds */
+static int sc_frame_bytes = 0;          /* size of an interleaved frame */
+
 static int sc_chans = 0;
+static int sc_want_chans = 0;           /* channels to ask for; 0 for as many as there are */
 static int sound_card_rate = DEF_R;     /* sampling rate of sound card */
 
-/* Signal structures we're capturing into */
-static Signal left_sig = {"Left Mix", "a"};
-static Signal right_sig = {"Right Mix", "b"};
+/* The rates change_rate() steps through: the standard ones the device says it can do, found by
+ * probe_rates() the first time we open it (and again if the number of channels changes, since
+ * some interfaces only do their highest rates with fewer channels).
+ */
+static const unsigned int std_rates[] = {
+    8000, 11025, 16000, 22050, 32000, 44100, 48000, 64000, 88200, 96000,
+    176400, 192000, 352800, 384000
+};
+#define NSTD_RATES (sizeof(std_rates) / sizeof(std_rates[0]))
+
+static unsigned int sc_rates[NSTD_RATES];
+static int sc_nrates = 0;
+static int sc_rates_chans = 0;          /* channel count the ladder was probed with */
+
+/* Signal structures we're capturing into.  Multichannel interfaces can have dozens of inputs; we
+ * take as many as we have letters for, like the memory channels.  Only the ones somebody is
+ * listening to (or that we trigger on) get deinterleaved.
+ */
+#define SC_MAXCHANS 26
+
+static Signal sc_sig[SC_MAXCHANS];
 
 static int trigmode = 0;
 static int triglev;
 static int trigch;
+static Trigger trig;
+static History history[SC_MAXCHANS];    /* pre-trigger samples, if scope.trigpos asks for them */
 
 static const char * snd_errormsg1 = NULL;
 static const char * snd_errormsg2 = NULL;
@@ -86,14 +137,48 @@ static void close_sound_card(void)
     }
 }
 
+/* Stereo devices keep the names xoscope has always used for them */
+
+static void name_channels(void)
+{
+    int i;
+
+    for (i = 0; i < sc_chans; i++) {
+        if (sc_chans == 2) {
+            snprintf(sc_sig[i].name, sizeof(sc_sig[i].name), "%s Mix", i ? "Right" : "Left");
+        } else {
+            snprintf(sc_sig[i].name, sizeof(sc_sig[i].name), "Input %d", i + 1);
+        }
+        snprintf(sc_sig[i].savestr, sizeof(sc_sig[i].savestr), "%c", 'a' + i);
+    }
+}
+
+static void probe_rates(snd_pcm_hw_params_t *params)
+{
+    int i;
+
+    if (sc_nrates > 0 && sc_rates_chans == sc_chans) {
+        return;
+    }
+
+    sc_nrates = 0;
+    for (i = 0; i < NSTD_RATES; i++) {
+        if (snd_pcm_hw_params_test_rate(handle, params, std_rates[i], 0) == 0) {
+            sc_rates[sc_nrates++] = std_rates[i];
+        }
+    }
+    sc_rates_chans = sc_chans;
+}
+
 static int open_sound_card(void)
 {
     unsigned int rate = sound_card_rate;
-    unsigned int chan = 2;
+    unsigned int chan;
     int rc;
     snd_pcm_hw_params_t *params;
     int dir = 0;
     snd_pcm_uframes_t pcm_frames;
+    unsigned int period_us;
     int intervall_ms;
 
     if (handle != NULL){
@@ -124,8 +209,12 @@ static int open_sound_card(void)
 
     /* Set the desired hardware parameters. */
 
-    /* Interleaved mode */
-    rc = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    /* Interleaved mode, mmap'ed if possible */
+    rc = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    use_mmap = (rc == 0);
+    if (!use_mmap) {
+        rc = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    }
     if (rc < 0) {
         snd_errormsg1 = "snd_pcm_hw_params_set_access() failed ";
         snd_errormsg2 = snd_strerror(rc);
@@ -134,9 +223,14 @@ static int open_sound_card(void)
 
     /* Set and check format, i.e. bits per sample */
 #if SC_16BIT
-    /* Signed 16-bit little-endian format */
-    rc = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
-    pcm_format = SND_PCM_FORMAT_S16_LE;
+    /* Signed 16-bit little-endian format, unless we've been asked for a wider one and can have it */
+    rc = -1;
+    if (sc_want_format > 0) {
+        rc = snd_pcm_hw_params_set_format(handle, params, sc_formats[sc_want_format].pcm);
+    }
+    if (rc < 0) {
+        rc = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
+    }
 #else
     /* Unsigned 8-bit format */
     rc = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_U8);
@@ -155,7 +249,18 @@ static int open_sound_card(void)
         return 0;
     }
 #if SC_16BIT
-    if (pcm_format != SND_PCM_FORMAT_S16_LE) {
+    switch (pcm_format) {
+    case SND_PCM_FORMAT_S16_LE:
+        sc_format = SAMPLE_S16;
+        break;
+    case SND_PCM_FORMAT_S24_LE:
+    case SND_PCM_FORMAT_S32_LE:
+        sc_format = SAMPLE_S32;
+        break;
+    case SND_PCM_FORMAT_FLOAT_LE:
+        sc_format = SAMPLE_FLOAT;
+        break;
+    default:
         snd_errormsg1 = "Can't set 16-bit format (SND_PCM_FORMAT_S16_LE)";
         return 0;
     }
@@ -166,8 +271,20 @@ static int open_sound_card(void)
     }
 #endif
 
-    /* Two channels (stereo) */
-    rc = snd_pcm_hw_params_set_channels(handle, params, chan);
+    /* As many channels as the device has (or as the user asked for), up to SC_MAXCHANS */
+    rc = snd_pcm_hw_params_get_channels_max(params, &chan);
+    if (rc < 0) {
+        snd_errormsg1 = "snd_pcm_hw_params_get_channels_max() failed ";
+        snd_errormsg2 = snd_strerror(rc);
+        return 0;
+    }
+    if (sc_want_chans > 0 && chan > sc_want_chans) {
+        chan = sc_want_chans;
+    }
+    if (chan > SC_MAXCHANS) {
+        chan = SC_MAXCHANS;
+    }
+    rc = snd_pcm_hw_params_set_channels_near(handle, params, &chan);
     if (rc < 0) {
         snd_errormsg1 = "snd_pcm_hw_params_set_channels() failed ";
         snd_errormsg2 = snd_strerror(rc);
@@ -179,7 +296,10 @@ static int open_sound_card(void)
         snd_errormsg2 = snd_strerror(rc);
         return 0;
     }
-    sc_chans = chan;
+    sc_chans = (chan < SC_MAXCHANS) ? chan : SC_MAXCHANS;
+    sc_frame_bytes = snd_pcm_format_physical_width(pcm_format) / 8 * chan;
+    name_channels();
+    probe_rates(params);
 
     rc = snd_pcm_hw_params_set_rate_near(handle, params, &rate, &dir);
     if (rc < 0) {
@@ -216,6 +336,14 @@ static int open_sound_card(void)
         return 0;
     }
 
+    /* We now wait on the PCM's poll descriptors instead of querying it every SND_QUERY_INTERVALL
+     * ms, and they become readable once per period.  So ask for a period of about that length,
+     * which keeps the display about as lively as it used to be.  This is only a preference; if the
+     * driver can't do it, we live with whatever period it picks.
+     */
+    period_us = SND_QUERY_INTERVALL * 1000;
+    snd_pcm_hw_params_set_period_time_near(handle, params, &period_us, &dir);
+
     /* Write the parameters to the driver */
     rc = snd_pcm_hw_params(handle, params);
     if (rc < 0) {
@@ -230,21 +358,24 @@ static int open_sound_card(void)
         return 0;
     }
 
+    /* A capture stream doesn't start until the first read, and poll never reports a stream that
+     * hasn't started as readable, so start it now.
+     */
+    if ((rc = snd_pcm_start (handle)) < 0) {
+        snd_errormsg1 = "snd_pcm_start() failed ";
+        snd_errormsg2 = snd_strerror(rc);
+        return 0;
+    }
+
     return 1;
 }
 
+static int startup_skip = 0;            /* frames still to drop after a reset */
+static long skipped_frames = 0;         /* frames skipped while waiting for the next sweep */
+static long sweep_skipped = 0;          /* ...and before the current sweep, for the status line */
+
 static void reset_sound_card(void)
 {
-    static unsigned char *junk = NULL;
-
-    if (junk == NULL) {
-        if (!(junk =  malloc((SAMPLESKIP * snd_pcm_format_width(pcm_format) / 8) * 2))) {
-            snd_errormsg1 = "malloc() failed " ;
-            snd_errormsg2 = strerror(errno);
-            return;
-        }
-    }
-
     if (handle != NULL) {
         close_sound_card();
         open_sound_card();
@@ -252,7 +383,11 @@ static void reset_sound_card(void)
         if (handle == NULL) {
             return;
         }
-        snd_pcm_readi(handle, junk, SAMPLESKIP);
+
+        /* The first SAMPLESKIP frames get dropped by skip_stale(), once they've arrived */
+        startup_skip = SAMPLESKIP;
+        skipped_frames = 0;
+        sweep_skipped = 0;
     }
 }
 
@@ -269,17 +404,56 @@ static int fd(void)
     return -1;
 }
 
+/* ALSA doesn't give us a single file descriptor, but a set of poll descriptors (possibly with
+ * events other than POLLIN), so we provide poll_fds() and leave fd() returning -1.
+ */
+
+static int sc_poll_fds(struct pollfd *pfds, int max)
+{
+    int n;
+
+    if (handle == NULL) {
+        return 0;
+    }
+
+    n = snd_pcm_poll_descriptors(handle, pfds, max);
+    return (n > 0) ? n : 0;
+}
+
+/* For plugin PCMs (pulse, dsnoop and the like) the descriptors' events aren't the PCM's own, and
+ * some of them only take the wake-up back when asked what it meant, so that's what we do.
+ */
+
+static unsigned short sc_poll_revents(struct pollfd *pfds, int n)
+{
+    unsigned short revents = 0;
+
+    if (handle == NULL || snd_pcm_poll_descriptors_revents(handle, pfds, n, &revents) < 0) {
+        return POLLERR;
+    }
+    return revents;
+}
+
 static Signal *sc_chan(int chan)
 {
-    return (chan ? &right_sig : &left_sig);
+    return (chan >= 0 && chan < SC_MAXCHANS) ? &sc_sig[chan] : NULL;
 }
 
 /* Triggering - we save the trigger level in the raw, unsigned byte values that we read from the
- * sound card
+ * sound card, and hand it to the trigger engine scaled to the samples it'll see
  */
 
+#if SC_16BIT
+#define TRIG_SCALE 256
+#else
+#define TRIG_SCALE 1
+#endif
+
 static int set_trigger(int chan, int *levelp, int mode)
 {
+    if (chan >= sc_nchans()) {
+        return 0;
+    }
     trigch = chan;
     trigmode = mode;
     triglev = 127 + *levelp;
@@ -291,32 +465,38 @@ static int set_trigger(int chan, int *levelp, int mode)
         triglev = 0;
         *levelp = -128;
     }
+    trigger_set(&trig, mode, (triglev - 127) * TRIG_SCALE, scope.trighyst * TRIG_SCALE);
     return 1;
 }
 
 static void clear_trigger(void)
 {
     trigmode = 0;
+    trigger_set(&trig, 0, 0, 0);
 }
 
+/* Step to the next rate up or down the ladder probe_rates() found.  The current rate needn't be
+ * on it (it could have come from a saved file), so look for the nearest one in the right direction.
+ */
+
 static int change_rate(int dir)
 {
-    int newrate = sound_card_rate;
+    int i, newrate = sound_card_rate;
 
     if (dir > 0) {
-        if (sound_card_rate > 16500)
-            newrate = 44100;
-        else if (sound_card_rate > 9500)
-            newrate = 22050;
-        else
-            newrate = 11025;
+        for (i = 0; i < sc_nrates; i++) {
+            if (sc_rates[i] > sound_card_rate) {
+                newrate = sc_rates[i];
+                break;
+            }
+        }
     } else {
-        if (sound_card_rate < 16500)
-            newrate = 8000;
-        else if (sound_card_rate < 33000)
-            newrate = 11025;
-        else
-            newrate = 22050;
+        for (i = sc_nrates - 1; i >= 0; i--) {
+            if (sc_rates[i] < sound_card_rate) {
+                newrate = sc_rates[i];
+                break;
+            }
+        }
     }
 
     if (newrate != sound_card_rate) {
@@ -326,43 +506,66 @@ static int change_rate(int dir)
     return 0;
 }
 
-static void reset(void)
-{
-    reset_sound_card();
-
-    left_sig.rate = sound_card_rate;
-    right_sig.rate = sound_card_rate;
-
-    left_sig.num = 0;
-    left_sig.frame ++;
-
-    right_sig.num = 0;
-    right_sig.frame ++;
-
-    left_sig.volts = alsa_volts;
-    right_sig.volts = alsa_volts;
-
-    in_progress = 0;
-}
-
 /* This is the buffer into wich we read the interleaved data from the soundcard.
  * Interleaved means the data is transfered in individual frames, 
  * where each frame is composed of a single sample from each channel. 
  *
- * The buffer is sized so that the data for a full sweep of the scope fits into it.
- * The number of samples for a full sweep depends on the time base and the sample rate 
+ * The number of samples for a full sweep depends on the time base and the sample rate
  * of the scope.
- * It is stored in bufferSizeFrames (also equal to: left_sig/right_sig.width).
- * Therfore the size has to be recaluleted and the buffer realocated 
- * when the time base and/or the sample rate changes.
+ * It is stored in bufferSizeFrames (also equal to the Signals' width).
+ * A sweep may take several reads, so the buffer holds up to TRIGGER_STEP frames of it
+ * (readFrames), and has to be reallocated when a sweep gets shorter than that.
  */
 
-#if SC_16BIT
-static short *buffer = NULL;
-#else
-static unsigned char *buffer = NULL;
-#endif
-static int  bufferSizeFrames    = 0;    /* The size of the buffer,measured in Frames */
+static char *buffer = NULL;
+static int  bufferSizeFrames    = 0;    /* The size of a sweep,measured in Frames */
+static int  readFrames          = 0;    /* The size of the buffer,measured in Frames */
+
+/* Each channel of up to TRIGGER_STEP frames, converted to shorts for the trigger search, and in a
+ * wide format, at full resolution as well.  The wide samples have their own history.
+ */
+static short *scratch[SC_MAXCHANS];
+static void *wscratch[SC_MAXCHANS];
+static History whistory[SC_MAXCHANS];
+
+/* (Re)allocate whatever depends on the width of a sweep and the number of channels */
+
+static void alloc_buffers(void)
+{
+    static int buffer_frame_bytes = 0;
+    int frames = (bufferSizeFrames < TRIGGER_STEP) ? bufferSizeFrames : TRIGGER_STEP;
+    int pre = pretrigger_samples(bufferSizeFrames);
+    int i;
+
+    if (bufferSizeFrames == 0) {
+        return;
+    }
+
+    for (i = 0; i < sc_chans; i++) {
+        if (sc_sig[i].data == NULL || sc_sig[i].width != bufferSizeFrames) {
+            g_free(sc_sig[i].data);
+            sc_sig[i].data = g_new0(short, bufferSizeFrames);
+            sc_sig[i].width = bufferSizeFrames;
+            g_free(sc_sig[i].wide);
+            sc_sig[i].wide = NULL;
+
+            scratch[i] = g_renew(short, scratch[i], frames);
+            history_resize(&history[i], pre, sizeof(short));
+        }
+        if (sc_format != SAMPLE_S16 && sc_sig[i].wide == NULL) {
+            sc_sig[i].wide = g_malloc((size_t) bufferSizeFrames * WIDE_SIZE);
+            wscratch[i] = g_realloc(wscratch[i], (size_t) frames * WIDE_SIZE);
+            history_resize(&whistory[i], pre, WIDE_SIZE);
+        }
+        sc_sig[i].format = sc_format;
+    }
+
+    if (readFrames != frames || buffer_frame_bytes < sc_frame_bytes) {
+        buffer = g_realloc(buffer, (size_t) frames * sc_frame_bytes);
+        readFrames = frames;
+        buffer_frame_bytes = sc_frame_bytes;
+    }
+}
 
 /* set_width(int)
  *
@@ -371,215 +574,427 @@ static int  bufferSizeFrames    = 0;    /* The size of the buffer,measured in Fr
 
 static void set_width(int width)
 {
-    left_sig.width = width;
-    right_sig.width = width;
     bufferSizeFrames = width;
+    alloc_buffers();
+}
+
+static void reset(void)
+{
+    int i;
+
+    reset_sound_card();
+    alloc_buffers();
+
+    for (i = 0; i < sc_chans; i++) {
+        sc_sig[i].rate = sound_card_rate;
+        sc_sig[i].num = 0;
+        sc_sig[i].frame ++;
+        sc_sig[i].volts = alsa_volts;
+    }
+
+    trigger_start(&trig, sound_card_rate);
+
+    in_progress = 0;
+}
+
+/* Samples we'll never see break the stream, for the trigger engine and the pre-trigger history */
+
+static void lost_frames(long n)
+{
+    int i;
+
+    trigger_gap(&trig, n);
+    for (i = 0; i < sc_chans; i++) {
+        history_clear(&history[i]);
+        history_clear(&whistory[i]);
+    }
+}
+
+/* Split 'n' frames up into the channels that have somewhere to go in out[], and in a wide format,
+ * into wout[] at full resolution too
+ */
 
-    if (left_sig.data != NULL) 
-        g_free(left_sig.data);
-    if (right_sig.data != NULL) 
-        g_free(right_sig.data);
-    
-    left_sig.data = g_new0(short, width);
-    right_sig.data = g_new0(short, width);
-    
+static void deinterleave(short **out, void **wout, const char *frames, int n)
+{
 #if SC_16BIT
-    if(buffer == NULL)
-        buffer = g_new0(short, width * 2);
-    else
-        buffer = g_renew(short, buffer, width * 2);
+    switch (pcm_format) {
+    case SND_PCM_FORMAT_S24_LE:
+        deinterleave_s32(out, (int **) wout, (const int *) frames, sc_chans, n, 8);
+        break;
+    case SND_PCM_FORMAT_S32_LE:
+        deinterleave_s32(out, (int **) wout, (const int *) frames, sc_chans, n, 0);
+        break;
+    case SND_PCM_FORMAT_FLOAT_LE:
+        deinterleave_float(out, (float **) wout, (const float *) frames, sc_chans, n);
+        break;
+    default:
+        deinterleave_s16(out, (const short *) frames, sc_chans, n);
+        break;
+    }
 #else
-    if(buffer == NULL)
-        buffer = g_new0(unsigned char, width * 2);
-    else
-        buffer = g_renew(unsigned char, buffer, width * 2);
+    deinterleave_u8(out, (const unsigned char *) frames, sc_chans, n);
 #endif
 }
 
+/* Hand 'n' frames to the recorder as they came from the card: every channel, whether or not
+ * anybody is looking at it, and whether or not the frames end up on the screen
+ */
 
-/* get data from ALSA sound system, */
-/* return value is 0 when we wait for a trigger event or on error, otherwise 1 */
-/* in_progress: 0 when we start a new plot, when a plot is in progress, number of samples read. */
+static void record_frames(const char *frames, int n)
+{
+    short *out[SC_MAXCHANS];
+    void *wout[SC_MAXCHANS];
+    int k;
+
+    if (!record_active()) return;
+
+    record_staging(sc_chans, sc_format != SAMPLE_S16, out, wout);
+    for (; n > 0; n -= k, frames += (size_t) k * sc_frame_bytes) {
+        k = (n < RECORD_STEP) ? n : RECORD_STEP;
+        deinterleave(out, wout, frames, k);
+        record_samples(sc_sig[0].frame, sound_card_rate, sc_format, (1u << sc_chans) - 1, out,
+                       wout, k);
+    }
+}
 
-static int sc_get_data(void)
+/* The frames at 'offset' in the areas snd_pcm_mmap_begin() gave us.  They're interleaved, so every
+ * channel's area starts at the same address.
+ */
+
+static const char * mmap_frames(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset)
 {
-    int i, delay;
-    int rdCnt, rdMax;           /* measured in frames ! */
+    return (const char *) areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+}
 
-    if (handle == NULL) {
-        return 0;
+/* Read up to 'n' frames just to record them, and return how many we got */
+
+static snd_pcm_sframes_t record_stale(snd_pcm_sframes_t n)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, k;
+    snd_pcm_sframes_t rc, done = 0;
+
+    while (done < n) {
+        if (use_mmap) {
+            k = n - done;
+            if (snd_pcm_mmap_begin(handle, &areas, &offset, &k) < 0 || k == 0) break;
+            record_frames(mmap_frames(areas, offset), k);
+            if ((rc = snd_pcm_mmap_commit(handle, offset, k)) < 0) break;
+        } else {
+            k = (n - done < readFrames) ? n - done : readFrames;
+            if ((rc = snd_pcm_readi(handle, buffer, k)) <= 0) break;
+            record_frames(buffer, rc);
+        }
+        done += rc;
     }
+    return done;
+}
 
-    rdMax = bufferSizeFrames - in_progress;
-    if (!in_progress) {
-        /* Discard excess samples so we can keep our time snapshot close to real-time and minimize
-         * sound recording overruns.  For ESD we don't know how many are available (do we?) so we
-         * discard them all to start with a fresh buffer that hopefully won't wrap around before we
-         * get it read.
-         */
+/* Called before looking for a trigger.  Skips over the samples left after a reset, and over
+ * everything but the last screenful of samples, so that a new sweep starts close to real time and
+ * the device doesn't overrun while we catch up.  snd_pcm_forward() just moves ALSA's application
+ * pointer, so unlike reading and throwing away, no samples get copied, whatever the timebase.
+ * While we're recording, though, the backlog is read and recorded before it's skipped, so the
+ * recording doesn't have a gap in it every sweep.
+ */
+
+static void skip_stale(void)
+{
+    snd_pcm_sframes_t avail, n;
 
-        /* read until we get something smaller than a full buffer */
-        while ((rdCnt = snd_pcm_readi(handle, buffer, bufferSizeFrames)) == bufferSizeFrames)
-            ;
-    } 
-    else {
-        rdCnt = snd_pcm_readi(handle, buffer, rdMax);
+    avail = snd_pcm_avail_update(handle);
+    if (avail <= 0) {
+        return;                 /* nothing there, or an overrun the caller will recover from */
     }
 
-    if (rdCnt < 0) {
-        if (rdCnt == -EAGAIN) { /* EAGAIN means try again, i.e. no data available */
-            return 0;
-        }
-        else if (rdCnt == -EPIPE) { /* EPIPE means overrun */
-            snd_pcm_recover(handle, rdCnt, TRUE);
-            snd_pcm_readi(handle, buffer, rdMax); // flush frame buffer
-            usleep(1000);
-            return sc_get_data();
-        }
-        else {
-            snd_pcm_recover(handle, rdCnt, TRUE);
-            snd_pcm_readi(handle, buffer, rdMax); // flush frame buffer
-            usleep(1000);
-            return 0;
+    if (startup_skip > 0) {
+        n = snd_pcm_forward(handle, (avail < startup_skip) ? avail : startup_skip);
+        if (n > 0) {
+            startup_skip -= n;
+            avail -= n;
+            lost_frames(n);
+            record_gap(n);
         }
     }
 
-    if (rdCnt < 0) {
-        if (rdCnt == -EAGAIN) { /* EAGAIN means try again, i.e. not data available */
-            return 0;
-        }
-        else if (rdCnt == -EPIPE) { /* EPIPE means overrun */
-            snd_pcm_recover(handle, rdCnt, TRUE);
-            snd_pcm_readi(handle, buffer, rdMax); // flush frame buffer
-            usleep(1000);
-            return sc_get_data();
+    if (avail > bufferSizeFrames) {
+        if (record_active()) {
+            n = record_stale(avail - bufferSizeFrames);
+        } else {
+            n = snd_pcm_forward(handle, avail - bufferSizeFrames);
         }
-        else {
-            snd_pcm_recover(handle, rdCnt, TRUE);
-            snd_pcm_readi(handle, buffer, rdMax); // flush frame buffer
-            usleep(1000);
-            return 0;
+        if (n > 0) {
+            skipped_frames += n;
+            lost_frames(n);
         }
     }
-    i = 0;
+}
+
+/* Look for the trigger (if we're not in the middle of a sweep) and copy samples from 'count'
+ * interleaved frames into the Signal arrays.  'frames' is either our own read buffer or, when the
+ * device is mmap'ed, the DMA area itself.  Returns 0 if we're still waiting for a trigger,
+ * otherwise 1, and sets '*used' to the number of frames we're done with.  Every frame we use goes
+ * past the trigger engine, which is what lets it find a trigger right at the start of a read.
+ *
+ * If the user wants to see what happened before the trigger, the frames also go into the history
+ * rings, while we look for the trigger and while we capture, and a sweep starts with the last 'pre'
+ * samples from there.  A trigger that comes before we have that many is passed over.
+ */
+
+static int process_frames(const char *frames, int count, int *used)
+{
+    short *out[SC_MAXCHANS];
+    void *wout[SC_MAXCHANS];
+    int capturing[SC_MAXCHANS];
+    int wide = (sc_format != SAMPLE_S16);
+    int c, i = 0, n, delay = 0;
+    int pre, start = 0, base = 0, k = 0;
+
+    if (count > bufferSizeFrames) {
+        count = bufferSizeFrames;
+    }
+    *used = count;
+
+    for (c = 0; c < sc_chans; c++) {
+        capturing[c] = (sc_sig[c].listeners > 0) || (trigmode && c == trigch);
+    }
+
     if (!in_progress) {
-        int trigger, val, prev, k;
-#if SC_16BIT
-    trigger = (triglev - 127) * 256;
-#else
-    trigger = (triglev - 0);
-#endif
-        if (trigmode == 1) {
-            /* locate rising edges. Try to handle handle noise by looking at the next 10 values.
-             * Might miss a trigger point close to the right edge of the screen
+        if (trigmode) {
+            /* Convert frames[base..base+k) to shorts, so the trigger engine can look at them, a
+             * step at a time.  The sweep is converted straight from 'frames' once we've found the
+             * trigger.
              */
-#if SC_16BIT
-            prev = SHRT_MAX;
-#else
-            prev = UCHAR_MAX;
-#endif
-            for (i = 0; i < rdCnt; i++) {
-                val = buffer[2*i + trigch];
-                if (val > trigger && prev <= trigger){
-                    int rising = 0;
-                    for(k = i + 1; k < i + 11 && k < rdCnt; k++) {
-                        if(buffer[2*k + trigch] > val){
-                            rising++;
-                        }
-                    }
-                    if(rising > 5){
-                        break;
-                    }
+            pre = pretrigger_samples(bufferSizeFrames);
+            for (c = 0; c < sc_chans; c++) {
+                out[c] = capturing[c] ? scratch[c] : NULL;
+                wout[c] = (capturing[c] && wide) ? wscratch[c] : NULL;
+                if (capturing[c]) {
+                    history_reserve(&history[c], pre, sizeof(short));
+                }
+                if (wout[c] != NULL) {
+                    history_reserve(&whistory[c], pre, WIDE_SIZE);
                 }
-                prev = val;
             }
-        }
-        else if(trigmode == 2) {
-            /* same for falling edges */
-            prev = 0;
-#if SC_16BIT
-            prev = SHRT_MIN;
-#else
-            prev = 0;
-#endif
-            for (i = 0; i < rdCnt; i++) {
-                val = buffer[2*i + trigch];
-                if (val < trigger && prev >= trigger){
-                    int falling = 0;
-                    for(k = i + 1; k < i + 11 && k < rdCnt; k++) {
-                        if(buffer[2*k + trigch] < val){
-                            falling++;
+
+            for (;;) {
+                if (i == base + k) {
+                    if (i >= count) {  /* haven't triggered within the screen */
+                        return 0;      /* give up */
+                    }
+                    base = i;
+                    k = (count - base < TRIGGER_STEP) ? count - base : TRIGGER_STEP;
+                    deinterleave(out, wout, frames + (size_t) base * sc_frame_bytes, k);
+                }
+                i += trigger_find(&trig, scratch[trigch] + i - base, base + k - i, &delay);
+                if (pre > 0) {
+                    for (c = 0; c < sc_chans; c++) {
+                        if (capturing[c]) {
+                            history_push(&history[c], scratch[c] + start - base, i - start);
+                        }
+                        if (wout[c] != NULL) {
+                            history_push(&whistory[c],
+                                         (char *) wout[c] + (start - base) * WIDE_SIZE, i - start);
                         }
                     }
-                    if(falling > 5){
+                    start = i;
+                }
+                if (i < base + k) {
+                    if (history[trigch].fill >= pre) {
                         break;
                     }
+                    trigger_skip(&trig, scratch[trigch] + i - base, 1);
+                    i ++;
+                }
+            }
+
+            for (c = 0; c < sc_chans; c++) {
+                if (capturing[c]) {
+                    history_copy(&history[c], sc_sig[c].data, pre);
+                }
+                if (wout[c] != NULL) {
+                    history_copy(&whistory[c], sc_sig[c].wide, pre);
                 }
-                prev = val;
             }
+            in_progress = pre;
         }
 
-        if (i >= rdCnt) {  /* haven't triggered within the screen */
-             return 0;     /* give up */
+        for (c = 0; c < sc_chans; c++) {
+            sc_sig[c].delay = delay;
+            sc_sig[c].frame ++;
         }
 
-        /* The delay value calculated here is only used in on_databox_button_press_event()
-         * But it seems on_databox_button_press_event() isn't associated with anything.
-         * Most likely it was used in the now defunct code for "cursors"
-         */
-        delay = 0;
+        sweep_skipped = skipped_frames;
+        skipped_frames = 0;
+    }
 
-#if SC_16BIT
-        left_sig.data[0] = buffer[2*i];
-#else
-        left_sig.data[0] = buffer[2*i] - 127;
-#endif
-        left_sig.delay = delay;
-        left_sig.num = 1;
-        left_sig.frame ++;
+    /* Copy as much as we have, up to a full screen */
 
-#if SC_16BIT
-        right_sig.data[0] = buffer[2*i + 1];
-#else
-        right_sig.data[0] = buffer[2*i + 1] - 127;
-#endif
-        right_sig.delay = delay;
-        right_sig.num = 1;
-        right_sig.frame ++;
+    n = count - i;
+    if (n > bufferSizeFrames - in_progress) {
+        n = bufferSizeFrames - in_progress;
+    }
+
+    for (c = 0; c < sc_chans; c++) {
+        out[c] = capturing[c] ? sc_sig[c].data + in_progress : NULL;
+        wout[c] = (capturing[c] && wide) ? (char *) sc_sig[c].wide + in_progress * WIDE_SIZE : NULL;
+    }
+    deinterleave(out, wout, frames + (size_t) i * sc_frame_bytes, n);
+
+    if (trigmode) {
+        trigger_skip(&trig, sc_sig[trigch].data + in_progress, n);
+        if (scope.trigpos > 0) {
+            for (c = 0; c < sc_chans; c++) {
+                if (capturing[c]) {
+                    history_push(&history[c], out[c], n);
+                }
+                if (wout[c] != NULL) {
+                    history_push(&whistory[c], wout[c], n);
+                }
+            }
+        }
+    }
+
+    in_progress += n;
+    i += n;
+
+    for (c = 0; c < sc_chans; c++) {
+        sc_sig[c].num = in_progress;
+    }
+
+    if (in_progress >= bufferSizeFrames) { // enough samples for a screen
+        in_progress = 0;
+    }
+    *used = i;
+
+    return 1;
+}
+
+/* Recover from an overrun (or suspend) while mmap'ed.  Unlike snd_pcm_readi(), the mmap functions
+ * never start a capture stream, so we have to restart it ourselves.
+ */
+
+static void mmap_recover(int err)
+{
+    if (snd_pcm_recover(handle, err, TRUE) == 0) {
+        snd_pcm_start(handle);
+    }
+}
+
+/* The mmap version of sc_get_data().  snd_pcm_mmap_begin() hands us the available part of the DMA
+ * ring up to its end, so we may have to go around twice.  After each piece we commit just the
+ * frames we're done with, leaving whatever follows a completed sweep for the next one.
+ */
+
+static int sc_get_data_mmap(void)
+{
+    const snd_pcm_channel_area_t *areas;
+    const char *frames;
+    snd_pcm_uframes_t offset, n;
+    snd_pcm_sframes_t avail, rc;
+    int ret = 0;
+    int used;
+
+    if (!in_progress) {
+        skip_stale();
+    }
 
-        i ++;
-        in_progress = 1;
+    avail = snd_pcm_avail_update(handle);
+    if (avail < 0) {
+        mmap_recover(avail);
+        return 0;
     }
 
-    while (i < rdCnt) {
-        if (in_progress >= left_sig.width) { // enough samples for a screen
+    while (avail > 0) {
+        n = avail;
+        if ((rc = snd_pcm_mmap_begin(handle, &areas, &offset, &n)) < 0) {
+            mmap_recover(rc);
             break;
         }
-#if SC_16BIT
-        left_sig.data[in_progress] = buffer[2*i];
-        right_sig.data[in_progress] = buffer[2*i + 1];
-#else
-        left_sig.data[in_progress] = buffer[2*i] - 127;
-        right_sig.data[in_progress] = buffer[2*i + 1] - 127;
-#endif
 
-        in_progress ++;
-        i++;
+        frames = mmap_frames(areas, offset);
+
+        ret |= process_frames(frames, n, &used);
+        record_frames(frames, used);
+
+        if ((rc = snd_pcm_mmap_commit(handle, offset, used)) < 0) {
+            mmap_recover(rc);
+            break;
+        }
+        if (ret && !in_progress) {      /* sweep complete; get_data() must return now */
+            break;
+        }
+        avail -= used;
     }
 
-    left_sig.num = in_progress;
-    right_sig.num = in_progress;
+    return ret;
+}
 
-    if (in_progress >= left_sig.width) { // enough samples for a screen
-        in_progress = 0;
+/* get data from ALSA sound system, */
+/* return value is 0 when we wait for a trigger event or on error, otherwise 1 */
+/* in_progress: 0 when we start a new plot, when a plot is in progress, number of samples read. */
+
+static int sc_get_data(void)
+{
+    int rdCnt, rdMax;           /* measured in frames ! */
+    int used, ret;
+
+    if (handle == NULL) {
+        return 0;
     }
-    return 1;
+
+    if (use_mmap) {
+        return sc_get_data_mmap();
+    }
+
+    rdMax = bufferSizeFrames - in_progress;
+    if (!in_progress) {
+        /* Discard excess samples so we can keep our time snapshot close to real-time and minimize
+         * sound recording overruns.
+         */
+        skip_stale();
+
+        /* A sweep that starts with pre-trigger samples from the history needs that many fewer
+         * from this read, and anything we read but don't use would be lost
+         */
+        if (trigmode) {
+            rdMax -= pretrigger_samples(bufferSizeFrames);
+        }
+    }
+    if (rdMax > readFrames) {
+        rdMax = readFrames;
+    }
+
+    rdCnt = snd_pcm_readi(handle, buffer, rdMax);
+
+    if (rdCnt < 0) {
+        if (rdCnt == -EAGAIN) { /* EAGAIN means try again, i.e. no data available */
+            return 0;
+        }
+        else if (rdCnt == -EPIPE) { /* EPIPE means overrun */
+            snd_pcm_recover(handle, rdCnt, TRUE);
+            usleep(1000);
+            return sc_get_data();
+        }
+        else {
+            snd_pcm_recover(handle, rdCnt, TRUE);
+            usleep(1000);
+            return 0;
+        }
+    }
+
+    /* Everything we read gets recorded, even if the sweep doesn't need all of it */
+
+    ret = process_frames(buffer, rdCnt, &used);
+    record_frames(buffer, rdCnt);
+    return ret;
 }
 
 static const char * snd_status_str(int i)
 {
-#ifdef DEBUG
     static char string[16];
+
+#ifdef DEBUG
     sprintf(string, "status %d", i);
     return string;
 #endif
@@ -588,6 +1003,14 @@ static const char * snd_status_str(int i)
     case 0:
         return alsaDevice;
 
+    case 3:
+        if (sweep_skipped > 0) {
+            snprintf(string, sizeof(string), "%ld skipped", sweep_skipped);
+            return string;
+        } else {
+            return "";
+        }
+
     case 2:
         if (snd_errormsg1){
             return snd_errormsg1;
@@ -595,6 +1018,13 @@ static const char * snd_status_str(int i)
             return "";
         }
 
+    case 1:
+        if (handle != NULL && sc_format != SAMPLE_S16) {
+            return snd_pcm_format_name(pcm_format);
+        } else {
+            return "";
+        }
+
     case 4:
         if (snd_errormsg2) {
             return snd_errormsg2;
@@ -625,8 +1055,24 @@ static char * option2str_sc(void)
 
 static int sc_set_option(char *option)
 {
+#if SC_16BIT
+    int i;
+
+    if (strncmp(option, "format=", 7) == 0) {
+        for (i = 0; i < NSC_FORMATS; i++) {
+            if (strcmp(option + 7, sc_formats[i].name) == 0) {
+                sc_want_format = i;
+                return 1;
+            }
+        }
+        return 0;
+    }
+#endif
+
     if (sscanf(option, "rate=%d", &sound_card_rate) == 1) {
         return 1;
+    } else if (sscanf(option, "channels=%d", &sc_want_chans) == 1) {
+        return 1;
     } else if (strcmp(option, "dma=") == 0) {
         /* a deprecated option, return 1 so we don't indicate error */
         return 1;
@@ -644,6 +1090,24 @@ static char * sc_save_option(int i)
         snprintf(buf, sizeof(buf), "rate=%d", sound_card_rate);
         return buf;
 
+    case 1:
+        if (sc_want_chans > 0) {
+            snprintf(buf, sizeof(buf), "channels=%d", sc_want_chans);
+        } else {
+            buf[0] = '\0';
+        }
+        return buf;
+
+#if SC_16BIT
+    case 2:
+        if (sc_want_format > 0) {
+            snprintf(buf, sizeof(buf), "format=%s", sc_formats[sc_want_format].name);
+        } else {
+            buf[0] = '\0';
+        }
+        return buf;
+#endif
+
     default:
         return NULL;
     }
@@ -658,7 +1122,7 @@ DataSrc datasrc_sc = {
     change_rate,
     set_width,
     reset,
-    fd, //should be REALY unused....
+    fd, /* unused, see sc_poll_fds() */
     sc_get_data,
     snd_status_str,
 #ifdef DEBUG
@@ -674,6 +1138,8 @@ DataSrc datasrc_sc = {
 #endif
     sc_set_option,
     sc_save_option,
-    NULL  /* gtk_options */
+    NULL, /* gtk_options */
+    sc_poll_fds,
+    sc_poll_revents,
 };
 
@@ -0,0 +1,140 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the bit-planes that digital channels are drawn from
+ *
+ * In logic analyzer mode, every bit of a channel is a trace of its own.  Pulling the bits out of
+ * the samples one at a time, and then drawing a point for every sample of every bit, costs 16
+ * passes over the sweep and memory for 16 copies of it, even though most digital signals sit still
+ * most of the time.  Instead, the samples are transposed into bit-planes, 32 samples of a bit to a
+ * word, and each bit's trace only gets points either side of where it changes.  Finding those is a
+ * shift and an exclusive or a word at a time, and a count of trailing zeros for each edge, so the
+ * work after the transpose goes with the number of edges, not samples.
+ *
+ * The SSE2 transpose takes 16 samples, splits them into a vector of low bytes and one of high
+ * bytes, and then gets each bit of all 16 with a movemask of the top bits and an add (a shift left
+ * by one) to bring up the next.  Which kernel is used is decided at runtime, as in convert.c.
+ */
+
+#include <string.h>
+#include "bitplane.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+static void (* pack)(guint32 *planes, int words, const short *data, int from, int to) = NULL;
+
+/* Plain C version; we go through the set bits of each sample rather than all 16 of them */
+
+static void pack_scalar(guint32 *planes, int words, const short *data, int from, int to)
+{
+    guint32 w[16];
+    unsigned int v;
+    int i, k, b, n;
+
+    for (k = from / 32; k * 32 < to; k++) {
+        memset(w, 0, sizeof(w));
+        n = (to - k * 32 < 32) ? to - k * 32 : 32;
+        for (i = 0; i < n; i++) {
+            v = (unsigned short) data[k * 32 + i];
+            while (v) {
+                b = __builtin_ctz(v);
+                w[b] |= 1u << i;
+                v &= v - 1;
+            }
+        }
+        for (b = 0; b < 16; b++) {
+            planes[b * words + k] = w[b];
+        }
+    }
+}
+
+#ifdef X86_KERNELS
+
+/* Transpose a vector of 16 bytes: bit j of masks[b] is bit b of byte j */
+
+#define TRANSPOSE_SSE2(bytes, masks)                    \
+    do {                                                \
+        __m128i t = (bytes);                            \
+        int b_;                                         \
+        for (b_ = 7; b_ >= 0; b_--) {                   \
+            (masks)[b_] = _mm_movemask_epi8(t);         \
+            t = _mm_add_epi8(t, t);                     \
+        }                                               \
+    } while (0)
+
+__attribute__ ((target("sse2")))
+static void pack_sse2(guint32 *planes, int words, const short *data, int from, int to)
+{
+    const __m128i low = _mm_set1_epi16(0xff);
+    unsigned int lo[2][8], hi[2][8];
+    __m128i a, b;
+    int k, h, bit;
+
+    for (k = from / 32; k * 32 + 32 <= to; k++) {
+        for (h = 0; h < 2; h++) {
+            a = _mm_loadu_si128((const __m128i *) (data + k * 32 + h * 16));
+            b = _mm_loadu_si128((const __m128i *) (data + k * 32 + h * 16 + 8));
+            TRANSPOSE_SSE2(_mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)), lo[h]);
+            TRANSPOSE_SSE2(_mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)), hi[h]);
+        }
+        for (bit = 0; bit < 8; bit++) {
+            planes[bit * words + k] = lo[0][bit] | (lo[1][bit] << 16);
+            planes[(bit + 8) * words + k] = hi[0][bit] | (hi[1][bit] << 16);
+        }
+    }
+    if (k * 32 < to) {
+        pack_scalar(planes, words, data, k * 32, to);
+    }
+}
+
+#endif /* X86_KERNELS */
+
+static void select_kernels(void)
+{
+    void (* best)(guint32 *, int, const short *, int, int) = pack_scalar;
+
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        best = pack_sse2;
+    }
+#endif
+    pack = best;
+}
+
+void bitplane_pack(guint32 *planes, int words, const short *data, int from, int to)
+{
+    if (pack == NULL) select_kernels();
+
+    if (to > from) {
+        pack(planes, words, data, from, to);
+    }
+}
+
+int bitplane_edges(const guint32 *plane, int from, int to, int *edges, int max)
+{
+    guint32 w, diff;
+    int k, n = 0;
+
+    if (from < 1) from = 1;
+
+    for (k = from / 32; k * 32 < to && n < max; k++) {
+        w = plane[k];
+        diff = w ^ ((w << 1) | ((k > 0) ? plane[k - 1] >> 31 : (w & 1)));
+        if (k * 32 < from) {
+            diff &= ~0u << (from - k * 32);
+        }
+        if (to - k * 32 < 32) {
+            diff &= (1u << (to - k * 32)) - 1;
+        }
+        while (diff && n < max) {
+            edges[n++] = k * 32 + __builtin_ctz(diff);
+            diff &= diff - 1;
+        }
+    }
+    return n;
+}
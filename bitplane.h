@@ -0,0 +1,26 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * bit-plane routines available outside of bitplane.c
+ *
+ */
+
+#include <glib.h>
+
+/* A logic analyzer channel's samples, one bit at a time.  Plane b is planes[b * words] through
+ * planes[b * words + words - 1], and bit i of its word k is bit b of sample 32 * k + i.  All 16
+ * planes are always there.
+ */
+
+/* Pack samples data[from..to) into 'planes', which has 'words' words per plane.  'from' has to be
+ * a multiple of 32; the words the samples fall in are rewritten, and the bits in them past 'to' are
+ * zero.
+ */
+void            bitplane_pack(guint32 *planes, int words, const short *data, int from, int to);
+
+/* Find where one plane changes between samples from and to: sample i is an edge if its bit isn't
+ * the same as sample i-1's.  Writes up to 'max' of them to edges[], in order, and returns how many
+ * there were; if that's 'max', there may be more after the last one.
+ */
+int             bitplane_edges(const guint32 *plane, int from, int to, int *edges, int max);
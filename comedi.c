@@ -24,9 +24,13 @@
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
 #include <comedilib.h>
 #include "xoscope.h"            /* program defaults */
 #include "func.h"
+#include "trigger.h"
+#include "convert.h"
+#include "record.h"
 
 #define COMEDI_RANGE 0          /* XXX user should set this */
 
@@ -54,16 +58,57 @@ int comedi_subdevice = 0;
 
 int comedi_rate = 50000;        /* XXX set this to max valid upon open */
 
-/* Size of COMEDI's kernel buffer.  -1 means leave it at the default.  Slight bug - if you change
- * it, then change it back to -1, the default setting won't return until you close and re-open the
- * device.  Actually, that might not be good enough - you might need to re-configure the device.
+/* Size of COMEDI's kernel buffer.  -1 means size it automatically (see auto_bufsize()).  Slight
+ * bug - if you change it, then change it back to -1, the buffer won't shrink until you close and
+ * re-open the device.  Actually, that might not be good enough - you might need to re-configure the
+ * device.
  */
 
 int comedi_bufsize = -1;
 
+/* Automatic buffer sizing.  The buffer holds BUF_MS milliseconds of samples, or four times the
+ * longest we've gone between get_data() calls while the scope was running, whichever is more,
+ * times auto_factor, which doubles after every overrun that happens while it's running.  It only
+ * ever grows.
+ */
+
+#define BUF_MS 250
+#define MAX_AUTO_FACTOR 64
+
+static int auto_factor = 1;
+static int worst_gap = 0;               /* microseconds between get_data() calls */
+static struct timeval prev_call;        /* ...cleared when the next call may come after a pause */
+static int timed = 0;                   /* this call came a timed gap after the last one */
+
+/* Telemetry for status_str(): overruns, bytes taken from the device, and the fullest we've seen
+ * the kernel buffer, all since the device was opened.
+ */
+
+static int overruns = 0;
+static long long bytes_total = 0;
+static int worst_backlog = 0;           /* percent */
+
+/* BUFSZ samples, as read from the device.  They're sampl_t's, except on subdevices with
+ * SDF_LSAMPL, which have lsampl_t's.  If those have more than 16 bits, the short view of a sample
+ * (Signal.data) drops the lowest 'sample_shift' bits, and the whole thing goes into Signal.wide as
+ * SAMPLE_S32.
+ */
+
 #define BUFSZ 1024
-static sampl_t buf[BUFSZ];
+static lsampl_t buf[BUFSZ];
 static int bufvalid=0;
+static int sample_size = sizeof(sampl_t);
+static int sample_shift = 0;
+static int sample_format = SAMPLE_S16;
+
+/* COMEDI's kernel buffer, mapped read-only, so that get_data() can take the samples from where the
+ * driver put them instead of copying them through buf.  NULL when it isn't mapped (the mmap=off
+ * option, or the mmap failed), and then we read() into buf instead.
+ */
+
+int comedi_mmap = 1;
+static const char *comedi_map = NULL;
+static int comedi_map_size = 0;
 
 // has to be set later
 int zero_value = -1;
@@ -93,6 +138,12 @@ static struct capture *capture_list = NULL;
 
 static int active_channels=0;
 
+/* The same list, flattened for get_data(): scan_chan[j] is the channel of the j'th sample of each
+ * scan.  reset() builds both.
+ */
+
+static int scan_chan[NCHANS];
+
 static Signal comedi_chans[NCHANS];
 
 /* Triggering information - the (one) channel we're triggering on, the sample level, the type of
@@ -104,6 +155,9 @@ static int trig_chan = 0;
 static int trig_level = 0;
 static int trig_mode = 0;
 static int trig_index = -1;
+static Trigger trig;
+static History history[NCHANS];         /* pre-trigger samples, if scope.trigpos asks for them */
+static History whistory[NCHANS];        /* ...and their wide versions */
 
 /* This function is defined as do-nothing and weak, meaning it can be overridden by the linker
  * without error.  It's used to start the X Windows GTK options dialog for COMEDI, and is defined in
@@ -115,6 +169,52 @@ static int trig_index = -1;
 void comedi_gtk_options() __attribute__ ((weak));
 void comedi_gtk_options() {}
 
+/* The buffer size to ask for when comedi_bufsize is -1 (automatic), in bytes */
+
+static int auto_bufsize(void)
+{
+    double bytes_per_sec = (double) comedi_rate * active_channels * sample_size;
+    double secs = BUF_MS / 1000.0;
+    double size;
+    int max = comedi_get_max_buffer_size(comedi_dev, comedi_subdevice);
+
+    if (secs < 4 * worst_gap / 1e6) secs = 4 * worst_gap / 1e6;
+    size = bytes_per_sec * secs * auto_factor;
+    if (max > 0 && size > max) size = max;
+
+    return size;
+}
+
+/* Let go of the mapping of the COMEDI buffer, if we have one */
+
+static void unmap_buffer(void)
+{
+    if (comedi_map != NULL) {
+        munmap((void *) comedi_map, comedi_map_size);
+        comedi_map = NULL;
+    }
+}
+
+/* The mapping is of the device's read subdevice, so it's no good if we're capturing from another */
+
+static void map_buffer(void)
+{
+    void *map;
+
+    unmap_buffer();
+    if (!comedi_mmap || comedi_get_read_subdevice(comedi_dev) != comedi_subdevice) return;
+
+    comedi_map_size = comedi_get_buffer_size(comedi_dev, comedi_subdevice);
+    if (comedi_map_size <= 0) return;
+
+    map = mmap(NULL, comedi_map_size, PROT_READ, MAP_SHARED, comedi_fileno(comedi_dev), 0);
+    if (map == MAP_FAILED) {
+        perror("comedi mmap");
+        return;
+    }
+    comedi_map = map;
+}
+
 /* This function gets called at various points that we need to stop and restart COMEDI, like a rate
  * change, or a change to the list of channels we're capturing for.  start_comedi_running() gets
  * called automatically by get_data(), so we can use stop_comedi_running() pretty liberally.
@@ -126,6 +226,7 @@ static void stop_comedi_running(void)
         comedi_cancel(comedi_dev, 0);
         comedi_running = 0;
     }
+    unmap_buffer();
     bufvalid = 0;
 }
 
@@ -141,7 +242,8 @@ static int start_comedi_running(void)
     unsigned int chanlist[NCHANS];
     struct capture *capture;
     comedi_range *comedi_rng;
-    int maxdata;
+    lsampl_t maxdata;
+    int bits;
 
     if (!comedi_dev) return 0;
 
@@ -157,22 +259,46 @@ static int start_comedi_running(void)
     subdevice_flags = comedi_get_subdevice_flags(comedi_dev, comedi_subdevice);
     subdevice_type = comedi_get_subdevice_type(comedi_dev, comedi_subdevice);
 
+    sample_size = (subdevice_flags & SDF_LSAMPL) ? sizeof(lsampl_t) : sizeof(sampl_t);
+    sample_shift = 0;
+    sample_format = SAMPLE_S16;
+    if ((subdevice_flags & SDF_LSAMPL) && (subdevice_type == COMEDI_SUBD_AI)) {
+        maxdata = comedi_get_maxdata(comedi_dev, comedi_subdevice, 0);
+        for (bits = 0; bits < 32 && (maxdata >> bits) != 0; bits++);
+        if (bits > 16) {
+            sample_shift = bits - 16;
+            sample_format = SAMPLE_S32;
+        }
+    }
+
     if (active_channels == 0) return 0;
 
-    if ((comedi_bufsize > 0) && (comedi_get_version_code(comedi_dev) > 0x0748)) {
-        /* comedi versions pre-0.7.73 have a bug in their buffer size handling.  Not only does it
-         * fail to round up to a multiple of PAGE_SIZE correctly, but if you attempt to set a buffer
-         * smaller than PAGE_SIZE, it will deallocate the buffer and you'll never get it back
-         * without re-configuring the device.  I used to round up to PAGE_SIZE here to avoid the
-         * bug, but that requires <asm/page.h> to be present on the system.  Easier is to just skip
-         * setting buffer size on pre-0.7.73 comedi.
-         */
-        ret = comedi_set_buffer_size(comedi_dev, comedi_subdevice, comedi_bufsize);
-        if (ret < 0) {
-            comedi_error = comedi_errno();
-            return ret;
+    /* COMEDI won't resize a buffer that's mapped */
+
+    unmap_buffer();
+
+    /* comedi versions pre-0.7.73 have a bug in their buffer size handling.  Not only does it fail
+     * to round up to a multiple of PAGE_SIZE correctly, but if you attempt to set a buffer smaller
+     * than PAGE_SIZE, it will deallocate the buffer and you'll never get it back without
+     * re-configuring the device.  I used to round up to PAGE_SIZE here to avoid the bug, but that
+     * requires <asm/page.h> to be present on the system.  Easier is to just skip setting buffer
+     * size on pre-0.7.73 comedi.
+     *
+     * A failure to grow the buffer automatically isn't an error; we just carry on with what we have.
+     */
+
+    if (comedi_get_version_code(comedi_dev) > 0x0748) {
+        if (comedi_bufsize > 0) {
+            ret = comedi_set_buffer_size(comedi_dev, comedi_subdevice, comedi_bufsize);
+            if (ret < 0) {
+                comedi_error = comedi_errno();
+                return ret;
+            }
+        } else if (auto_bufsize() > comedi_get_buffer_size(comedi_dev, comedi_subdevice)) {
+            comedi_set_buffer_size(comedi_dev, comedi_subdevice, auto_bufsize());
         }
     }
+    timerclear(&prev_call);
 
     /* Now we build a COMEDI command structure */
 
@@ -316,7 +442,8 @@ static int start_comedi_running(void)
      * voltage range given by COMEDI, multiply by 1000 (volts -> millivolts), divide by 2^(sampl_t
      * bits) (sample values in an sampl_t), to get millivolts per sample value, and multiply by 320
      * to get millivolts per 320 sample values.  320 is the size of the vertical display area, in
-     * case you wondered.
+     * case you wondered.  With more than 16 bits, a sample value in Signal.data is 2^sample_shift
+     * of the device's.
      *
      * Also, set the rate (samples/sec) at which we'll capture data
      */
@@ -334,7 +461,7 @@ static int start_comedi_running(void)
             if (comedi_rng != NULL) {
                 capture->signal->volts
                     = (comedi_rng->max - comedi_rng->min)
-                    * 1000 * 320 / maxdata;
+                    * 1000 * 320 / maxdata * (1 << sample_shift);
             }
 
             if (zero_value<0) {
@@ -364,6 +491,20 @@ static int start_comedi_running(void)
         }
 
         capture->signal->rate = comedi_rate;
+
+        capture->signal->format = sample_format;
+        if (sample_format != SAMPLE_S16) {
+            capture->signal->wide = g_realloc(capture->signal->wide,
+                                              (size_t) capture->signal->width * WIDE_SIZE);
+            history_resize(&whistory[capture->chan], pretrigger_samples(capture->signal->width),
+                           WIDE_SIZE);
+        }
+    }
+
+    trigger_start(&trig, comedi_rate);
+    for (capture = capture_list; capture != NULL; capture = capture->next) {
+        history_clear(&history[capture->chan]);
+        history_clear(&whistory[capture->chan]);
     }
 
 #if 0
@@ -375,6 +516,7 @@ static int start_comedi_running(void)
     if (ret >= 0) {
         fcntl(comedi_fileno(comedi_dev), F_SETFL, O_NONBLOCK);
         comedi_running = 1;
+        map_buffer();
     } else {
         comedi_error = comedi_errno();
     }
@@ -387,6 +529,7 @@ static void close_comedi()
     struct capture *capture;
 #endif
 
+    unmap_buffer();
     if (comedi_dev) comedi_close(comedi_dev);
     comedi_dev = NULL;
     if (comedi_board_name) g_free(comedi_board_name);
@@ -417,6 +560,11 @@ static int open_comedi(void)
     close_comedi();
     comedi_error = 0;
     comedi_opened = 1;
+    overruns = 0;
+    bytes_total = 0;
+    worst_backlog = 0;
+    worst_gap = 0;
+    auto_factor = 1;
     subdevice_flags = 0;
     subdevice_type = COMEDI_SUBD_UNUSED;
 
@@ -502,7 +650,7 @@ static int open_comedi(void)
                     }
                     if (i == (100 * sizeof(sampl_t))) {
                         zero_value = 0;
-                        for (i=0; i<100; i++) zero_value += buf[i];
+                        for (i=0; i<100; i++) zero_value += ((sampl_t *) buf)[i];
                         zero_value /= 100;
                     }
                 }
@@ -617,7 +765,7 @@ static void reset(void)
 
             if ((trig_mode > 0) && (trig_chan == i)) trig_index = active_channels;
 
-            active_channels ++;
+            scan_chan[active_channels ++] = i;
         }
     }
 
@@ -635,12 +783,14 @@ static int set_trigger(int chan, int *levelp, int mode)
     trig_level = *levelp;
     trig_mode = mode;
     /* XXX check that trig_level is within subdevice's range */
+    trigger_set(&trig, mode, trig_level, scope.trighyst);
     return 1;
 }
 
 static void clear_trigger(void)
 {
     trig_mode = 0;
+    trigger_set(&trig, 0, 0, 0);
 }
 
 /* Current COMEDI rate logic has some bizarre effects.  As we increase the number of channels
@@ -678,6 +828,7 @@ static void set_width(int width)
         comedi_chans[i].width = width;
         if (comedi_chans[i].data != NULL) free(comedi_chans[i].data);
         comedi_chans[i].data = malloc(width * sizeof(short));
+        history_resize(&history[i], pretrigger_samples(width), sizeof(short));
     }
 }
 
@@ -690,184 +841,393 @@ static void set_width(int width)
 
 #define convert(sample) (sample - zero_value)
 
-static int get_data(void)
+/* lsampl_t's, wrapped around to signed ints */
+#define lconvert(sample) ((int) (sample - zero_value))
+
+/* Channel j of scans [from, to) at src, converted to shorts.  src is either buf or COMEDI's own
+ * mmap'ed buffer.  There's a loop for each sample size, so that it only gets looked at once.
+ */
+
+static void column(short *out, const void *src, int from, int to, int j)
 {
-    int bytes_read;
-    int samples_read;
-    int scans_read;
-    int samples_per_frame;
-    sampl_t *current_scan, *last_scan;
-    int i, j;
-    int delay;
-    int triggered=0;
-    int was_in_sweep=in_progress;
-    static struct timeval tv1, tv2;
-    struct capture *capture;
+    const sampl_t *s = (const sampl_t *) src + from * active_channels + j;
+    const lsampl_t *l = (const lsampl_t *) src + from * active_channels + j;
+    int k;
 
-    /* This code used to try and start COMEDI running if it wasn't running already.  But if fd()
-     * already returned -1, the main code doesn't think we're running, so it's best to leave things
-     * alone here...
-     */
+    if (sample_size == sizeof(sampl_t)) {
+        for (k = 0; k < to - from; k++, s += active_channels) {
+            out[k] = convert(*s);
+        }
+    } else {
+        for (k = 0; k < to - from; k++, l += active_channels) {
+            out[k] = lconvert(*l) >> sample_shift;
+        }
+    }
+}
 
-    if (! comedi_dev || ! comedi_running) return 0;
+/* ...and at full resolution, for SAMPLE_S32 */
+
+static void wide_column(int *out, const void *src, int from, int to, int j)
+{
+    const lsampl_t *l = (const lsampl_t *) src + from * active_channels + j;
+    int k;
+
+    for (k = 0; k < to - from; k++, l += active_channels) {
+        out[k] = (int) ((unsigned int) lconvert(*l) << (16 - sample_shift));
+    }
+}
+
+/* Push scans [from, to) at src into the pre-trigger history of the channels we're capturing */
+
+static void push_history(const void *src, int from, int to)
+{
+    static short col[BUFSZ];
+    static int wcol[BUFSZ];
+    int j;
+
+    for (j = 0; j < active_channels; j++) {
+        column(col, src, from, to, j);
+        history_push(&history[scan_chan[j]], col, to - from);
+        if (sample_format != SAMPLE_S16) {
+            wide_column(wcol, src, from, to, j);
+            history_push(&whistory[scan_chan[j]], wcol, to - from);
+        }
+    }
+}
+
+/* Hand the 'nscans' scans at src to the recorder, all of them, whether they end up in a sweep or
+ * not
+ */
+
+static void record_scans(const void *src, int nscans)
+{
+    short *out[NCHANS];
+    void *wout[NCHANS];
+    unsigned int chans = 0;
+    int from, to, j;
+
+    if (!record_active() || active_channels == 0) return;
+
+    record_staging(NCHANS, sample_format != SAMPLE_S16, out, wout);
+    for (j = 0; j < active_channels; j++) {
+        chans |= 1u << scan_chan[j];
+    }
+
+    for (from = 0; from < nscans; from = to) {
+        to = (nscans - from < RECORD_STEP) ? nscans : from + RECORD_STEP;
+        for (j = 0; j < active_channels; j++) {
+            column(out[scan_chan[j]], src, from, to, j);
+            if (sample_format != SAMPLE_S16) {
+                wide_column(wout[scan_chan[j]], src, from, to, j);
+            }
+        }
+        record_samples(comedi_chans[scan_chan[0]].frame, comedi_rate, sample_format, chans, out,
+                       wout, to - from);
+    }
+}
+
+/* Append scans [from, to) at src to the sweep.  sampl_t's are the common case, and get split up and
+ * converted a block at a time by deinterleave_u16().
+ */
+
+static void demux(const void *src, int from, int to)
+{
+    short *out[NCHANS];
+    Signal *sig;
+    int j;
+
+    if (sample_size == sizeof(sampl_t)) {
+        for (j = 0; j < active_channels; j++) {
+            out[j] = comedi_chans[scan_chan[j]].data + comedi_chans[scan_chan[j]].num;
+        }
+        deinterleave_u16(out, (const unsigned short *) src + from * active_channels,
+                         active_channels, to - from, zero_value);
+    } else {
+        for (j = 0; j < active_channels; j++) {
+            sig = &comedi_chans[scan_chan[j]];
+            column(sig->data + sig->num, src, from, to, j);
+            if (sample_format != SAMPLE_S16) {
+                wide_column((int *) sig->wide + sig->num, src, from, to, j);
+            }
+        }
+    }
+
+    for (j = 0; j < active_channels; j++) {
+        comedi_chans[scan_chan[j]].num += to - from;
+    }
+}
+
+/* Run 'nscans' (at most BUFSZ) whole scans at src through the trigger and into the sweep.  Returns
+ * the number of scans used up, and sets *done if a sweep that was already in progress when
+ * get_data() was called has been finished - the rest of the scans belong to the next call.
+ */
+
+static int process_scans(const void *src, int nscans, int was_in_sweep, int *triggered, int *done)
+{
+    static short trig_buf[BUFSZ];
+    int samples_per_frame;
+    int i, j, n;
+    int delay, pre, start;
+    Signal *sig;
+    Signal *first = &comedi_chans[scan_chan[0]];
 
     /* The way the code's written right now, all the channels are sampled at the same rate and for
      * the same width (number of samples per frame), so we just use the width from the first channel
      * in the capture list to figure how many samples we're capturing.
      */
 
-    samples_per_frame = capture_list->signal->width;
+    samples_per_frame = first->width;
 
-    /* It is possible for this loop to be entered with a full buffer of data already (bufvalid ==
-     * sizeof(buf)).  In that case, the read will be called with a zero byte buffer size, and will
-     * return zero.  That's why the comparison reads ">=0" and not ">0"
-     */
-    while ((bytes_read = read(comedi_fileno(comedi_dev),
-                              ((char *)buf) + bufvalid, sizeof(buf) - bufvalid))
-           >= 0) {
-
-        // fprintf(stderr, "bytes_read=%d; bufvalid=%d\n", bytes_read, bufvalid);
+    i = 0;
+    while (i < nscans) {
 
-        bytes_read += bufvalid;
+        if (!in_progress) {
 
-        gettimeofday(&tv1, NULL);
-        samples_read = bytes_read / sizeof(sampl_t);
-        scans_read = samples_read / active_channels;
-
-        /* This is here to catch the case when there's nothing (or not much) in the buffer, and the
-         * read() call returned nothing.
-         */
+            if (!scope.run) {
+                trigger_gap(&trig, nscans - i);
+                for (j = 0; j < active_channels; j++) {
+                    history_clear(&history[scan_chan[j]]);
+                }
+                break;
+            }
 
-        if (scans_read == 0 && bytes_read == 0) break;
+            /* Sweep isn't in_progress, so look for a trigger.  With no trigger channel
+             * (trig_index < 0) that's anything; otherwise pull the trigger channel's samples out of
+             * the scans and let the trigger engine look at them.  It remembers the end of the
+             * previous read, so a crossing between two reads isn't missed, and it computes a delay
+             * value based on extrapolating a straight line between the two sample values that
+             * straddle the triggering point, for high-frequency signals that change significantly
+             * between the two samples.
+             *
+             * If the sweep is to start with 'pre' samples from before the trigger, the scans we go
+             * past are pushed into the history, and a trigger that comes before we have that many
+             * is passed over.
+             */
 
-        for (i = 0; i < scans_read; i++) {
-
-            current_scan = buf + i * active_channels;
-
-            if (!in_progress && scope.run && i>0) {
-
-                /* Sweep isn't in_progress, so look for a trigger - anything (trig_mode==0) or a
-                 * transition between the last sample and the current one that crossed the
-                 * trig_level threshold, either going positive (trig_mode==1) or going negative
-                 * (trig_mode==2).  Since we check the previous sample, there's an "i>0" case in the
-                 * above if statement, and that does mean that we'll miss a trigger if the
-                 * transition exactly corresponds with a read buffer boundary.
-                 */
-
-                last_scan = buf + (i-1) * active_channels;
-
-                if ((trig_mode == 0) ||
-                    ((trig_mode == 1) &&
-                     (convert(current_scan[trig_index]) >= trig_level) &&
-                     (convert(last_scan[trig_index]) < trig_level)) ||
-                    ((trig_mode == 2) &&
-                     (convert(current_scan[trig_index]) <= trig_level) &&
-                     (convert(last_scan[trig_index]) > trig_level))) {
-
-                    /* found something to trigger on, so compute a delay value based on
-                     * extrapolating a straight line between the two sample values that straddle the
-                     * triggering point, for high-frequency signals that change significantly
-                     * between the two samples.  Set up all the relevent Signal structures, then
-                     * fall through into the triggered case below
-                     */
-
-                    delay = 0;
-
-                    if (trig_mode != 0) {
-                        short current = convert(current_scan[trig_index]);
-                        short last = convert(last_scan[trig_index]);
-                        if (current != last) {
-                            delay = abs(10000 * (current - trig_level) / (current - last));
-                        }
-                    }
+            delay = 0;
+            pre = 0;
 
-                    for (j=0, capture=capture_list;
-                         capture != NULL; capture=capture->next, j++) {
-                        capture->signal->frame ++;
-                        capture->signal->delay = delay;
-                        capture->signal->num = 0;
+            if (trig_index >= 0) {
+                column(trig_buf + i, src, i, nscans, trig_index);
+                pre = pretrigger_samples(samples_per_frame);
+                for (j = 0; j < active_channels; j++) {
+                    history_reserve(&history[scan_chan[j]], pre, sizeof(short));
+                    if (sample_format != SAMPLE_S16) {
+                        history_reserve(&whistory[scan_chan[j]], pre, WIDE_SIZE);
                     }
-                    if (j != active_channels) {
-                        fprintf(stderr, "ERROR!   j != active_channels in get_data()\n");
+                }
+                start = i;
+                for (;;) {
+                    i += trigger_find(&trig, trig_buf + i, nscans - i, &delay);
+                    if (pre > 0) {
+                        push_history(src, start, i);
+                        start = i;
                     }
+                    if (i >= nscans || history[trig_chan].fill >= pre) break;
+                    trigger_skip(&trig, trig_buf + i, 1);
+                    i ++;
+                }
+                if (i >= nscans) break;
+            }
 
-                    in_progress = 1;
+            /* Found something to trigger on.  Set up all the relevent Signal structures, then fall
+             * through into the sweep in progress below
+             */
 
+            for (j = 0; j < active_channels; j++) {
+                sig = &comedi_chans[scan_chan[j]];
+                sig->frame ++;
+                sig->delay = delay;
+                history_copy(&history[scan_chan[j]], sig->data, pre);
+                if (sample_format != SAMPLE_S16) {
+                    history_copy(&whistory[scan_chan[j]], sig->wide, pre);
                 }
+                sig->num = pre;
             }
+        }
+
+        /* Sweep in progress - copy as many scans as we have, up to the end of the sweep */
 
-            if (in_progress) {
+        n = nscans - i;
+        if (n > samples_per_frame - first->num) {
+            n = samples_per_frame - first->num;
+        }
 
-                /* Sweep in progress */
+        demux(src, i, i + n);
 
-                for (j=0, capture=capture_list; capture != NULL; capture=capture->next, j++) {
-                    capture->signal->data[capture->signal->num ++] = convert(current_scan[j]);
-                    in_progress = capture->signal->num;
-                }
-                if (j != active_channels) {
-                    fprintf(stderr, "ERROR!   j != active_channels in get_data()\n");
+        if (trig_index >= 0) {
+            trigger_skip(&trig, comedi_chans[trig_chan].data + comedi_chans[trig_chan].num - n, n);
+            if (scope.trigpos > 0) {
+                for (j = 0; j < active_channels; j++) {
+                    sig = &comedi_chans[scan_chan[j]];
+                    history_push(&history[scan_chan[j]], sig->data + sig->num - n, n);
+                    if (sample_format != SAMPLE_S16) {
+                        history_push(&whistory[scan_chan[j]], (int *) sig->wide + sig->num - n, n);
+                    }
                 }
+            }
+        }
 
-                triggered = 1;
+        i += n;
+        in_progress = first->num;
+        *triggered = 1;
 
-                if (in_progress >= samples_per_frame) {
+        if (in_progress >= samples_per_frame) {
 
-                    in_progress = 0;
+            in_progress = 0;
 
-                    /* If we were in the middle of a sweep when we entered this function, return
-                     * now.  Otherwise, keep looking for more sweeps.
-                     */
+            /* If we were in the middle of a sweep when get_data() was called, stop now.  Otherwise,
+             * keep looking for more sweeps.
+             */
 
-                    if (was_in_sweep) {
+            if (was_in_sweep) {
+                *done = 1;
+                return i;
+            }
+        }
+    }
 
-                        bufvalid = bytes_read - (i * active_channels * sizeof(sampl_t));
-                        if (bufvalid) {
-                            memcpy(buf, (char *) buf + bytes_read - bufvalid, bufvalid);
-                        }
+    return nscans;
+}
 
-                        lag = 0;
-                        return triggered;
-                    }
-                }
+/* The most common cause of a COMEDI read error is a buffer overflow.  There are all kinds of ways
+ * to do it, from hitting space to stop the scope trace to dragging a window while xoscope is
+ * running.  In the later case, the window manager will do an X server grab, which will block
+ * xoscope the next time it tries to perform an X operation.  Holding the mouse down longer than a
+ * split second will cause the COMEDI kernel buffer to overflow, which will trigger this code the
+ * next time through.
+ *
+ * comedi-0.7.60 returned EINVAL on buffer overflows;
+ * comedi-0.7.66 returns EPIPE
+ *
+ * In any event, if we detect an overflow, we reset the capture to start a new trace, record how
+ * many microseconds elapsed since the last time we were able to read the device, and report this
+ * on the screen as "lag".
+ */
 
-            }
+static struct timeval last_read;
+
+static void overrun(const char *what)
+{
+    struct timeval now;
+
+    if (errno != EINVAL && errno != EPIPE) perror(what);
+
+    /* An overrun after the scope's been stopped says nothing about the buffer's size */
+
+    overruns ++;
+    if (comedi_bufsize <= 0 && timed && auto_factor < MAX_AUTO_FACTOR) auto_factor *= 2;
+
+    stop_comedi_running();
+    start_comedi_running();
+    gettimeofday(&now, NULL);
+    lag = 1000000*(now.tv_sec-last_read.tv_sec) + now.tv_usec - last_read.tv_usec;
+
+    /* Nobody says how many scans went missing; call it as many as came in since the last read */
+    record_gap((long long) lag * comedi_rate / 1000000);
+}
+
+/* Straight out of COMEDI's buffer, when it's mapped.  Each pass takes the whole scans that are
+ * there up to the end of the ring; a scan that wraps around the end gets put back together in buf.
+ * Nothing is handed back to COMEDI until process_scans() is done with it.
+ */
+
+static int get_data_mmap(int was_in_sweep)
+{
+    int scan_bytes = active_channels * sample_size;
+    int contents, offset, part, n;
+    int triggered = 0;
+    int done = 0;
+    const void *src;
+
+    while (!done) {
+        contents = comedi_get_buffer_contents(comedi_dev, comedi_subdevice);
+        if (contents < 0) {
+            overrun("comedi_get_buffer_contents");
+            return 0;
         }
+        if (contents < scan_bytes) break;
 
-        /* It would be nice if COMEDI never returned a partial scan to a read() call.
-         * Unfortunately, it often does, so we need to tuck the "extra" data away until the next
-         * time through this loop...
-         */
+        gettimeofday(&last_read, NULL);
+        offset = comedi_get_buffer_offset(comedi_dev, comedi_subdevice);
 
-        bufvalid = bytes_read - (scans_read * active_channels * sizeof(sampl_t));
-        if (bufvalid) {
-            memcpy(buf, (char *) buf + bytes_read - bufvalid, bufvalid);
+        n = (comedi_map_size - offset) / scan_bytes;
+        if (n > contents / scan_bytes) n = contents / scan_bytes;
+        if (n > BUFSZ) n = BUFSZ;
+
+        if (n > 0) {
+            src = comedi_map + offset;
+        } else {
+            part = comedi_map_size - offset;
+            memcpy(buf, comedi_map + offset, part);
+            memcpy((char *) buf + part, comedi_map, scan_bytes - part);
+            src = buf;
+            n = 1;
         }
 
+        n = process_scans(src, n, was_in_sweep, &triggered, &done);
+        record_scans(src, n);
+
+        if (comedi_mark_buffer_read(comedi_dev, comedi_subdevice, n * scan_bytes) < 0) {
+            overrun("comedi_mark_buffer_read");
+            return 0;
+        }
+        bytes_total += n * scan_bytes;
     }
 
-    if ((bytes_read < 0) && (errno != EAGAIN)) {
-
-        /* The most common cause of a COMEDI read error is a buffer overflow.  There are all kinds
-         * of ways to do it, from hitting space to stop the scope trace to dragging a window while
-         * xoscope is running.  In the later case, the window manager will do an X server grab,
-         * which will block xoscope the next time it tries to perform an X operation.  Holding the
-         * mouse down longer than a split second will cause the COMEDI kernel buffer to overflow,
-         * which will trigger this code the next time through.
-         *
-         * comedi-0.7.60 returned EINVAL on buffer overflows;
-         * comedi-0.7.66 returns EPIPE
-         *
-         * In any event, if we detect an overflow, we reset the capture to start a new trace, record
-         * how many microseconds elapsed since the last time we were able to read the device, and
-         * report this on the screen as "lag".
+    lag = 0;
+    return triggered;
+}
+
+/* ...or through read(), into buf */
+
+static int get_data_read(int was_in_sweep)
+{
+    int scan_bytes = active_channels * sample_size;
+    int bytes_read;
+    int scans_read;
+    int used;
+    int triggered = 0;
+    int done = 0;
+
+    /* It is possible for this loop to be entered with a full buffer of data already (bufvalid ==
+     * sizeof(buf)).  In that case, the read will be called with a zero byte buffer size, and will
+     * return zero.  That's why the comparison reads ">=0" and not ">0"
+     */
+    while (!done && (bytes_read = read(comedi_fileno(comedi_dev),
+                                       ((char *)buf) + bufvalid, BUFSZ * sample_size - bufvalid))
+           >= 0) {
+
+        // fprintf(stderr, "bytes_read=%d; bufvalid=%d\n", bytes_read, bufvalid);
+
+        bytes_total += bytes_read;
+        bytes_read += bufvalid;
+
+        gettimeofday(&last_read, NULL);
+        scans_read = bytes_read / scan_bytes;
+
+        /* This is here to catch the case when there's nothing (or not much) in the buffer, and the
+         * read() call returned nothing.
          */
 
-        if (errno != EINVAL && errno != EPIPE) perror("comedi read");
+        if (scans_read == 0 && bytes_read == 0) break;
+
+        used = process_scans(buf, scans_read, was_in_sweep, &triggered, &done);
+        record_scans(buf, used);
+
+        /* It would be nice if COMEDI never returned a partial scan to a read() call.
+         * Unfortunately, it often does, so we need to tuck the "extra" data (and any whole scans
+         * past the end of the sweep) away until the next time through this loop...
+         */
 
-        start_comedi_running();
-        bufvalid = 0;
-        gettimeofday(&tv2, NULL);
-        lag = 1000000*(tv2.tv_sec-tv1.tv_sec) + tv2.tv_usec - tv1.tv_usec;
+        bufvalid = bytes_read - used * scan_bytes;
+        if (bufvalid) {
+            memmove(buf, (char *) buf + bytes_read - bufvalid, bufvalid);
+        }
+    }
+
+    if (!done && (bytes_read < 0) && (errno != EAGAIN)) {
+        overrun("comedi read");
         return 0;
     }
 
@@ -875,10 +1235,54 @@ static int get_data(void)
     return triggered;
 }
 
+static int get_data(void)
+{
+    int was_in_sweep=in_progress;
+    struct timeval now;
+    int contents, size, gap;
+
+    /* This code used to try and start COMEDI running if it wasn't running already.  But if fd()
+     * already returned -1, the main code doesn't think we're running, so it's best to leave things
+     * alone here...
+     */
+
+    if (! comedi_dev || ! comedi_running) return 0;
+
+    /* Keep track of how long the main loop leaves us between calls, for auto_bufsize(), and how
+     * much of the kernel buffer that backed up.  Once the scope is stopped, or waiting for its
+     * single-shot trace, the capture thread stops calling us (unless it's recording), and the gap
+     * until it starts again is a pause, not something the buffer has to ride out.
+     */
+
+    gettimeofday(&now, NULL);
+    timed = timerisset(&prev_call);
+    if (timed) {
+        gap = 1000000*(now.tv_sec-prev_call.tv_sec) + now.tv_usec - prev_call.tv_usec;
+        if (gap > worst_gap) worst_gap = gap;
+    }
+    if (scope.run == 1 || record_active()) {
+        prev_call = now;
+    } else {
+        timerclear(&prev_call);
+    }
+
+    contents = comedi_get_buffer_contents(comedi_dev, comedi_subdevice);
+    size = comedi_get_buffer_size(comedi_dev, comedi_subdevice);
+    if (contents > 0 && size > 0 && 100LL * contents / size > worst_backlog) {
+        worst_backlog = 100LL * contents / size;
+    }
+
+    if (comedi_map != NULL) {
+        return get_data_mmap(was_in_sweep);
+    } else {
+        return get_data_read(was_in_sweep);
+    }
+}
+
 
 static const char * status_str(int i)
 {
-    static char buffer[16];
+    static char buffer[32];
     const char *error = comedi_strerror(comedi_error);
 
     switch (i) {
@@ -894,9 +1298,12 @@ static const char * status_str(int i)
     case 4:
         if (!comedi_dev) {
             return split_field(error, 1, 16);
+        } else if (bytes_total >= 1000000000LL) {
+            snprintf(buffer, sizeof(buffer), "%.1f GB read", bytes_total / 1e9);
         } else {
-            return "";
+            snprintf(buffer, sizeof(buffer), "%.1f MB read", bytes_total / 1e6);
         }
+        return buffer;
 
     case 1:
         if (comedi_dev) {
@@ -915,6 +1322,8 @@ static const char * status_str(int i)
         } else {
             return "";
         }
+        return buffer;
+
     case 5:
         if (comedi_dev && comedi_error) {
             return split_field(error, 1, 16);
@@ -922,6 +1331,22 @@ static const char * status_str(int i)
             return "";
         }
 
+    case 6:
+        if (comedi_dev) {
+            snprintf(buffer, sizeof(buffer), "%d overrun%s", overruns, overruns == 1 ? "" : "s");
+            return buffer;
+        } else {
+            return "";
+        }
+
+    case 7:
+        if (comedi_dev) {
+            snprintf(buffer, sizeof(buffer), "%d%% peak backlog", worst_backlog);
+            return buffer;
+        } else {
+            return "";
+        }
+
     default:
         return NULL;
     }
@@ -1019,12 +1444,16 @@ static int comedi_set_option(char *option)
         comedi_aref = AREF_DIFF;
         reset_comedi();
         return 1;
-    } else if (strcasecmp(buf, "bufsize=default") == 0) {
+    } else if (strcasecmp(buf, "bufsize=default") == 0 || strcasecmp(buf, "bufsize=auto") == 0) {
         comedi_bufsize = -1;
         return 1;
     } else if (sscanf(buf, "bufsize=%d", &comedi_bufsize) == 1) {
         reset_comedi();
         return 1;
+    } else if (strcasecmp(buf, "mmap=on") == 0 || strcasecmp(buf, "mmap=off") == 0) {
+        comedi_mmap = (strcasecmp(buf, "mmap=on") == 0);
+        reset_comedi();
+        return 1;
     } else {
         return 0;
     }
@@ -1067,6 +1496,9 @@ static char * comedi_save_option(int i)
             return "bufsize=default";
         }
 
+    case 5:
+        return comedi_mmap ? "mmap=on" : "mmap=off";
+
     default:
         return NULL;
     }
@@ -112,10 +112,10 @@ void device_changed(void)
     snprintf(buf, sizeof(buf), "%d", comedi_rate);
     gtk_entry_set_text(GTK_ENTRY(LU("rate_entry")), buf);
 
-    /* Set the bufsize radio buttons based on whether we're using the default buffer size or a
-     * custom one.  If we're custom, put the custom size we're using in the entry field and make it
-     * sensitive.  If we're using the default, find the default and put it in the entry field, then
-     * grey it out.
+    /* Set the bufsize radio buttons based on whether we're sizing the buffer automatically or
+     * using a custom size.  If we're custom, put the custom size we're using in the entry field and
+     * make it sensitive.  If we're automatic, find the size it's come to and put it in the entry
+     * field, then grey it out.
      */
 
     if (comedi_bufsize > 0) {
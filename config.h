@@ -41,7 +41,7 @@
 #define DEF_S 10
 
 /* trigger level */
-#define DEF_T "0:0:x"
+#define DEF_T "0:0:x:2"
 
 /* verbose display off */
 #define DEF_V 0
@@ -162,6 +162,9 @@
    <sysmacros.h>. */
 /* #undef MAJOR_IN_SYSMACROS */
 
+/* maximum number of samples in a sweep */
+#define MAXSWEEP 64 * 1024 * 1024
+
 /* maximum number of samples stored in memories */
 #define MAXWID 1024 * 256
 
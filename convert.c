@@ -0,0 +1,458 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the sample format conversion kernels
+ *
+ * Sound cards hand us interleaved frames (left, right, left, right, ...) of unsigned 8-bit or
+ * signed 16-bit samples, while the Signal structures want one array of signed shorts per channel.
+ * Splitting them up one sample at a time is most of the work a sound DataSrc does, so the common
+ * cases (one and two channels) have SSE2, AVX2 and NEON versions.  Which ones get used is decided
+ * at runtime, the first time we're called, so one binary still runs on any CPU of its family.
+ * Everything else (and the last few frames that don't fill a vector) goes through plain C.
+ *
+ * With more channels, the plain C version takes the frames a block at a time, and splits each
+ * block up channel by channel, so that it reads through the input once however many channels there
+ * are.  Channels nobody wants (a NULL in out[]) are skipped altogether.  The 24-bit, 32-bit and
+ * float formats of the better interfaces only come that way.  COMEDI's unsigned 16-bit samples are
+ * split up like signed ones, and then have the board's zero value taken off a vector at a time.
+ *
+ * The x86 kernels are compiled with the target attribute rather than -msse2/-mavx2, so they don't
+ * need any special compiler flags and can't leak vector instructions into the rest of the program.
+ */
+
+#include <string.h>
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+static void (* u8_mono)(short *out, const unsigned char *in, int n) = NULL;
+static void (* u8_stereo)(short *l, short *r, const unsigned char *in, int n) = NULL;
+static void (* s16_stereo)(short *l, short *r, const short *in, int n) = NULL;
+static void (* s16_offset)(short *p, int n, short zero) = NULL;
+
+/* Plain C versions */
+
+static void u8_mono_scalar(short *out, const unsigned char *in, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = in[i] - U8_BIAS;
+    }
+}
+
+static void u8_stereo_scalar(short *l, short *r, const unsigned char *in, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        l[i] = in[2*i] - U8_BIAS;
+        r[i] = in[2*i + 1] - U8_BIAS;
+    }
+}
+
+static void s16_stereo_scalar(short *l, short *r, const short *in, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        l[i] = in[2*i];
+        r[i] = in[2*i + 1];
+    }
+}
+
+static void s16_offset_scalar(short *p, int n, short zero)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        p[i] -= zero;
+    }
+}
+
+#ifdef X86_KERNELS
+
+/* Treating a vector of (left, right) pairs of 16-bit samples as 32-bit lanes, the left samples are
+ * the sign-extended low halves and the right samples the high halves.  Pack two such vectors worth
+ * of each back down to 16 bits.  (The AVX2 pack works within 128-bit halves, so its results need
+ * their 64-bit quarters put back in order.)
+ */
+
+#define SPLIT_SSE2(a, b, left, right)                                           \
+    left = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),           \
+                           _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));          \
+    right = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16))
+
+#define SPLIT_AVX2(a, b, left, right)                                           \
+    left = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16),  \
+                              _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16)); \
+    right = _mm256_packs_epi32(_mm256_srai_epi32(a, 16), _mm256_srai_epi32(b, 16)); \
+    left = _mm256_permute4x64_epi64(left, 0xd8);                                \
+    right = _mm256_permute4x64_epi64(right, 0xd8)
+
+__attribute__ ((target("sse2")))
+static void u8_mono_sse2(short *out, const unsigned char *in, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(U8_BIAS);
+    __m128i v;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (in + i));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias));
+        _mm_storeu_si128((__m128i *) (out + i+8), _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias));
+    }
+    u8_mono_scalar(out + i, in + i, n - i);
+}
+
+__attribute__ ((target("sse2")))
+static void u8_stereo_sse2(short *l, short *r, const unsigned char *in, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(U8_BIAS);
+    __m128i v, a, b, left, right;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((const __m128i *) (in + 2*i));
+        a = _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias);
+        b = _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias);
+        SPLIT_SSE2(a, b, left, right);
+        _mm_storeu_si128((__m128i *) (l + i), left);
+        _mm_storeu_si128((__m128i *) (r + i), right);
+    }
+    u8_stereo_scalar(l + i, r + i, in + 2*i, n - i);
+}
+
+__attribute__ ((target("sse2")))
+static void s16_stereo_sse2(short *l, short *r, const short *in, int n)
+{
+    __m128i a, b, left, right;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        a = _mm_loadu_si128((const __m128i *) (in + 2*i));
+        b = _mm_loadu_si128((const __m128i *) (in + 2*i + 8));
+        SPLIT_SSE2(a, b, left, right);
+        _mm_storeu_si128((__m128i *) (l + i), left);
+        _mm_storeu_si128((__m128i *) (r + i), right);
+    }
+    s16_stereo_scalar(l + i, r + i, in + 2*i, n - i);
+}
+
+__attribute__ ((target("sse2")))
+static void s16_offset_sse2(short *p, int n, short zero)
+{
+    const __m128i z = _mm_set1_epi16(zero);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i *) (p + i),
+                         _mm_sub_epi16(_mm_loadu_si128((const __m128i *) (p + i)), z));
+    }
+    s16_offset_scalar(p + i, n - i, zero);
+}
+
+__attribute__ ((target("avx2")))
+static void u8_mono_avx2(short *out, const unsigned char *in, int n)
+{
+    const __m256i bias = _mm256_set1_epi16(U8_BIAS);
+    __m256i v;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (in + i)));
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_sub_epi16(v, bias));
+    }
+    u8_mono_scalar(out + i, in + i, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static void u8_stereo_avx2(short *l, short *r, const unsigned char *in, int n)
+{
+    const __m256i bias = _mm256_set1_epi16(U8_BIAS);
+    __m256i a, b, left, right;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (in + 2*i)));
+        b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (in + 2*i + 16)));
+        a = _mm256_sub_epi16(a, bias);
+        b = _mm256_sub_epi16(b, bias);
+        SPLIT_AVX2(a, b, left, right);
+        _mm256_storeu_si256((__m256i *) (l + i), left);
+        _mm256_storeu_si256((__m256i *) (r + i), right);
+    }
+    u8_stereo_scalar(l + i, r + i, in + 2*i, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static void s16_stereo_avx2(short *l, short *r, const short *in, int n)
+{
+    __m256i a, b, left, right;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        a = _mm256_loadu_si256((const __m256i *) (in + 2*i));
+        b = _mm256_loadu_si256((const __m256i *) (in + 2*i + 16));
+        SPLIT_AVX2(a, b, left, right);
+        _mm256_storeu_si256((__m256i *) (l + i), left);
+        _mm256_storeu_si256((__m256i *) (r + i), right);
+    }
+    s16_stereo_scalar(l + i, r + i, in + 2*i, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static void s16_offset_avx2(short *p, int n, short zero)
+{
+    const __m256i z = _mm256_set1_epi16(zero);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        _mm256_storeu_si256((__m256i *) (p + i),
+                            _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *) (p + i)), z));
+    }
+    s16_offset_scalar(p + i, n - i, zero);
+}
+
+#endif /* X86_KERNELS */
+
+#ifdef NEON_KERNELS
+
+/* NEON has loads that deinterleave by themselves */
+
+#define WIDEN(v) vreinterpretq_s16_u16(vmovl_u8(v))
+
+static void u8_mono_neon(short *out, const unsigned char *in, int n)
+{
+    const int16x8_t bias = vdupq_n_s16(U8_BIAS);
+    uint8x16_t v;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = vld1q_u8(in + i);
+        vst1q_s16(out + i, vsubq_s16(WIDEN(vget_low_u8(v)), bias));
+        vst1q_s16(out + i + 8, vsubq_s16(WIDEN(vget_high_u8(v)), bias));
+    }
+    u8_mono_scalar(out + i, in + i, n - i);
+}
+
+static void u8_stereo_neon(short *l, short *r, const unsigned char *in, int n)
+{
+    const int16x8_t bias = vdupq_n_s16(U8_BIAS);
+    uint8x16x2_t v;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = vld2q_u8(in + 2*i);
+        vst1q_s16(l + i, vsubq_s16(WIDEN(vget_low_u8(v.val[0])), bias));
+        vst1q_s16(l + i + 8, vsubq_s16(WIDEN(vget_high_u8(v.val[0])), bias));
+        vst1q_s16(r + i, vsubq_s16(WIDEN(vget_low_u8(v.val[1])), bias));
+        vst1q_s16(r + i + 8, vsubq_s16(WIDEN(vget_high_u8(v.val[1])), bias));
+    }
+    u8_stereo_scalar(l + i, r + i, in + 2*i, n - i);
+}
+
+static void s16_stereo_neon(short *l, short *r, const short *in, int n)
+{
+    int16x8x2_t v;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = vld2q_s16(in + 2*i);
+        vst1q_s16(l + i, v.val[0]);
+        vst1q_s16(r + i, v.val[1]);
+    }
+    s16_stereo_scalar(l + i, r + i, in + 2*i, n - i);
+}
+
+static void s16_offset_neon(short *p, int n, short zero)
+{
+    const int16x8_t z = vdupq_n_s16(zero);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        vst1q_s16(p + i, vsubq_s16(vld1q_s16(p + i), z));
+    }
+    s16_offset_scalar(p + i, n - i, zero);
+}
+
+#endif /* NEON_KERNELS */
+
+/* Pick the best kernels this CPU can run.  u8_mono gets set last, and is what the callers check,
+ * so it doesn't hurt if two threads happen to get here at once; they both come up with the same
+ * answer.
+ */
+
+static void select_kernels(void)
+{
+    void (* mono)(short *, const unsigned char *, int) = u8_mono_scalar;
+
+    u8_stereo = u8_stereo_scalar;
+    s16_stereo = s16_stereo_scalar;
+    s16_offset = s16_offset_scalar;
+
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mono = u8_mono_avx2;
+        u8_stereo = u8_stereo_avx2;
+        s16_stereo = s16_stereo_avx2;
+        s16_offset = s16_offset_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        mono = u8_mono_sse2;
+        u8_stereo = u8_stereo_sse2;
+        s16_stereo = s16_stereo_sse2;
+        s16_offset = s16_offset_sse2;
+    }
+#endif
+
+#ifdef NEON_KERNELS
+    mono = u8_mono_neon;
+    u8_stereo = u8_stereo_neon;
+    s16_stereo = s16_stereo_neon;
+    s16_offset = s16_offset_neon;
+#endif
+
+    u8_mono = mono;
+}
+
+/* Frames per block for the N-channel versions.  A block of even 32 channels of 16-bit samples fits
+ * in the L1 cache, so the stride-nchans reads for each channel after the first don't go to memory.
+ */
+#define BLOCK 64
+
+void deinterleave_u8(short **out, const unsigned char *in, int nchans, int nframes)
+{
+    const unsigned char *p;
+    int b, m, c, i;
+
+    if (u8_mono == NULL) select_kernels();
+
+    if (nchans == 1 && out[0] != NULL) {
+        u8_mono(out[0], in, nframes);
+    } else if (nchans == 2 && out[0] != NULL && out[1] != NULL) {
+        u8_stereo(out[0], out[1], in, nframes);
+    } else {
+        for (b = 0; b < nframes; b += BLOCK) {
+            m = (nframes - b < BLOCK) ? nframes - b : BLOCK;
+            for (c = 0; c < nchans; c++) {
+                if (out[c] == NULL) continue;
+                for (i = 0, p = in + b*nchans + c; i < m; i++, p += nchans) {
+                    out[c][b + i] = *p - U8_BIAS;
+                }
+            }
+        }
+    }
+}
+
+void deinterleave_s16(short **out, const short *in, int nchans, int nframes)
+{
+    const short *p;
+    int b, m, c, i;
+
+    if (u8_mono == NULL) select_kernels();
+
+    if (nchans == 1) {
+        if (out[0] != NULL) memcpy(out[0], in, nframes * sizeof(short));
+    } else if (nchans == 2 && out[0] != NULL && out[1] != NULL) {
+        s16_stereo(out[0], out[1], in, nframes);
+    } else {
+        for (b = 0; b < nframes; b += BLOCK) {
+            m = (nframes - b < BLOCK) ? nframes - b : BLOCK;
+            for (c = 0; c < nchans; c++) {
+                if (out[c] == NULL) continue;
+                for (i = 0, p = in + b*nchans + c; i < m; i++, p += nchans) {
+                    out[c][b + i] = *p;
+                }
+            }
+        }
+    }
+}
+
+/* COMEDI's unsigned samples.  Taking the zero value off is the same 16-bit wraparound subtraction
+ * whether the bits are read as signed or unsigned, so split them up as shorts first, then subtract
+ * from each channel while it's still in the cache.
+ */
+
+void deinterleave_u16(short **out, const unsigned short *in, int nchans, int nframes, int zero)
+{
+    int c;
+
+    if (u8_mono == NULL) select_kernels();
+
+    deinterleave_s16(out, (const short *) in, nchans, nframes);
+    for (c = 0; c < nchans; c++) {
+        if (out[c] != NULL) s16_offset(out[c], nframes, zero);
+    }
+}
+
+/* The wide formats.  These don't come in mono and stereo flavours; each block is split up channel
+ * by channel as above, and the compiler is left to vectorize the inner loops, which it can since
+ * they're straight-line code.  A channel can have a short view (out[c]) without the wide samples
+ * (wide[c] NULL), which is what we do for a trigger channel nobody is looking at.
+ */
+
+void deinterleave_s32(short **out, int **wide, const int *in, int nchans, int nframes, int shift)
+{
+    const int *p;
+    int b, m, c, i, v;
+
+    for (b = 0; b < nframes; b += BLOCK) {
+        m = (nframes - b < BLOCK) ? nframes - b : BLOCK;
+        for (c = 0; c < nchans; c++) {
+            if (out[c] == NULL) continue;
+            p = in + b*nchans + c;
+            if (wide[c] != NULL) {
+                for (i = 0; i < m; i++) {
+                    v = (int) ((unsigned int) p[i*nchans] << shift);
+                    wide[c][b + i] = v;
+                    out[c][b + i] = v >> 16;
+                }
+            } else {
+                for (i = 0; i < m; i++) {
+                    out[c][b + i] = (int) ((unsigned int) p[i*nchans] << shift) >> 16;
+                }
+            }
+        }
+    }
+}
+
+#define CLIP_SHORT(v) ((v) > 32767.0f ? 32767 : (v) < -32768.0f ? -32768 : (short) (v))
+
+void deinterleave_float(short **out, float **wide, const float *in, int nchans, int nframes)
+{
+    const float *p;
+    float v;
+    int b, m, c, i;
+
+    for (b = 0; b < nframes; b += BLOCK) {
+        m = (nframes - b < BLOCK) ? nframes - b : BLOCK;
+        for (c = 0; c < nchans; c++) {
+            if (out[c] == NULL) continue;
+            p = in + b*nchans + c;
+            if (wide[c] != NULL) {
+                for (i = 0; i < m; i++) {
+                    v = p[i*nchans] * 32768.0f;
+                    wide[c][b + i] = v;
+                    out[c][b + i] = CLIP_SHORT(v);
+                }
+            } else {
+                for (i = 0; i < m; i++) {
+                    v = p[i*nchans] * 32768.0f;
+                    out[c][b + i] = CLIP_SHORT(v);
+                }
+            }
+        }
+    }
+}
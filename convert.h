@@ -0,0 +1,32 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * sample format conversion routines available outside of convert.c
+ *
+ */
+
+/* Unsigned 8-bit sound samples are centered on this value.  (Strictly speaking it's 128, but
+ * xoscope has always used 127, and the sound cards' trigger levels are computed from it.)
+ */
+#define U8_BIAS 127
+
+/* Split 'nframes' frames of 'nchans' interleaved samples into one array per channel, out[0] ..
+ * out[nchans-1], converting to signed 16 bits on the way.  Channels whose out[] is NULL are skipped.
+ */
+void            deinterleave_u8(short **out, const unsigned char *in, int nchans, int nframes);
+void            deinterleave_s16(short **out, const short *in, int nchans, int nframes);
+
+/* Unsigned 16-bit samples (COMEDI's sampl_t), less 'zero' */
+void            deinterleave_u16(short **out, const unsigned short *in, int nchans, int nframes,
+                                 int zero);
+
+/* The same for the wide sample formats, which also fill wide[c] with the samples at full
+ * resolution, in the units of Signal.wide (see xoscope.h).  A channel whose wide[] is NULL only gets
+ * its short view.  32-bit words are shifted up by 'shift' bits first: 0 for S32, 8 for S24 (24 bits
+ * in the low three bytes of each word).  Floats are +/-1.0 full scale.
+ */
+void            deinterleave_s32(short **out, int **wide, const int *in, int nchans, int nframes,
+                                 int shift);
+void            deinterleave_float(short **out, float **wide, const float *in, int nchans,
+                                   int nframes);
@@ -19,6 +19,8 @@
 #include "xoscope.h"            /* program defaults */
 #include "display.h"
 #include "func.h"
+#include "persist.h"
+#include "bitplane.h"
 
 #include "xoscope_gtk.h"
 #include <glib.h>
@@ -301,7 +303,7 @@ void setup_help_text(GtkWidget *widget, gpointer ignored)
 void update_dynamic_text(void)
 {
     static time_t prev = 0;
-    static int frames = 0;
+    static int prev_frames = 0;
     char string[81], widget[81], *cp;
     const char *s;
     int i;
@@ -342,7 +344,8 @@ void update_dynamic_text(void)
         }
         else{
             sprintf(cp, "<tt>Max:%+*d - Min:%+*d = %*d Pk-Pk",
-                        INTW, stats.max, INTW, stats.min, UINTW, stats.max - stats.min);
+                        INTW, (int) stats.max, INTW, (int) stats.min,
+                        UINTW, (int) (stats.max - stats.min));
 #if CALC_RMS
             cp = string + strlen(string);
             if(stats.rms > 0)
@@ -422,27 +425,25 @@ void update_dynamic_text(void)
         }
     }
 
-    /* Recompute frames per second once every second */
+    /* Recompute frames per second once every second, from the frames show_data() has counted */
 
     time(&sec);
     if (sec != prev) {
 
         if (prev != 0) {
-            sprintf(string, "fps:%3d", frames);
+            sprintf(string, "fps:%3d", g_atomic_int_get(&frames) - prev_frames);
             gtk_label_set_text(GTK_LABEL(LU("fps_label")), string);
         } else {
             gtk_label_set_text(GTK_LABEL(LU("fps_label")), "");
         }
 
-        frames = 0;
+        prev_frames = g_atomic_int_get(&frames);
         if (datasrc) {
             prev = sec;
         } else {
             prev = 0;
         }
     }
-
-    frames++;
 }
 
 void update_text(void)
@@ -493,6 +494,9 @@ void update_text(void)
             sprintf(string, "%s Trigger @ %d",
                     trigs[scope.trige], scope.trig);
         }
+        if (scope.trigpos > 0) {
+            sprintf(string + strlen(string), ", %d%% pre", scope.trigpos);
+        }
         gtk_label_set_text(GTK_LABEL(LU("trigger_label")), string);
         gtk_label_set_text(GTK_LABEL(LU("trigger_source_label")), trigsig->name);
     } else {
@@ -806,6 +810,8 @@ void free_signalline(SignalLine *sl)
         }
         g_free(sl->X);
         g_free(sl->Y);
+        g_free(sl->data);
+        g_free(sl->index);
 
         g_free(sl);
         sl = slnext;
@@ -839,6 +845,18 @@ void clear_databox(void)
 static gboolean x_offset_property_exists = 0;
 static gboolean y_offset_property_exists = 0;
 static gboolean y_factor_property_exists = 0;
+static gboolean length_property_settable = 0;
+static gboolean values_property_settable = 0;
+
+/* Can a property be set on a graph after it's been made? */
+
+static gboolean property_settable(GtkDataboxGraph *graph, const char *name)
+{
+    GParamSpec *pspec = g_object_class_find_property(G_OBJECT_GET_CLASS(graph), name);
+
+    return (pspec != NULL) && (pspec->flags & G_PARAM_WRITABLE)
+        && !(pspec->flags & G_PARAM_CONSTRUCT_ONLY);
+}
 
 void configure_databox(void)
 {
@@ -924,6 +942,9 @@ void configure_databox(void)
         x_offset_property_exists = (g_object_class_find_property(G_OBJECT_GET_CLASS(line), "x-offset") != NULL);
         y_offset_property_exists = (g_object_class_find_property(G_OBJECT_GET_CLASS(line), "y-offset") != NULL);
         y_factor_property_exists = (g_object_class_find_property(G_OBJECT_GET_CLASS(line), "y-factor") != NULL);
+        length_property_settable = property_settable(line, "length");
+        values_property_settable = property_settable(line, "X-Values")
+            && property_settable(line, "Y-Values");
 
         g_object_unref(line);
     }
@@ -969,7 +990,7 @@ void timebase_changed(void)
             }
             datasrc->reset();
         }
-        setinputfd(datasrc->fd());
+        datasrc_listen();
     }
 
     restart_external_commands();
@@ -994,6 +1015,7 @@ void clear(void)
     int i;
 
     clear_databox();
+    persist_clear();
 
     if (datasrc) {
 
@@ -1022,7 +1044,7 @@ void clear(void)
             }
             datasrc->reset();
         }
-        setinputfd(datasrc->fd());
+        datasrc_listen();
     }
 
     configure_databox();
@@ -1084,6 +1106,550 @@ void draw_graticule(void)
     }
 }
 
+/* A trace gets at most two points for each pixel of the screen: the smallest and the largest of
+ * the samples that fall in it, in the order they come.  Drawing every sample of a long sweep would
+ * only stroke thousands of line segments over each other in the same column, and this keeps any
+ * glitch that would have shown.  trace_bucket() works out how many samples that is, for a signal
+ * with 'num' seconds per sample, from the databox's visible limits and width.
+ */
+
+static int trace_bucket(gfloat num)
+{
+    gfloat left, right, top, bottom;
+    double per_pixel;
+    int width = databox->allocation.width;
+
+    if (width <= 0 || num <= 0) {
+        return 1;
+    }
+    gtk_databox_get_visible_limits(GTK_DATABOX(databox), &left, &right, &top, &bottom);
+    per_pixel = (right - left) / width / num;
+
+    /* a bucket of two samples would still get two points */
+    return (per_pixel > 2) ? (int) ceil(per_pixel) : 1;
+}
+
+/* Where the smallest and largest of samples from..to are, with one loop for each way of getting at
+ * a sample's value, as in func.c.
+ */
+
+#define MIN_MAX_KERNEL(name, type, VALUE)                                               \
+    static void name(const void *p, int bit, int from, int to, int *lop, int *hip)      \
+    {                                                                                   \
+        type v, min = VALUE(p, from), max = min;                                        \
+        int i, lo = from, hi = from;                                                    \
+                                                                                        \
+        for (i = from + 1 ; i < to ; i++) {                                             \
+            v = VALUE(p, i);                                                            \
+            if (v < min) {                                                              \
+                min = v;                                                                \
+                lo = i;                                                                 \
+            }                                                                           \
+            if (v > max) {                                                              \
+                max = v;                                                                \
+                hi = i;                                                                 \
+            }                                                                           \
+        }                                                                               \
+        *lop = lo;                                                                      \
+        *hip = hi;                                                                      \
+    }
+
+#define SHORT_VALUE(p, i)       (((const short *) (p))[i])
+#define BIT_VALUE(p, i)         ((((const short *) (p))[i] >> bit) & 1)
+#define S32_VALUE(p, i)         (((const int *) (p))[i])
+#define FLOAT_VALUE(p, i)       (((const float *) (p))[i])
+
+MIN_MAX_KERNEL(short_min_max, short, SHORT_VALUE)
+MIN_MAX_KERNEL(bit_min_max, short, BIT_VALUE)
+MIN_MAX_KERNEL(s32_min_max, int, S32_VALUE)
+MIN_MAX_KERNEL(float_min_max, float, FLOAT_VALUE)
+
+/* The value of sample i of 'sig' (or of bit 'bit' of it) to draw.  For an analog trace of a wide
+ * Signal, it comes from wide[], at full resolution.
+ */
+
+static gfloat sample_value(Signal *sig, int bit, int i)
+{
+    if (bit >= 0) {
+        return (sig->data[i] >> bit) & 1;
+    } else if (sig->format == SAMPLE_S32) {
+        return ((const int *) sig->wide)[i] * (1.0f / 65536);
+    } else if (sig->format == SAMPLE_FLOAT) {
+        return ((const float *) sig->wide)[i];
+    }
+    return sig->data[i];
+}
+
+/* Add sample i of 'sig' to a trace, as a point.  sl->data gets the short view of it, which is what
+ * the rescaling at the end of draw_data() falls back on.
+ */
+
+static void trace_point(SignalLine *sl, Signal *sig, int bit, int i, gfloat left_offset, gfloat num)
+{
+    int k = sl->next_point++;
+
+    sl->data[k] = (bit < 0) ? sig->data[i] : (sig->data[i] >> bit) & 1;
+    sl->index[k] = i;
+    sl->X[k] = left_offset + i * num;
+    sl->Y[k] = sample_value(sig, bit, i);
+}
+
+/* Bring a trace up to the samples 'sig' has.  The last bucket we did may have been only part full,
+ * so it gets done over.
+ */
+
+static void trace_points(SignalLine *sl, Signal *sig, int bit, gfloat left_offset, gfloat num)
+{
+    void (*min_max)(const void *, int, int, int, int *, int *) = short_min_max;
+    const void *p = sig->data;
+    int i, to, lo, hi;
+
+    if (sl->bucket <= 1) {
+        for (i = sl->next_point; i < sig->num; i++) {
+            trace_point(sl, sig, bit, i, left_offset, num);
+        }
+        sl->next_sample = sig->num;
+        return;
+    }
+
+    if (bit >= 0) {
+        min_max = bit_min_max;
+    } else if (sig->format == SAMPLE_S32) {
+        min_max = s32_min_max;
+        p = sig->wide;
+    } else if (sig->format == SAMPLE_FLOAT) {
+        min_max = float_min_max;
+        p = sig->wide;
+    }
+
+    i = (sl->next_sample > 0) ? (sl->next_sample - 1) / sl->bucket * sl->bucket : 0;
+    sl->next_point = 2 * (i / sl->bucket);
+
+    for ( ; i < sig->num; i = to) {
+        to = (i + sl->bucket < sig->num) ? i + sl->bucket : sig->num;
+        min_max(p, bit, i, to, &lo, &hi);
+        trace_point(sl, sig, bit, (lo < hi) ? lo : hi, left_offset, num);
+        trace_point(sl, sig, bit, (lo < hi) ? hi : lo, left_offset, num);
+    }
+    sl->next_sample = sig->num;
+}
+
+/* Make room for 'points' points in a digital trace.  The graph drew from the arrays we're moving,
+ * so it has to go; trace_graph() makes another.
+ */
+
+static void trace_grow(SignalLine *sl, int points)
+{
+    if (points <= sl->size) {
+        return;
+    }
+    while (sl->size < points) {
+        sl->size *= 2;
+    }
+    sl->X = g_renew(gfloat, sl->X, 2 * sl->size);
+    sl->Y = g_renew(gfloat, sl->Y, 2 * sl->size);
+    sl->data = g_renew(short, sl->data, sl->size);
+    sl->index = g_renew(int, sl->index, sl->size);
+
+    if (sl->graph != NULL) {
+        gtk_databox_graph_remove(GTK_DATABOX(databox), sl->graph);
+        g_object_unref(G_OBJECT(sl->graph));
+        sl->graph = NULL;
+    }
+}
+
+/* Bring a digital trace up to the samples 'sig' has, from its channel's bit-planes.  A bit only
+ * changes at its edges, so joining the samples either side of each edge draws the same line as
+ * joining every sample, in line or step mode.  Edges closer together than a bucket (a pixel's
+ * worth of samples) only get points for the first of them and for the last one so far, which
+ * still fills the pixels a burst of them covers, and leaves it at the level the burst ends on.
+ * The trace always ends at the last sample; if that's not next to an edge, it's taken off again
+ * when more samples come.
+ */
+
+#define TRACE_EDGES 256
+
+static void trace_edges(SignalLine *sl, Channel *p, int bit, gfloat left_offset, gfloat num)
+{
+    Signal *sig = p->signal;
+    const guint32 *plane = p->planes + bit * p->plane_words;
+    int edges[TRACE_EDGES];
+    int from = sl->next_sample, to = p->plane_samples;
+    int n, k, e;
+
+    if (to <= from) {
+        return;
+    }
+    if (sl->tail) {
+        sl->next_point--;
+        sl->tail = 0;
+    }
+    if (sl->next_point == 0) {
+        trace_grow(sl, 1);
+        trace_point(sl, sig, bit, 0, left_offset, num);
+    }
+
+    while ((n = bitplane_edges(plane, from, to, edges, TRACE_EDGES)) > 0) {
+        trace_grow(sl, sl->next_point + 2 * n + 1);
+        for (k = 0; k < n; k++) {
+            e = edges[k];
+            if (sl->last_edge > 0 && e - sl->last_edge < sl->bucket) {
+                if (sl->index[sl->next_point - 1] > sl->last_edge) {
+                    sl->next_point--;           /* an earlier edge of the same burst */
+                }
+                trace_point(sl, sig, bit, e, left_offset, num);
+                continue;
+            }
+            if (sl->index[sl->next_point - 1] != e - 1) {
+                trace_point(sl, sig, bit, e - 1, left_offset, num);
+            }
+            trace_point(sl, sig, bit, e, left_offset, num);
+            sl->last_edge = e;
+        }
+        if (n < TRACE_EDGES) {
+            break;
+        }
+        from = edges[n - 1] + 1;
+    }
+
+    if (sl->index[sl->next_point - 1] != to - 1) {
+        trace_grow(sl, sl->next_point + 1);
+        trace_point(sl, sig, bit, to - 1, left_offset, num);
+        sl->tail = 1;
+    }
+    sl->next_sample = to;
+}
+
+/* Bring channel p's bit-planes up to the samples its signal has, starting over for a new frame */
+
+static void channel_planes(Channel *p, int new_frame)
+{
+    Signal *sig = p->signal;
+    int words = (sig->width + 31) / 32;
+    int num = (sig->num < words * 32) ? sig->num : words * 32;
+
+    if (words > p->plane_words) {
+        g_free(p->planes);
+        p->planes = g_new(guint32, 16 * words);
+        p->plane_words = words;
+        new_frame = 1;
+    }
+    if (new_frame || num < p->plane_samples) {
+        p->plane_samples = 0;
+    }
+    if (num > p->plane_samples) {
+        bitplane_pack(p->planes, p->plane_words, sig->data, p->plane_samples & ~31, num);
+        p->plane_samples = num;
+    }
+}
+
+/* The first point of a trace that's at or after 'sample' */
+
+static int trace_point_at(SignalLine *sl, int sample)
+{
+    int k, lo = 0, hi = sl->next_point;
+
+    if (sl->edges) {
+        while (lo < hi) {
+            k = (lo + hi) / 2;
+            if (sl->index[k] < sample) {
+                lo = k + 1;
+            } else {
+                hi = k;
+            }
+        }
+        return lo;
+    }
+
+    k = (sl->bucket > 1) ? 2 * ((sample + sl->bucket - 1) / sl->bucket) : sample;
+    return (k < sl->next_point) ? k : sl->next_point;
+}
+
+/* Put points from..sl->next_point of a trace in the databox.  A running sweep comes through here
+ * every time more samples arrive, so rather than make a new graph over all of its points each
+ * time, we just tell the graph it has more of them, if the databox lets us change its length.  In
+ * sweep mode, the older trace shrinks from the front instead, which needs its X and Y pointers
+ * moved as well.  Otherwise, or if the plot mode changed, it's a new graph.
+ */
+
+static void trace_graph(SignalLine *sl, int from, GdkColor *gcolor)
+{
+    int n = sl->next_point - from;
+    gfloat *X = sl->X + from, *Y = sl->Y + from;
+
+    if (scope.plot_mode == 2) { /* step */
+        n = 2 * n - 1;
+        X = sl->X + 2 * from;
+        Y = sl->Y + 2 * from;
+    }
+
+    if (sl->graph != NULL && n > 0 && sl->graph_mode == scope.plot_mode
+        && length_property_settable) {
+        if (from == sl->graph_from) {
+            g_object_set(G_OBJECT(sl->graph), "length", n, NULL);
+            return;
+        }
+        if (values_property_settable) {
+            g_object_set(G_OBJECT(sl->graph), "X-Values", X, "Y-Values", Y, "length", n, NULL);
+            sl->graph_from = from;
+            return;
+        }
+    }
+
+    if (sl->graph != NULL) {
+        gtk_databox_graph_remove(GTK_DATABOX(databox), sl->graph);
+        g_object_unref(G_OBJECT(sl->graph));
+        sl->graph = NULL;
+    }
+    if (n <= 0) {
+        return;
+    }
+
+    switch (scope.plot_mode) {
+    case 0: /* points */
+        sl->graph = gtk_databox_points_new(n, X, Y, gcolor, 1);
+        break;
+    case 1: /* lines */
+    case 2: /* step */
+        sl->graph = gtk_databox_lines_new(n, X, Y, gcolor, 1);
+        break;
+    }
+    gtk_databox_graph_add(GTK_DATABOX(databox), sl->graph);
+    sl->graph_mode = scope.plot_mode;
+    sl->graph_from = from;
+}
+
+/* How a channel's samples (or bit 'bit' of them, of bits 0..end) are scaled to the databox: the
+ * scale is applied first, then the offset.
+ */
+
+static void trace_scale(Channel *p, int bit, int end, double *y_scale, double *y_offset)
+{
+    /* Full range is scaled to 4/5 of the screen.  Therefor we scale it to 127*1,25 in 8-bit mode
+     * and 32767*1,25 in 16-bit mode.
+     */
+#if SC_16BIT
+    *y_scale = (double)p->scale / 40959;
+    *y_offset = (double)p->pos;
+#else
+    *y_scale = (double)p->scale / 160;
+    *y_offset = (double)p->pos;
+#endif
+    /* If we're in digital mode, increase the scale by eight and shift the offset by sixteen for
+     * each bit.  This hardwires eight as the height of a digital line and sixteen as the
+     * inter-line spacing.  We also shift the entire digital plot by the number of bits times eight
+     * plus four to center it.
+     */
+
+    if (bit >= 0) {
+        int bitoff = bit * 16 - end * 8 + 4;
+
+#if SC_16BIT
+        *y_offset += bitoff * *y_scale * 256;
+        *y_scale *= (8 * 256);
+#else
+        *y_offset += bitoff * *y_scale;
+        *y_scale *= 8;
+#endif
+    }
+}
+
+/* Stripchart mode rolls each trace in from the right.  It used to keep every frame it showed as a
+ * trace of its own, moving each of them left as new ones came in and throwing them away once they
+ * were off the screen, which at slow timebases meant a constant turnover of arrays and graphs.
+ * Now a trace is one SignalLine whose Y is a ring of just enough points to cover the screen, with
+ * each point stored twice, at k and k + size, so the newest 'size' of them are always one after
+ * another in memory, starting anywhere in Y.  X doesn't move at all: X[size - 1] is the right-hand
+ * edge of the screen, X[size - 2] the point before that, and so on.  The graph is X's last n points
+ * against the ring's newest n, so new samples only cost writing their points (the next one goes in
+ * slot next_point) and pointing the graph at the next starting place.
+ *
+ * Like the other traces, a long timebase gets the smallest and largest of each bucket (a pixel's
+ * worth) of samples, in the order they came; the bucket being filled is drawn as far as it's got,
+ * and finished off later, frames and all.  Step mode gets two points a sample too, at the same X,
+ * one with the sample before's value.  If the points are Y values as drawn rather than samples
+ * (when the graphs don't have a y-factor and a y-offset), they're redone for a new scale.
+ */
+
+/* Put point value v in slot k of a trace's ring */
+
+static void roll_put(SignalLine *sl, int k, gfloat v)
+{
+    if (!y_offset_property_exists || !y_factor_property_exists) {
+        v = sl->y_offset + v * sl->y_scale;
+    }
+    sl->Y[k] = sl->Y[k + sl->size] = v;
+}
+
+/* Add the samples 'sig' has that the trace hasn't got to yet.  Only as many as fit on the screen
+ * can show, so we skip any before those.
+ */
+
+static void roll_points(SignalLine *sl, Signal *sig, int bit)
+{
+    int ppb = (sl->bucket > 1 || sl->graph_mode == 2) ? 2 : 1;
+    int screen = sl->size / ppb * sl->bucket;
+    int i, k;
+    gfloat v;
+
+    if (sig->frame != sl->frame) {
+        sl->frame = sig->frame;
+        sl->next_sample = 0;
+    }
+    i = sl->next_sample;
+    if (sig->num - i > screen + sl->bucket) {
+        i = sig->num - screen;
+        sl->fill = 0;
+    }
+
+    for ( ; i < sig->num; i++) {
+        v = sample_value(sig, bit, i);
+        k = sl->next_point;
+
+        if (sl->bucket > 1) {
+            if (sl->fill == 0) {
+                sl->lo = sl->hi = v;
+                sl->lo_first = 1;
+            } else if (v < sl->lo) {
+                sl->lo = v;
+                sl->lo_first = 0;
+            } else if (v > sl->hi) {
+                sl->hi = v;
+                sl->lo_first = 1;
+            }
+            if (++sl->fill < sl->bucket) {
+                continue;
+            }
+            roll_put(sl, k, sl->lo_first ? sl->lo : sl->hi);
+            roll_put(sl, k + 1, sl->lo_first ? sl->hi : sl->lo);
+            sl->fill = 0;
+        } else if (ppb == 2) {
+            roll_put(sl, k, (sl->filled > 0) ? sl->hi : v);
+            roll_put(sl, k + 1, v);
+            sl->hi = v;
+        } else {
+            roll_put(sl, k, v);
+        }
+
+        sl->next_point = (k + ppb) % sl->size;
+        if (sl->filled < sl->size) {
+            sl->filled += ppb;
+        }
+    }
+    sl->next_sample = sig->num;
+
+    /* The bucket we're part way through, which the next samples will write over */
+
+    if (sl->fill > 0) {
+        roll_put(sl, sl->next_point, sl->lo_first ? sl->lo : sl->hi);
+        roll_put(sl, sl->next_point + 1, sl->lo_first ? sl->hi : sl->lo);
+    }
+}
+
+/* Draw bit 'bit' of channel p (of bits 0..end), or all of it for bit -1, in stripchart mode */
+
+static void roll_trace(Channel *p, int bit, int end, gfloat num, GdkColor *gcolor)
+{
+    SignalLine *sl = p->signalline[bit < 0 ? 0 : bit];
+    gfloat right = total_horizontal_divisions * 0.001 * scope.scale;
+    int bucket = (p->signal->rate > 0) ? trace_bucket(num) : 1;
+    int ppb = (bucket > 1 || scope.plot_mode == 2) ? 2 : 1;
+    int size = ppb * ((int) ceil(right / num / bucket) + 1);
+    double y_scale, y_offset;
+    gfloat *X, *Y;
+    int k, n;
+
+    /* A new trace, if there isn't one that fits the screen */
+
+    if (sl == NULL || !sl->roll || sl->size != size || sl->bucket != bucket
+        || sl->graph_mode != scope.plot_mode) {
+        free_signalline(sl);
+        sl = g_new0(SignalLine, 1);
+        p->signalline[bit < 0 ? 0 : bit] = sl;
+
+        sl->roll = 1;
+        sl->size = size;
+        sl->bucket = bucket;
+        sl->graph_mode = scope.plot_mode;
+        sl->frame = p->signal->frame;
+        sl->X = g_new0(gfloat, size);
+        sl->Y = g_new0(gfloat, 2 * size);
+        for (k = 0; k < size; k++) {
+            sl->X[k] = right - (size / ppb - 1 - k / ppb) * bucket * num;
+        }
+        trace_scale(p, bit, end, &sl->y_scale, &sl->y_offset);
+    }
+
+    trace_scale(p, bit, end, &y_scale, &y_offset);
+    if ((!y_offset_property_exists || !y_factor_property_exists)
+        && (y_scale != sl->y_scale || y_offset != sl->y_offset) && sl->y_scale != 0) {
+        for (k = 0; k < 2 * size; k++) {
+            sl->Y[k] = y_offset + (sl->Y[k] - sl->y_offset) * y_scale / sl->y_scale;
+        }
+    }
+    sl->y_scale = y_scale;
+    sl->y_offset = y_offset;
+
+    roll_points(sl, p->signal, bit);
+
+    /* The newest n points, counting the bucket we're part way through */
+
+    n = sl->filled + ((sl->fill > 0) ? 2 : 0);
+    if (n > size) n = size;
+    if (n <= 0) return;
+
+    X = sl->X + size - n;
+    Y = sl->Y + (sl->next_point + ((sl->fill > 0) ? 2 : 0) - n + size) % size;
+
+    if (sl->graph != NULL && length_property_settable && values_property_settable) {
+        g_object_set(G_OBJECT(sl->graph), "X-Values", X, "Y-Values", Y, "length", n, NULL);
+    } else {
+        if (sl->graph != NULL) {
+            gtk_databox_graph_remove(GTK_DATABOX(databox), sl->graph);
+            g_object_unref(G_OBJECT(sl->graph));
+        }
+        if (scope.plot_mode == 0) {
+            sl->graph = gtk_databox_points_new(n, X, Y, gcolor, 1);
+        } else {
+            sl->graph = gtk_databox_lines_new(n, X, Y, gcolor, 1);
+        }
+        gtk_databox_graph_add(GTK_DATABOX(databox), sl->graph);
+    }
+
+    if (y_offset_property_exists && y_factor_property_exists) {
+        g_object_set(G_OBJECT(sl->graph), "y-factor", y_scale, "y-offset", y_offset, NULL);
+    }
+}
+
+/* In accumulate mode, tell persist.c where channel j's samples land in the databox, and add the
+ * signal's frame once it's complete, unless the capture thread is doing that for us.
+ */
+
+static void persist_channel(int j, Signal *sig, SignalLine *sl, gfloat left_offset, gfloat num,
+                            GdkColor *gcolor)
+{
+    gfloat left, right, top, bottom;
+    PersistView view;
+
+    gtk_databox_get_visible_limits(GTK_DATABOX(databox), &left, &right, &top, &bottom);
+    if (right == left || top == bottom) {
+        persist_drop(j);
+        return;
+    }
+
+    view.width = databox->allocation.width;
+    view.height = databox->allocation.height;
+    view.x0 = (left_offset - left) * view.width / (right - left);
+    view.dx = num * view.width / (right - left);
+    view.y0 = (top - sl->y_offset) * view.height / (top - bottom);
+    view.dy = -sl->y_scale * view.height / (top - bottom);
+
+    persist_set(j, sig, &view, gcolor);
+    if (!in_progress) {
+        persist_frame(sig, sig->data, sig->num, sig->frame, 0);
+    }
+}
+
 /* draw_data()
  *
  * Writes the signals into the databox.  Called from show_data(), which will queue an expose event
@@ -1094,35 +1660,25 @@ gfloat cursoraX[2], cursoraY[2], cursorbX[2], cursorbY[2];
 
 GtkDataboxGraph *cursora = NULL;
 GtkDataboxGraph *cursorb = NULL;
+static int cursors_shown = 0;
 
 void draw_data(void)
 {
     static int i, j, bit, start, end;
+    int points, from, edges;
     gfloat num, left_offset;
     Channel *p;
     SignalLine *sl;
-    short *samp;
     gchar widget[80];
     GtkStyle *style;
     GdkColor gcolor;
     SignalLine *prevSL;
-    double x_offset;
-
-    /* Remove the cursors.  We'll put them back in later if they're active. */
-
-    if (cursora != NULL) {
-        gtk_databox_graph_remove(GTK_DATABOX(databox), cursora);
-        g_object_unref(G_OBJECT(cursora));
-        cursora = NULL;
-    }
-    if (cursorb != NULL) {
-        gtk_databox_graph_remove(GTK_DATABOX(databox), cursorb);
-        g_object_unref(G_OBJECT(cursorb));
-        cursorb = NULL;
-    }
+    int cursors_wanted = 0;
+    int persisting;
 
     for (j = 0 ; j < CHANNELS ; j++) { /* plot each visible channel */
         p = &ch[j];
+        persisting = 0;
         if(p->signal && p->signal->rate < 0 && in_progress != 0){
             continue;
         }
@@ -1142,8 +1698,6 @@ void draw_data(void)
             style = gtk_widget_get_style(GTK_WIDGET(LU(widget)));
             gcolor = style->fg[GTK_STATE_NORMAL];
 
-            samp = p->signal->data;
-
             /* Compute num, the number of seconds per sample, based on the signal's rate (in
              * samples/sec). If the signal rate is zero (unspecified) or negative (a special case
              * for Fourier Transforms, meaning the x scale is in Hz), we use a base rate of one
@@ -1180,10 +1734,22 @@ void draw_data(void)
                 cursoraY[0] = cursorbY[0] = -1;
                 cursoraY[1] = cursorbY[1] = +1;
 
-                cursora = gtk_databox_lines_new(2, cursoraX, cursoraY, &gcolor, 1);
-                cursorb = gtk_databox_lines_new(2, cursorbX, cursorbY, &gcolor, 1);
-                gtk_databox_graph_add(GTK_DATABOX(databox), cursora);
-                gtk_databox_graph_add(GTK_DATABOX(databox), cursorb);
+                /* The cursor graphs are made once; they draw from these arrays, so moving them is
+                 * just a matter of changing the arrays (and the color, for a new channel).
+                 */
+
+                if (cursora == NULL) {
+                    cursora = gtk_databox_lines_new(2, cursoraX, cursoraY, &gcolor, 1);
+                    cursorb = gtk_databox_lines_new(2, cursorbX, cursorbY, &gcolor, 1);
+                }
+                gtk_databox_graph_set_color(cursora, &gcolor);
+                gtk_databox_graph_set_color(cursorb, &gcolor);
+                if (!cursors_shown) {
+                    gtk_databox_graph_add(GTK_DATABOX(databox), cursora);
+                    gtk_databox_graph_add(GTK_DATABOX(databox), cursorb);
+                    cursors_shown = 1;
+                }
+                cursors_wanted = 1;
             }
 
             /* XXX make sure that if we're displaying a digital signal, we go into digital display
@@ -1195,13 +1761,32 @@ void draw_data(void)
             }
 #endif
 
+            /* Digital traces in line and step mode are drawn from the channel's bit-planes */
+
+            edges = (start >= 0) && (scope.plot_mode != 0) && (scope.scroll_mode != 2);
+            if (edges) {
+                channel_planes(p, (p->signal->frame != p->old_frame) || (p->old_frame == 0));
+            }
+
             for (bit = start ; bit <= end ; bit++) {
 
+                /* Stripchart mode has a trace of its own */
+
+                if (scope.scroll_mode == 2) {
+                    roll_trace(p, bit, end, num, &gcolor);
+                    continue;
+                }
+
                 /* SignalLine structures contain all the stored information about the (x,y)
                  * coordinates we've drawn already and may need to erase
                  */
                 sl = p->signalline[bit < 0 ? 0 : bit];
 
+                if (sl != NULL && sl->roll) {
+                    free_signalline(sl);
+                    sl = p->signalline[bit < 0 ? 0 : bit] = NULL;
+                }
+
                 if ((sl == NULL) ||
                     (p->signal->frame != p->old_frame) || (p->old_frame == 0)) {
                     /* New signal line, so we need a new SignalLine structure */
@@ -1211,44 +1796,41 @@ void draw_data(void)
                     sl->next = p->signalline[bit < 0 ? 0 : bit];
                     p->signalline[bit < 0 ? 0 : bit] = sl;
 
-                    /* we double the size of these array in case we're in step mode, when we draw
-                     * two vertices for every data point
+                    /* A long sweep gets two points per bucket of samples, not one per sample.
+                     * We double the size of the X and Y arrays in case we're in step mode, when we
+                     * draw two vertices for every data point.  A digital trace drawn from its
+                     * edges starts small and grows with the edges it finds.
                      */
 
-                    sl->X = g_new0(gfloat, 2 * p->signal->width);
-                    sl->Y = g_new0(gfloat, 2 * p->signal->width);
-                    sl->data = g_new0(short, p->signal->width);
+                    sl->bucket = (p->signal->rate > 0) ? trace_bucket(num) : 1;
+                    sl->edges = edges;
+                    if (edges) {
+                        points = 64;
+                    } else if (sl->bucket > 1) {
+                        points = 2 * ((p->signal->width + sl->bucket - 1) / sl->bucket);
+                    } else {
+                        points = p->signal->width;
+                    }
+                    sl->size = points;
+
+                    sl->X = g_new0(gfloat, 2 * points);
+                    sl->Y = g_new0(gfloat, 2 * points);
+                    sl->data = g_new0(short, points);
+                    sl->index = g_new0(int, points);
 
                     sl->y_scale = 1.0;
                 }
 
 
-                /* If we're continuing a running sweep, remove the existing trace from the databox.
-                 * We'll put it back in later, with more data points.
-                 */
-
-                if (sl->graph != NULL) {
-                    gtk_databox_graph_remove(GTK_DATABOX(databox), sl->graph);
-                    g_object_unref(G_OBJECT(sl->graph));
-                    sl->graph = NULL;
-                }
-
                 /* Compute the points we want to draw on the current trace and write them into the
                  * SignalLine arrays.  The only thing a little bit strange is that we might be
-                 * updating a trace that's already partially drawn; that's why we start at
-                 * sl->next_point and not 0.
+                 * updating a trace that's already partially drawn; that's why we carry on from
+                 * sl->next_sample and not 0.
                  */
-                for (i = sl->next_point; i < p->signal->num; i++) {
-
-                    if (bit < 0) {
-                        sl->data[sl->next_point] = samp[i];
-                    } else {
-                        sl->data[sl->next_point] = (samp[i] >> bit) & 1;
-                    }
-
-                    sl->X[sl->next_point] = left_offset + i * num;
-                    sl->Y[sl->next_point] = sl->data[sl->next_point];
-                    sl->next_point ++;
+                if (sl->edges) {
+                    trace_edges(sl, p, bit, left_offset, num);
+                } else {
+                    trace_points(sl, p->signal, bit, left_offset, num);
                 }
 
                 /* Depending on the scroll mode, manage previous traces */
@@ -1260,15 +1842,9 @@ void draw_data(void)
                     /* Sweep mode - erase anything lingering in the databox except the next to last
                      * trace, because we want to leave the trailing part of it drawn if we're in the
                      * middle of a sweep.  We remove it from the databox, and put it back in with
-                     * fewer data points.
+                     * fewer data points: the ones after the samples the new trace has.
                      */
 
-                    if (sl->next != NULL && sl->next->graph != NULL) {
-                        gtk_databox_graph_remove(GTK_DATABOX(databox), sl->next->graph);
-                        g_object_unref(G_OBJECT(sl->next->graph));
-                        sl->next->graph = NULL;
-                    }
-
                     if (sl->next != NULL && sl->next->next != NULL) {
                         free_signalline(sl->next->next);
                         sl->next->next = NULL;
@@ -1290,32 +1866,8 @@ void draw_data(void)
                         gtk_databox_graph_add (GTK_DATABOX (databox), sl->next->graph);
                     }
 #else
-                    if ((sl->next != NULL)
-                        && (sl->next_point < sl->next->next_point)) {
-                        switch (scope.plot_mode) {
-                        case 0: /* points */
-                            sl->next->graph
-                                = gtk_databox_points_new (sl->next->next_point-sl->next_point,
-                                                          sl->next->X + sl->next_point,
-                                                          sl->next->Y + sl->next_point,
-                                                          &gcolor, 1);
-                            break;
-                        case 1: /* lines */
-                            sl->next->graph
-                                = gtk_databox_lines_new (sl->next->next_point-sl->next_point,
-                                                         sl->next->X + sl->next_point,
-                                                         sl->next->Y + sl->next_point,
-                                                         &gcolor, 1);
-                            break;
-                        case 2: /* step */
-                            sl->next->graph
-                                = gtk_databox_lines_new (2*(sl->next->next_point - sl->next_point) - 1,
-                                                         sl->next->X + 2 * sl->next_point,
-                                                         sl->next->Y + 2 * sl->next_point,
-                                                         &gcolor, 1);
-                            break;
-                        }
-                        gtk_databox_graph_add (GTK_DATABOX (databox), sl->next->graph);
+                    if (sl->next != NULL) {
+                        trace_graph(sl->next, trace_point_at(sl->next, sl->next_sample), &gcolor);
                     }
 #endif
 
@@ -1323,97 +1875,38 @@ void draw_data(void)
 
                 case 1:
 
-                    /* Accumulate mode - do nothing, letting traces pile up in the databox.
-                     *
-                     * XXX this can lead to memory and CPU exhaustion with thousands of traces
-                     * piling up on a fast timebase
-                     */
-
-                    break;
-
-                case 2:
-
-                    /* Stripchart mode - position this trace at the right of the databox and line up
-                     * any previous traces to its left
+                    /* Accumulate mode - the older traces live on in persist.c's image, so only the
+                     * newest one stays in the databox.
                      */
 
-                    x_offset = total_horizontal_divisions * 0.001 * scope.scale
-                        - num * (sl->next_point - 1);
-                    for (prevSL = sl; prevSL != NULL; prevSL = prevSL->next) {
-
-                        /* If x_offset is negative at this point, we've just drawn a SignalLine
-                         * partially off the left-hand side of the screen, so anything older has
-                         * scrolled completely out of view.
-                         */
+                    if (sl->next != NULL) {
+                        free_signalline(sl->next);
+                        sl->next = NULL;
+                    }
 
-                        prevSL->x_offset = x_offset;
-// prevSL->y_offset = 0.25;
-                        if ((x_offset < 0) && prevSL->next) {
-                            free_signalline(prevSL->next);
-                            prevSL->next = NULL;
-                        }
+                    break;
 
-                        x_offset -= num * p->signal->width;
-                    }
+                    /* Stripchart mode (2) never gets here; see roll_trace() */
                 }
 
-                /* The scale is applied first, then the offset 
-                 * Full range is scaled to 4/5 of the screen.
-                 * Therefor we scale it to 127*1,25 in 8-bit mode 
-                 * and 32767*1,25 in 16-bit mode.
-                 */
-#if SC_16BIT
-                sl->y_scale = (double)p->scale / 40959;
-                sl->y_offset = (double)p->pos;
-#else
-                sl->y_scale = (double)p->scale / 160;
-                sl->y_offset = (double)p->pos;
-#endif
-                /* If we're in digital mode, increase the scale by eight and shift the offset by
-                 * sixteen for each bit.  This hardwires eight as the height of a digital line and
-                 * sixteen as the inter-line spacing.  We also shift the entire digital plot by the
-                 * number of bits times eight plus four to center it.
-                 */
+                trace_scale(p, bit, end, &sl->y_scale, &sl->y_offset);
 
-                if (bit >= 0) {
-                    int bitoff = bit * 16 - end * 8 + 4;
+                /* Digital channels only show their newest trace in accumulate mode */
 
-#if SC_16BIT
-                    sl->y_offset += bitoff * sl->y_scale * 256;
-                    sl->y_scale *= (8 * 256);
-#else
-                    sl->y_offset += bitoff * sl->y_scale;
-                    sl->y_scale *= 8;
-#endif
+                if (scope.scroll_mode == 1 && bit < 0) {
+                    persist_channel(j, p->signal, sl, left_offset, num, &gcolor);
+                    persisting = 1;
                 }
-                /* Add the current trace to the databox */
-
-                if (sl->next_point > 0) {
-
-                    switch (scope.plot_mode) {
-                    case 0: /* points */
-                        sl->graph = gtk_databox_points_new (sl->next_point,
-                                                            sl->X, sl->Y, &gcolor, 1);
-                        break;
-                    case 1: /* lines */
-                        sl->graph = gtk_databox_lines_new (sl->next_point,
-                                                           sl->X, sl->Y, &gcolor, 1);
-                        break;
-                    case 2: /* step */
-                        sl->graph = gtk_databox_lines_new (2 * sl->next_point - 1,
-                                                           sl->X, sl->Y, &gcolor, 1);
-                        break;
-                    }
 
-                    gtk_databox_graph_add (GTK_DATABOX (databox), sl->graph);
+                /* Add the current trace to the databox, or the points it's gained */
 
-                }
+                trace_graph(sl, 0, &gcolor);
 
                 /* Run through all of the SignalLines associated with this trace and set the scaling
-                 * factors and offsets for all of them.  This ensures that if we're in accumulate
-                 * mode and change the scale or position of the channel, all of the accumulated
-                 * traces move together.  Not quite what you'd expect from a real scope, but I think
-                 * this makes the most sense.
+                 * factors and offsets for all of them.  This ensures that if we're in sweep mode
+                 * and change the scale or position of the channel, the rest of the older trace
+                 * moves with the new one.  (Accumulate mode's persistence starts over instead,
+                 * much as a real scope's would.)
                  *
                  * XXX save left_offset in the SignalLine structure rather than use the one for the
                  * current signal
@@ -1442,10 +1935,12 @@ void draw_data(void)
                         } else {
                             for (i = 0; i < prevSL->next_point; i++) {
                                 if ((scope.plot_mode != 2) || (i == 0)) {
-                                    prevSL->X[i] = prevSL->x_offset + left_offset + i * num;
+                                    prevSL->X[i] = prevSL->x_offset + left_offset
+                                        + prevSL->index[i] * num;
                                     prevSL->Y[i] = prevSL->y_offset + prevSL->data[i] * prevSL->y_scale;
                                 } else {
-                                    prevSL->X[2*i] = prevSL->x_offset + left_offset + i * num;
+                                    prevSL->X[2*i] = prevSL->x_offset + left_offset
+                                        + prevSL->index[i] * num;
                                     prevSL->Y[2*i] = prevSL->y_offset + prevSL->data[i] * prevSL->y_scale;
                                     prevSL->X[2*i - 1] = prevSL->X[2*i - 2];
                                     prevSL->Y[2*i - 1] = prevSL->Y[2*i];
@@ -1478,6 +1973,10 @@ void draw_data(void)
             }
         }
 
+        if (!persisting) {
+            persist_drop(j);
+        }
+
         if (!p->bits) end=0;
         for (bit = end+1; bit < 16; bit++) {
             free_signalline(p->signalline[bit < 0 ? 0 : bit]);
@@ -1485,6 +1984,11 @@ void draw_data(void)
         }
     }
 
+    if (cursors_shown && !cursors_wanted) {
+        gtk_databox_graph_remove(GTK_DATABOX(databox), cursora);
+        gtk_databox_graph_remove(GTK_DATABOX(databox), cursorb);
+        cursors_shown = 0;
+    }
 }
 
 /* calculate any math and plot the results and the graticule */
@@ -1511,6 +2015,7 @@ void show_data(void)
     }
 
     gtk_widget_queue_draw (databox);
+    g_atomic_int_inc(&frames);
 }
 
 /* animate() - get and plot some data */
@@ -1518,6 +2023,7 @@ void show_data(void)
 void animate(void *data)
 {
     static struct timeval current_time, prev_time;
+    int listening = 0;
 
     /* To avoid hammering the X server, don't do anything if it's been less than scope.min_interval
      * milliseconds (default 50) since the last time we ran this function.  If we do skip
@@ -1541,7 +2047,7 @@ void animate(void *data)
     }
 
     prev_time = current_time;
-    if (datasrc) setinputfd(datasrc->fd());
+    if (datasrc) listening = datasrc_listen();
     settimeout(SND_QUERY_INTERVALL);
 
     clip = 0;
@@ -1560,6 +2066,14 @@ void animate(void *data)
         } else {
             //usleep(100000);           /* no need to suck all CPU cycles */
             setinputfd(-1);             /* scope not running, so why listen? */
+            listening = 0;
+        }
+
+        /* While we're capturing a sweep, a data source with something to poll on wakes us up as
+         * soon as it has new data, so there's no need to also poll it every SND_QUERY_INTERVALL ms.
+         */
+        if (listening && (scope.run || in_progress)) {
+            settimeout(0);
         }
     }
     show_data();
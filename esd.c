@@ -17,6 +17,9 @@
 #include <stdlib.h>             /* for abs() */
 #include <sys/ioctl.h>
 #include "xoscope.h"            /* program defaults */
+#include "convert.h"
+#include "trigger.h"
+#include "record.h"
 #include <esd.h>
 
 #define ESDDEVICE "ESounD"
@@ -34,6 +37,8 @@ static Signal right_sig = {"Right Mix", "b"};
 static int trigmode = 0;
 static int triglev;
 static int trigch;
+static Trigger trig;
+static History history[2];      /* pre-trigger samples, when scope.trigpos asks for them */
 
 static char * esd_errormsg1 = NULL;
 static char * esd_errormsg2 = NULL;
@@ -144,12 +149,14 @@ static int set_trigger(int chan, int *levelp, int mode)
         triglev = 0;
         *levelp = -128;
     }
+    trigger_set(&trig, mode, triglev - U8_BIAS, scope.trighyst);
     return 1;
 }
 
 static void clear_trigger(void)
 {
     trigmode = 0;
+    trigger_set(&trig, 0, 0, 0);
 }
 
 static int change_rate(int dir)
@@ -174,6 +181,8 @@ static void reset(void)
     left_sig.volts = 0;
     right_sig.volts = 0;
 
+    trigger_start(&trig, ESD_DEFAULT_RATE);
+
     in_progress = 0;
 }
 
@@ -203,14 +212,48 @@ static void set_width(int width)
         fprintf(stderr, "set_width(), malloc failed, %s\n", strerror(errno));
         exit(0);
     }
+
+    history_resize(&history[0], pretrigger_samples(width), sizeof(short));
+    history_resize(&history[1], pretrigger_samples(width), sizeof(short));
+}
+
+/* Samples we'll never see break the stream, for the trigger engine and the pre-trigger history */
+
+static void lost_frames(long long n)
+{
+    trigger_gap(&trig, n);
+    history_clear(&history[0]);
+    history_clear(&history[1]);
+}
+
+/* Hand 'n' frames to the recorder, both channels, whatever becomes of them */
+
+static void record_frames(const unsigned char *frames, int n)
+{
+    short *out[2];
+    void *wout[2];
+    int k;
+
+    if (!record_active()) return;
+
+    record_staging(2, 0, out, wout);
+    for (; n > 0; n -= k, frames += 2 * k) {
+        k = (n < RECORD_STEP) ? n : RECORD_STEP;
+        deinterleave_u8(out, frames, 2, k);
+        record_samples(left_sig.frame, ESD_DEFAULT_RATE, SAMPLE_S16, 3, out, wout, k);
+    }
 }
 
 /* get data from sound card, return value is whether we triggered or not */
 static int esd_get_data(void)
 {
     static unsigned char buffer[MAXWID * 2];
-    static int i, j, delay;
-    int fd;
+    static short scratch0[MAXWID], scratch1[MAXWID];
+    short *out[2], *scratch[2] = {scratch0, scratch1};
+    long long drained = 0;
+    int fd, i = 0, j, n, frames, delay = 0;
+    int converted = 0;
+    int pre, start = 0;
 
     if (esd >= 0) {
         fd = esd;
@@ -226,7 +269,13 @@ static int esd_get_data(void)
          */
 
         /* read until we get something smaller than a full buffer */
-        while ((j = read(fd, buffer, sizeof(buffer))) == sizeof(buffer));
+        while ((j = read(fd, buffer, sizeof(buffer))) == sizeof(buffer)) {
+            record_frames(buffer, j / 2);
+            drained += j / 2;
+        }
+        if (drained) {
+            lost_frames(drained);
+        }
 
     } else {
 
@@ -235,63 +284,77 @@ static int esd_get_data(void)
 
     }
 
-    i = 0;
+    frames = (j > 0) ? j / 2 : 0;
+    record_frames(buffer, frames);
 
     if (!in_progress) {
 
-        if (trigmode == 1) {
-            i ++;
-            while (((i+1)*2 <= j) && ((buffer[2*i + trigch] < triglev) ||
-                                      (buffer[2*(i-1) + trigch] >= triglev))) i ++;
-        } else if (trigmode == 2) {
-            i ++;
-            while (((i+1)*2 <= j) && ((buffer[2*i + trigch] > triglev) ||
-                                      (buffer[2*(i-1) + trigch] <= triglev))) i ++;
-        }
-
-        if ((i+1)*2 > j) {      /* haven't triggered within the screen */
-            return 0;           /* give up and keep previous samples */
+        if (frames == 0) {
+            return 0;
         }
 
-        delay = 0;
-
         if (trigmode) {
-            int last = buffer[2*(i-1) + trigch] - 127;
-            int current = buffer[2*i + trigch] - 127;
-            if (last != current) {
-                delay = abs(10000 * (current - (triglev - 127)) / (current - last));
+            deinterleave_u8(scratch, buffer, 2, frames);
+            converted = 1;
+            pre = pretrigger_samples(left_sig.width);
+            history_reserve(&history[0], pre, sizeof(short));
+            history_reserve(&history[1], pre, sizeof(short));
+
+            /* Look for a trigger with at least 'pre' samples of history before it */
+            for (;;) {
+                i += trigger_find(&trig, scratch[trigch] + i, frames - i, &delay);
+                if (pre > 0) {
+                    history_push(&history[0], scratch[0] + start, i - start);
+                    history_push(&history[1], scratch[1] + start, i - start);
+                    start = i;
+                }
+                if (i >= frames) {  /* haven't triggered within the screen */
+                    return 0;       /* give up and keep previous samples */
+                }
+                if (history[0].fill >= pre) {
+                    break;
+                }
+                trigger_skip(&trig, scratch[trigch] + i, 1);
+                i ++;
             }
+
+            history_copy(&history[0], left_sig.data, pre);
+            history_copy(&history[1], right_sig.data, pre);
+            in_progress = pre;
         }
 
-        left_sig.data[0] = buffer[2*i] - 127;
         left_sig.delay = delay;
-        left_sig.num = 1;
         left_sig.frame ++;
 
-        right_sig.data[0] = buffer[2*i + 1] - 127;
         right_sig.delay = delay;
-        right_sig.num = 1;
         right_sig.frame ++;
-
-        i ++;
-        in_progress = 1;
     }
 
-    while ((i+1)*2 <= j) {
-        if (in_progress >= left_sig.width) {
-            break;
-        }
-#if 0
-        if (*buff == 0 || *buff == 255) {
-            clip = i % 2 + 1;
-        }
-#endif
-        left_sig.data[in_progress] = buffer[2*i] - 127;
-        right_sig.data[in_progress] = buffer[2*i + 1] - 127;
+    /* Copy the complete frames we read, up to a full screen */
+
+    n = frames - i;
+    if (n > left_sig.width - in_progress) {
+        n = left_sig.width - in_progress;
+    }
 
-        in_progress ++;
-        i ++;
+    if (converted) {
+        memcpy(left_sig.data + in_progress, scratch[0] + i, n * sizeof(short));
+        memcpy(right_sig.data + in_progress, scratch[1] + i, n * sizeof(short));
+    } else {
+        out[0] = left_sig.data + in_progress;
+        out[1] = right_sig.data + in_progress;
+        deinterleave_u8(out, buffer + 2*i, 2, n);
     }
+    trigger_skip(&trig, (trigch ? right_sig.data : left_sig.data) + in_progress, n);
+    if (trigmode && scope.trigpos > 0) {
+        history_push(&history[0], left_sig.data + in_progress, n);
+        history_push(&history[1], right_sig.data + in_progress, n);
+    }
+    if (i + n < frames) {
+        lost_frames(frames - i - n);
+    }
+
+    in_progress += n;
 
     left_sig.num = in_progress;
     right_sig.num = in_progress;
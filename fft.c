@@ -34,20 +34,13 @@ fftw_plan       plan = NULL;
 int             fftLenIn = -1;
 int             xLayOut[FFT_DSP_LEN + 1];     /* Array of bin #'s displayed */
 
-/* Fast Fourier Transform of in to out */
-void fftW(short *in, short *out, int inLen)
+/* Transform whatever's in dp[], and scale the result into out */
+static void transform(short *out)
 {
-    int     k;
 #ifdef TIME_FFT
     clock_t begin, end;
     double time_spent;
-#endif
-
-    for (k = 0; k < inLen && k < fftLenIn; k++) {
-        dp[k] = (double)in[k];
-    }
 
-#ifdef TIME_FFT
     begin = clock();
 #endif
     fftw_execute(plan);
@@ -59,6 +52,42 @@ void fftW(short *in, short *out, int inLen)
 #endif
 }
 
+/* Fast Fourier Transform of in to out */
+void fftW(short *in, short *out, int inLen)
+{
+    int     k;
+
+    for (k = 0; k < inLen && k < fftLenIn; k++) {
+        dp[k] = (double)in[k];
+    }
+    transform(out);
+}
+
+/* The same for a Signal, from its wide[] samples if it has them */
+void fftW_signal(Signal *sig, short *out)
+{
+    const int   *s32 = sig->wide;
+    const float *flt = sig->wide;
+    int     k;
+
+    switch (sig->format) {
+    case SAMPLE_S32:
+        for (k = 0; k < sig->width && k < fftLenIn; k++) {
+            dp[k] = s32[k] * (1.0 / 65536);
+        }
+        break;
+    case SAMPLE_FLOAT:
+        for (k = 0; k < sig->width && k < fftLenIn; k++) {
+            dp[k] = flt[k];
+        }
+        break;
+    default:
+        fftW(sig->data, out, sig->width);
+        return;
+    }
+    transform(out);
+}
+
 void InitializeFFTW(int inLen)
 {
 #ifdef TIME_FFT
@@ -15,6 +15,7 @@ extern int fftLenOut;
  
 void InitializeFFTW(int fftlen);
 void fftW(short *in, short *out, int inLen);
+void fftW_signal(Signal *sig, short *out);
 void EndFFTW(void);
 int  floor2(int num);
 int  FFTactive(Signal *source, Signal *dest, int rateChange);
@@ -14,6 +14,7 @@
 #include "xoscope.h"            /* program defaults */
 #include "display.h"            /* display routines */
 #include "func.h"               /* signal math functions */
+#include "record.h"             /* the recorder */
 
 int backwards_compat_1_10 = 0;  /* TRUE if parsing a pre-1.10 save file */
 int backwards_compat_2_0 = 0;   /* TRUE if parsing a pre-2.0 save file */
@@ -103,6 +104,20 @@ void handle_opt(int opt, char *optarg)
             } else {
                 scope.trigch = strtol(q, NULL, 0);
             }
+            p = q;
+        }
+        /* hysteresis, holdoff and pulse width limits keep their settings unless given */
+        if ((q = strchr(p, ':')) != NULL) {
+            scope.trighyst = limit(strtol(p = ++q, NULL, 0), 0, 255);
+        }
+        if ((q = strchr(p, ':')) != NULL) {
+            scope.trighold = limit(strtol(p = ++q, NULL, 0), 0, 100000000);
+        }
+        if ((q = strchr(p, ':')) != NULL) {
+            scope.trigwmin = limit(strtol(p = ++q, NULL, 0), 0, 100000000);
+        }
+        if ((q = strchr(p, ':')) != NULL) {
+            scope.trigwmax = limit(strtol(p = ++q, NULL, 0), 0, 100000000);
         }
         if (datasrc && datasrc->set_trigger
             && datasrc->set_trigger(scope.trigch,
@@ -114,12 +129,16 @@ void handle_opt(int opt, char *optarg)
             scope.trige = 0;
         }
         break;
+    case 'w':                   /* horizontal trigger position */
+    case 'W':
+        scope.trigpos = limit(strtol(optarg, NULL, 0), 0, 90);
+        break;
     case 'l':                   /* cursor lines */
     case 'L':
         scope.curs = 1;
-        scope.cursa = limit(strtol(p = optarg, NULL, 0), 1, MAXWID);
+        scope.cursa = limit(strtol(p = optarg, NULL, 0), 1, MAXSWEEP);
         if ((q = strchr(p, ':')) != NULL) {
-            scope.cursb = limit(strtol(++q, NULL, 0), 1, MAXWID);
+            scope.cursb = limit(strtol(++q, NULL, 0), 1, MAXSWEEP);
             p = q;
         }
         if ((q = strchr(p, ':')) != NULL)
@@ -146,6 +165,11 @@ void handle_opt(int opt, char *optarg)
             scope.scroll_mode = limit(strtol(optarg, NULL, 0) % 10, 0, 2);
         }
         break;
+    case 'e':                   /* persistence */
+    case 'E':
+        scope.persist = strtol(optarg, NULL, 0);
+        if (scope.persist < 0) scope.persist = 0;
+        break;
     case 'g':                   /* graticule on/off */
     case 'G':
         scope.grat = limit(strtol(optarg, NULL, 0), 0, 2);
@@ -162,6 +186,12 @@ void handle_opt(int opt, char *optarg)
     case 'I':
         scope.min_interval = strtol(optarg, NULL, 0);
         break;
+    case 'k':                   /* keep a recording of everything captured */
+    case 'K':
+        if (!record_open(optarg)) {
+            usage(1);
+        }
+        break;
     case 'x':                   /* sound card (backwards compatibility) */
     case 'X':
     case 'y':
@@ -324,19 +354,24 @@ void writefile(char *filename)
 
     fprintf(file, "# -a %d\n\
 # -s %s\n\
-# -t %d:%d:%d\n\
+# -t %d:%d:%d:%d:%d:%d:%d\n\
+# -w %d\n\
 # -l %d:%d:%d\n\
 # -p %d\n\
+# -e %d\n\
 # -g %d\n\
 %s%s",
             scope.select + 1,
             formatScale(scope.scale),
             scope.trig - 128, scope.trige, scope.trigch,
+            scope.trighyst, scope.trighold, scope.trigwmin, scope.trigwmax,
+            scope.trigpos,
             scope.cursa, scope.cursb, scope.curs,
             /* XXX fix this - plot_mode not backwards compatable anymore */
             /* XXX fix this - plot_mode now OK, but scope.scroll_mode = 2 not stored in file*/
             /* new pre-2.1 compatibility flag - plot_mode and scope.scroll_mode now OK*/
             (scope.plot_mode * 10) + scope.scroll_mode,
+            scope.persist,
             scope.grat,
             scope.behind ? "# -b\n" : "",
             scope.verbose ? "# -v\n" : "");
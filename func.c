@@ -24,6 +24,7 @@
 #include "fft.h"
 #include "display.h"
 #include "func.h"
+#include "trigger.h"
 #include "xoscope_gtk.h"
 
 Signal mem[26];         /* 26 memories, corresponding to 26 letters */
@@ -47,7 +48,7 @@ void recall(Signal *signal)
     recall_on_channel(signal, &ch[scope.select]);
 }
 
-extern int in_progress;
+extern __thread int in_progress;
 
 /* store the currently selected signal to the given memory register */
 
@@ -80,28 +81,47 @@ void do_save_pending(void)
 
 void save(int dest, int src)
 {
-    if (ch[src].signal == NULL) 
+    Signal *sig = ch[src].signal;
+
+    if (sig == NULL) 
         return;
 
     /* Don't want the name - leave that at 'Memory x'
      * Also, increment frame instead of setting it to signal->frame in case signal->frame is the
      * same as mem's old frame number!
+     *
+     * Only the samples the sweep actually has get copied; a long sweep's arrays are mostly
+     * untouched (and so unallocated) memory until it fills them, and the copy should be too.
      */
     if (mem[dest].data != NULL) {
         free(mem[dest].data);
     }
-    mem[dest].data = malloc(ch[src].signal->width * sizeof(short));
+    mem[dest].data = calloc(sig->width, sizeof(short));
     if(mem[dest].data == NULL){
         fprintf(stderr, "malloc failed in save()\n");
         exit(0);
     }
-    memcpy(mem[dest].data, ch[src].signal->data, ch[src].signal->width * sizeof(short));
+    memcpy(mem[dest].data, sig->data, sig->num * sizeof(short));
 
-    mem[dest].rate = ch[src].signal->rate;
-    mem[dest].num = ch[src].signal->width;
-    mem[dest].width = ch[src].signal->width;
+    if (mem[dest].wide != NULL) {
+        free(mem[dest].wide);
+        mem[dest].wide = NULL;
+    }
+    mem[dest].format = sig->format;
+    if (mem[dest].format != SAMPLE_S16) {
+        mem[dest].wide = calloc(sig->width, WIDE_SIZE);
+        if(mem[dest].wide == NULL){
+            fprintf(stderr, "malloc failed in save()\n");
+            exit(0);
+        }
+        memcpy(mem[dest].wide, sig->wide, sig->num * WIDE_SIZE);
+    }
+
+    mem[dest].rate = sig->rate;
+    mem[dest].num = sig->num;
+    mem[dest].width = sig->width;
     mem[dest].frame ++;
-    mem[dest].volts = ch[src].signal->volts;
+    mem[dest].volts = sig->volts;
 }
 
 /* !!! External process handling
@@ -495,24 +515,119 @@ static void run_externals(void)
     }
 }
 
+/* The math functions only work out the samples their inputs have gained since the last call.  A
+ * sweep's samples don't change once they're in, so as long as the inputs are the same Signals, in
+ * the same frames, and we haven't reallocated our own arrays, signal[0..done) is still good.  FFT
+ * results (rate < 0) get rewritten in place without a new frame, so anything computed from one
+ * starts over every time.
+ */
+
+struct func {
+    void (*func)(Signal *);
+    char *name;
+    int (*isvalid)(Signal *);   /* returns TRUE if this function is valid */
+    Signal signal;
+    Signal *a, *b;              /* what signal[0..done) was computed from... */
+    int frame_a, frame_b;       /* ...in which of their frames */
+    int done;
+};
+
+extern struct func funcarray[];
+extern int funccount;
+
+static struct func *func_of(Signal *dest)
+{
+    int i;
+
+    for (i = 0; i < funccount; i++) {
+        if (dest == &funcarray[i].signal) return &funcarray[i];
+    }
+    return NULL;
+}
+
+/* Set dest's frame and num for computing 'num' samples from 'a' and 'b' (which can be the same),
+ * and return the first one that needs working out.
+ */
+
+static int math_start(Signal *dest, Signal *a, Signal *b, int frame, int num)
+{
+    struct func *f = func_of(dest);
+    int from = 0;
+
+    dest->frame = frame;
+    dest->num = num;
+    if (f == NULL) return 0;
+
+    if (f->a == a && f->b == b && f->frame_a == a->frame && f->frame_b == b->frame
+        && f->done <= num && a->rate > 0 && b->rate > 0) {
+        from = f->done;
+    }
+    f->a = a;
+    f->b = b;
+    f->frame_a = a->frame;
+    f->frame_b = b->frame;
+    f->done = num;
+    return from;
+}
+
+/* Math on wide Signals.  The isvalid() functions below make the result SAMPLE_FLOAT if the inputs
+ * are wide (and in the same format), and the functions then run one of these kernels instead of
+ * their own loop.  There's one for each of the wide formats, so that the format gets looked at
+ * once per call, not once per sample.  Each fills in the short view in data[] as well, from sample
+ * 'from' on.
+ */
+
+#define S32_VALUE(p, i)         (((const int *) (p))[i] * (1.0f / 65536))
+#define FLOAT_VALUE(p, i)       (((const float *) (p))[i])
+
+#define CLIP_SHORT(v) ((v) > SHRT_MAX ? SHRT_MAX : (v) < SHRT_MIN ? SHRT_MIN : (short) (v))
+
+#define WIDE_KERNEL(name, VALUE, expr)                                          \
+    static void name(Signal *dest, const void *pa, const void *pb, int from)    \
+    {                                                                           \
+        float *c = dest->wide;                                                  \
+        float a, b;                                                             \
+        int i;                                                                  \
+                                                                                \
+        for (i = from ; i < dest->num ; i++) {                                  \
+            a = VALUE(pa, i);                                                   \
+            b = VALUE(pb, i);                                                   \
+            c[i] = (expr);                                                      \
+            dest->data[i] = CLIP_SHORT(c[i]);                                   \
+        }                                                                       \
+    }
+
+WIDE_KERNEL(inv_s32, S32_VALUE, -a)
+WIDE_KERNEL(inv_float, FLOAT_VALUE, -a)
+WIDE_KERNEL(sum_s32, S32_VALUE, a + b)
+WIDE_KERNEL(sum_float, FLOAT_VALUE, a + b)
+WIDE_KERNEL(diff_s32, S32_VALUE, a - b)
+WIDE_KERNEL(diff_float, FLOAT_VALUE, a - b)
+WIDE_KERNEL(avg_s32, S32_VALUE, (a + b) / 2)
+WIDE_KERNEL(avg_float, FLOAT_VALUE, (a + b) / 2)
+
 /* !!! The functions; they take one arg: a Signal ptr to store results in */
 
 /* Invert */
 void inv(Signal *dest, Signal *src)
 {
-    int i;
+    int i, from;
     short *a, *b;
 
     if (src == NULL) return;
 
     dest->rate = src->rate;
-    dest->num = src->num;
     dest->volts = src->volts;
-    dest->frame = src->frame;
+    from = math_start(dest, src, src, src->frame, src->num);
 
-    a = src->data;
-    b = dest->data;
-    for (i = 0 ; i < src->num; i++) {
+    if (dest->format == SAMPLE_FLOAT) {
+        (src->format == SAMPLE_S32 ? inv_s32 : inv_float)(dest, src->wide, src->wide, from);
+        return;
+    }
+
+    a = src->data + from;
+    b = dest->data + from;
+    for (i = from ; i < src->num; i++) {
         *b++ = -1 * *a++;
     }
 }
@@ -530,24 +645,31 @@ void inv2(Signal *sig)
 /* The sum of the two channels */
 void sum(Signal *dest)
 {
-    int i;
+    int i, num, from;
     short *a, *b, *c;
     int sum;
 
     if ((ch[0].signal == NULL) || (ch[1].signal == NULL)) 
         return;
 
-    a = ch[0].signal->data;
-    b = ch[1].signal->data;
-    c = dest->data;
+    num = ch[0].signal->num;
 
-    dest->frame = ch[0].signal->frame + ch[1].signal->frame;
-    dest->num = ch[0].signal->num;
+    if (num > ch[1].signal->num) 
+        num = ch[1].signal->num;
 
-    if (dest->num > ch[1].signal->num) 
-        dest->num = ch[1].signal->num;
+    from = math_start(dest, ch[0].signal, ch[1].signal,
+                      ch[0].signal->frame + ch[1].signal->frame, num);
 
-    for (i = 0 ; i < dest->num ; i++) {
+    if (dest->format == SAMPLE_FLOAT) {
+        (ch[0].signal->format == SAMPLE_S32 ? sum_s32 : sum_float)
+            (dest, ch[0].signal->wide, ch[1].signal->wide, from);
+        return;
+    }
+
+    a = ch[0].signal->data + from;
+    b = ch[1].signal->data + from;
+    c = dest->data + from;
+    for (i = from ; i < dest->num ; i++) {
         sum = *a++ + *b++;
         if(sum > SHRT_MAX)
             sum = SHRT_MAX;
@@ -560,23 +682,30 @@ void sum(Signal *dest)
 /* The difference of the two channels */
 void diff(Signal *dest)
 {
-    int i;
+    int i, num, from;
     short *a, *b, *c;
     int sum;
 
     if ((ch[0].signal == NULL) || (ch[1].signal == NULL))
         return;
 
-    a = ch[0].signal->data;
-    b = ch[1].signal->data;
-    c = dest->data;
+    num = ch[0].signal->num;
+
+    if (num > ch[1].signal->num) num = ch[1].signal->num;
 
-    dest->frame = ch[0].signal->frame + ch[1].signal->frame;
-    dest->num = ch[0].signal->num;
+    from = math_start(dest, ch[0].signal, ch[1].signal,
+                      ch[0].signal->frame + ch[1].signal->frame, num);
 
-    if (dest->num > ch[1].signal->num) dest->num = ch[1].signal->num;
+    if (dest->format == SAMPLE_FLOAT) {
+        (ch[0].signal->format == SAMPLE_S32 ? diff_s32 : diff_float)
+            (dest, ch[0].signal->wide, ch[1].signal->wide, from);
+        return;
+    }
 
-    for (i = 0 ; i < dest->num ; i++) {
+    a = ch[0].signal->data + from;
+    b = ch[1].signal->data + from;
+    c = dest->data + from;
+    for (i = from ; i < dest->num ; i++) {
          sum = *a++ - *b++;
         if(sum > SHRT_MAX)
             sum = SHRT_MAX;
@@ -590,21 +719,28 @@ void diff(Signal *dest)
 /* The average of the two channels */
 void avg(Signal *dest)
 {
-    int i;
+    int i, num, from;
     short *a, *b, *c;
 
     if ((ch[0].signal == NULL) || (ch[1].signal == NULL)) return;
 
-    a = ch[0].signal->data;
-    b = ch[1].signal->data;
-    c = dest->data;
+    num = ch[0].signal->num;
+
+    if (num > ch[1].signal->num) num = ch[1].signal->num;
 
-    dest->frame = ch[0].signal->frame + ch[1].signal->frame;
-    dest->num = ch[0].signal->num;
+    from = math_start(dest, ch[0].signal, ch[1].signal,
+                      ch[0].signal->frame + ch[1].signal->frame, num);
 
-    if (dest->num > ch[1].signal->num) dest->num = ch[1].signal->num;
+    if (dest->format == SAMPLE_FLOAT) {
+        (ch[0].signal->format == SAMPLE_S32 ? avg_s32 : avg_float)
+            (dest, ch[0].signal->wide, ch[1].signal->wide, from);
+        return;
+    }
 
-    for (i = 0 ; i < dest->num ; i++) {
+    a = ch[0].signal->data + from;
+    b = ch[1].signal->data + from;
+    c = dest->data + from;
+    for (i = from ; i < dest->num ; i++) {
         *c++ = (*a++ + *b++) / 2;
     }
 }
@@ -623,7 +759,7 @@ void fft1(Signal *dest)
     if (in_progress != 0 || !scope.run)
         return;
 
-    fftW(ch[0].signal->data, dest->data, ch[0].signal->width);
+    fftW_signal(ch[0].signal, dest->data);
 }
 
 #ifndef FFT_TEST
@@ -635,7 +771,7 @@ void fft2(Signal *dest)
     if (in_progress != 0 || !scope.run)
         return;
 
-    fftW(ch[1].signal->data, dest->data, ch[1].signal->width);
+    fftW_signal(ch[1].signal, dest->data);
 }
 
 #else
@@ -680,6 +816,42 @@ void fft2(Signal *dest)
 }
 #endif
 
+/* Make sure a math function's Signal has room for 'width' samples, in 'format', and forget what it
+ * had if it didn't.
+ */
+
+static void size_math_signal(Signal *dest, int width, int format)
+{
+    struct func *f = func_of(dest);
+
+    if ((dest->width != width || dest->format != format) && f != NULL) {
+        f->a = f->b = NULL;
+    }
+
+    if (dest->width != width) {
+        dest->width = width;
+        if (dest->data != NULL)
+            free(dest->data);
+        dest->data = malloc(width * sizeof(short));
+        if (dest->wide != NULL)
+            free(dest->wide);
+        dest->wide = NULL;
+        if(dest->data == NULL){
+            fprintf(stderr, "malloc failed in size_math_signal()\n");
+            exit(0);
+        }
+    }
+
+    if (format != SAMPLE_S16 && dest->wide == NULL) {
+        dest->wide = malloc(width * WIDE_SIZE);
+        if(dest->wide == NULL){
+            fprintf(stderr, "malloc failed in size_math_signal()\n");
+            exit(0);
+        }
+    }
+    dest->format = format;
+}
+
 /* isvalid() functions for the various math functions.
  *
  * These functions also have the side effect of setting the volts/rate fields in the Signal
@@ -704,16 +876,8 @@ int ch1active(Signal *dest)
     dest->rate = ch[0].signal->rate;
     dest->volts = ch[0].signal->volts;
 
-    if (dest->width != ch[0].signal->width) {
-        dest->width = ch[0].signal->width;
-        if (dest->data != NULL)
-            free(dest->data);
-        dest->data = malloc(ch[0].signal->width * sizeof(short));
-        if(dest->data == NULL){
-            fprintf(stderr, "malloc failed in ch1active()\n");
-            exit(0);
-        }
-    }
+    size_math_signal(dest, ch[0].signal->width,
+                     (ch[0].signal->format == SAMPLE_S16) ? SAMPLE_S16 : SAMPLE_FLOAT);
 
     return 1;
 }
@@ -732,16 +896,8 @@ int ch2active(Signal *dest)
     dest->rate = ch[1].signal->rate;
     dest->volts = ch[1].signal->volts;
 
-    if (dest->width != ch[1].signal->width) {
-        dest->width = ch[1].signal->width;
-        if (dest->data != NULL)
-            free(dest->data);
-        dest->data = malloc(ch[1].signal->width * sizeof(short));
-        if(dest->data == NULL){
-            fprintf(stderr, "malloc failed in ch2active()\n");
-            exit(0);
-        }
-    }
+    size_math_signal(dest, ch[1].signal->width,
+                     (ch[1].signal->format == SAMPLE_S16) ? SAMPLE_S16 : SAMPLE_FLOAT);
 
     return 1;
 }
@@ -767,16 +923,9 @@ int chs12active(Signal *dest)
      * worst that can happen is that it is too big.
      */
 
-    if (dest->width != ch[0].signal->width) {
-        dest->width = ch[0].signal->width;
-        if (dest->data != NULL)
-            free(dest->data);
-        dest->data = malloc(ch[0].signal->width * sizeof(short));
-        if(dest->data == NULL){
-            fprintf(stderr, "malloc failed in ch12active()\n");
-            exit(0);
-        }
-    }
+    size_math_signal(dest, ch[0].signal->width,
+                     (ch[0].signal->format == SAMPLE_S16
+                      || ch[0].signal->format != ch[1].signal->format) ? SAMPLE_S16 : SAMPLE_FLOAT);
     return 1;
 }
 
@@ -812,13 +961,6 @@ int ch2FFTactive(Signal *dest)
     return(FFTactive(ch[1].signal, dest, FALSE));
 }
 
-struct func {
-    void (*func)(Signal *);
-    char *name;
-    int (*isvalid)(Signal *);   /* returns TRUE if this function is valid */
-    Signal signal;
-};
-
 struct func funcarray[] = {
     {inv1, "Inv. 1  ", ch1active},
     {inv2, "Inv. 2  ", ch2active},
@@ -930,8 +1072,14 @@ void init_math(void)
         if (once==1 && mem[i].data != NULL) {
             free(mem[i].data);
         }
+        if (once==1 && mem[i].wide != NULL) {
+            free(mem[i].wide);
+        }
         mem[i].data = NULL;
-        mem[i].num = mem[i].frame = mem[i].volts = 0;
+        mem[i].wide = NULL;
+        mem[i].format = SAMPLE_S16;
+        mem[i].num = mem[i].volts = 0;
+        mem[i].frame ++;        /* a new frame, not 0 again, so nothing takes it for the old one */
         mem[i].listeners = 0;
         sprintf(mem[i].name, "Memory %c", 'a' + i);
         mem[i].savestr[0] = 'a' + i;
@@ -994,12 +1142,88 @@ void cleanup_math(void)
     EndFFTW();
 }
 
+/* A sample of a Signal, at full resolution if it has it */
+
+static double sample_value(Signal *sig, int i)
+{
+    switch (sig->format) {
+    case SAMPLE_S32:
+        return ((int *) sig->wide)[i] / 65536.0;
+    case SAMPLE_FLOAT:
+        return ((float *) sig->wide)[i];
+    default:
+        return sig->data[i];
+    }
+}
+
+/* The minimum and maximum of samples from..num of a wide Signal, and where the maximum is, carrying
+ * on from the ones before 'from' (which start off as the first sample)
+ */
+
+static void wide_min_max(Signal *sig, int from, double *minp, double *maxp, int *imaxp)
+{
+    const int *s32 = sig->wide;
+    const float *flt = sig->wide;
+    int i, imax = *imaxp;
+
+    if (sig->format == SAMPLE_S32) {
+        int min = (from > 0) ? *minp * 65536 : s32[0], max = (from > 0) ? *maxp * 65536 : s32[0];
+
+        for (i = from ; i < sig->num ; i++) {
+            if (s32[i] < min)
+                min = s32[i];
+            if (s32[i] > max) {
+                max = s32[i];
+                imax = i;
+            }
+        }
+        *minp = min / 65536.0;
+        *maxp = max / 65536.0;
+    } else {
+        float min = (from > 0) ? *minp : flt[0], max = (from > 0) ? *maxp : flt[0];
+
+        for (i = from ; i < sig->num ; i++) {
+            if (flt[i] < min)
+                min = flt[i];
+            if (flt[i] > max) {
+                max = flt[i];
+                imax = i;
+            }
+        }
+        *minp = min;
+        *maxp = max;
+    }
+    *imaxp = imax;
+}
+
+/* What measure_data() has worked out so far about the samples of a sweep.  Those don't change once
+ * they're in, so each call only has to look at the new ones: the minimum and maximum carry on, and
+ * so does the search for rising edges, unless the new samples moved the midpoint it looks for.  The
+ * last 10 samples can't be ruled out as an edge until the ones after them arrive, so the search
+ * goes back over those.  FFTs (rate < 0) get rewritten in place, so they're always done afresh.
+ */
+
+static struct {
+    Signal *signal;
+    int frame, format;
+    int num;                    /* samples looked at */
+    double wmin, wmax;
+    int imax;
+    int midpoint, above;        /* what the edges were looked for with */
+    int next, prev;             /* where the edge search goes on from, and the sample before it */
+    int first, last, count;
+#if CALC_RMS
+    int second;
+#endif
+} measured;
+
 /* measure the given channel */
 
 void measure_data(Channel *sig, struct signal_stats *stats)
 {
-    int     i, k;
+    int     i, n;
     short   val, prev;
+    double  wval, wmin = 0, wmax = 0;
     int     min=0, max=0, midpoint=0;
     int     first = 0, last = 0, count = 0, imax = 0;
 #if CALC_RMS
@@ -1029,52 +1253,108 @@ void measure_data(Channel *sig, struct signal_stats *stats)
             first = scope.cursb;
             last = scope.cursa;
         }
-        stats->min = stats->max = sig->signal->data[(int)first];
-        if ((val = sig->signal->data[(int)last]) < stats->min)
-            stats->min = val;
-        else if (val > stats->max)
-            stats->max = val;
+        stats->min = stats->max = sample_value(sig->signal, first);
+        if ((wval = sample_value(sig->signal, last)) < stats->min)
+            stats->min = wval;
+        else if (wval > stats->max)
+            stats->max = wval;
         count = 2;
     } else {                    /* automatic period measurements */
-        min = max = sig->signal->data[0];
-        for (i = 0 ; i < sig->signal->num ; i++) {
-            val = sig->signal->data[i];
-            if (val < min)
-                min = val;
-            if (val > max) {
-                max = val;
-                imax = i;
+        if (measured.signal != sig->signal || measured.frame != sig->signal->frame
+            || measured.format != sig->signal->format || measured.num > sig->signal->num
+            || sig->signal->rate <= 0) {
+            measured.signal = sig->signal;
+            measured.frame = sig->signal->frame;
+            measured.format = sig->signal->format;
+            measured.num = 0;
+            measured.imax = 0;
+        }
+
+        if (sig->signal->format != SAMPLE_S16) {
+            /* at full resolution; the edges are still found in the short view */
+            wide_min_max(sig->signal, measured.num, &measured.wmin, &measured.wmax,
+                         &measured.imax);
+            min = measured.wmin;
+            max = measured.wmax;
+        } else {
+            if (measured.num == 0) {
+                measured.wmin = measured.wmax = sig->signal->data[0];
+            }
+            min = measured.wmin;
+            max = measured.wmax;
+            for (i = measured.num ; i < sig->signal->num ; i++) {
+                val = sig->signal->data[i];
+                if (val < min)
+                    min = val;
+                if (val > max) {
+                    max = val;
+                    measured.imax = i;
+                }
             }
+            measured.wmin = min;
+            measured.wmax = max;
         }
+        wmin = measured.wmin;
+        wmax = measured.wmax;
+        imax = measured.imax;
 
         /* locate and count rising edges
          * tries to handle handle noise by looking at the next 10 values.
          */
         midpoint = (min + max)/2;
-        prev = max;
-        for (i = 0; i < sig->signal->num; i++) {
-            val = sig->signal->data[i];
-            if (val > midpoint && prev <= midpoint){
-                int rising = 0;
-                for(k = i + 1; k < i + 11 && k < sig->signal->num; k++) {
-                    if(sig->signal->data[k] > val){
-                        rising++;
-                     }
-                 }   
-                if(rising > 5){
-                    if (!first)
-                        first = i;
+        if (measured.num == 0 || midpoint != measured.midpoint
+            || (max > midpoint) != measured.above) {
+            measured.midpoint = midpoint;
+            measured.above = (max > midpoint);
+            measured.next = 0;
+            measured.prev = max;
+            measured.first = measured.last = measured.count = 0;
 #if CALC_RMS
-                    else if (!second)
-                        second = i;
+            measured.second = 0;
 #endif
-                    last = i;
-                    i = k;
-                    count++;
+        }
+        measured.num = sig->signal->num;
+
+        first = measured.first;
+        last = measured.last;
+        count = measured.count;
+#if CALC_RMS
+        second = measured.second;
+#endif
+        prev = measured.prev;
+        i = measured.next;
+        while (i < sig->signal->num) {
+            n = trigger_search(sig->signal->data + i, sig->signal->num - i, midpoint, 1, prev);
+            if (i + n >= sig->signal->num) {
+                /* none yet, but the last 10 samples could still turn out to be one */
+                if (sig->signal->num - 10 > i) {
+                    i = sig->signal->num - 10;
+                    prev = sig->signal->data[i - 1];
                 }
+                break;
             }
-            prev = val;
+            i += n;
+            if (!first)
+                first = i;
+#if CALC_RMS
+            else if (!second)
+                second = i;
+#endif
+            last = i;
+            count++;
+
+            /* skip the samples that confirmed this edge, and the one after them */
+            prev = sig->signal->data[i];
+            i += 12;
         }
+        measured.next = i;
+        measured.prev = prev;
+        measured.first = first;
+        measured.last = last;
+        measured.count = count;
+#if CALC_RMS
+        measured.second = second;
+#endif
 
 #if CALC_RMS
         for (i = first; i < second; i++) {
@@ -1088,8 +1368,8 @@ void measure_data(Channel *sig, struct signal_stats *stats)
         }
 #endif
 
-        stats->min = min;
-        stats->max = max;
+        stats->min = wmin;
+        stats->max = wmax;
     }
 
     if (sig->signal->rate < 0) {
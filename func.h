@@ -24,8 +24,8 @@
 #endif
 
 struct signal_stats {
-    short min;                  /* Minimum signal value */
-    short max;                  /* Maximum signal value */
+    double min;                 /* Minimum signal value */
+    double max;                 /* Maximum signal value */
     int time;
     int freq;
 #ifdef CALC_RMS
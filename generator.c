@@ -0,0 +1,747 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements a synthetic signal generator data source
+ *
+ * Each channel plays one of a handful of waveforms - sine, square, chirp, noise, or an 8-bit
+ * digital counting pattern - at a sample rate that can go up to tens of MS/s, so trigger, math,
+ * FFT and display can be pushed as hard as we like with no acquisition hardware attached.
+ *
+ * Generating has to stay out of the way of what it's measuring, so nothing is computed per
+ * sample.  Each channel's waveform is worked out once, into a table holding a whole number of
+ * periods, and a sweep is made by copying runs of the table (memcpy, which is as vectorized as
+ * the C library can make it).  The sample at time t is table[t % len], so skipping ahead to keep
+ * up with the clock costs nothing.  Fitting many periods into a table keeps the frequency close to
+ * what was asked for: it's rounded to rate * periods / len, not to rate / (samples per period).
+ * A wave too slow for even one period to fit in TABLE_LEN samples gets a table of one period
+ * instead, which a 64-bit phase accumulator steps through, so the table never grows with the
+ * period; the sample at time t is then table[(t * inc) >> shift], which is just as easy to find.
+ *
+ * Options:
+ *
+ *      rate=HZ                 samples per second, per channel
+ *      chans=N                 number of channels, up to GEN_MAXCHANS
+ *      wave=WAVE,WAVE,...      waveform of channel a, b, ...: sine, square, chirp, noise, digital
+ *      freq=HZ,HZ,...          frequency of channel a, b, ... (the top of a chirp's sweep, and
+ *                              the rate a digital pattern counts through its 256 values)
+ *
+ * Like the other sources, playback is paced by the clock: a timerfd wakes the capture thread every
+ * SND_QUERY_INTERVALL ms, and it generates however many samples are due by then.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include "xoscope.h"            /* program defaults */
+#include "trigger.h"
+#include "record.h"
+
+#define GEN_MAXCHANS    8
+#define TABLE_BITS      16
+#define TABLE_LEN       (1 << TABLE_BITS)       /* periodic tables hold as many periods as fit in
+                                                 * about this, or one period of a slow wave */
+#define CHIRP_LEN       (1 << 20)
+#define NOISE_LEN       65521   /* prime, so its repeats don't line up with a sweep */
+#define AMPLITUDE       24000
+
+#define MIN_RATE        1000
+#define MAX_RATE        100000000
+
+enum { WAVE_SINE, WAVE_SQUARE, WAVE_CHIRP, WAVE_NOISE, WAVE_DIGITAL, NWAVES };
+
+static const char *wave_names[NWAVES] = { "sine", "square", "chirp", "noise", "digital" };
+
+typedef struct GenChan {
+    int wave;
+    double freq;
+    short *table;
+    int len;
+    int shift;                  /* 0, or for a slow wave, 64 - log2(len) (see generate()) */
+    guint64 inc;                /* ...and its phase step per sample, in 2^-64ths of a period */
+} GenChan;
+
+static GenChan gen[GEN_MAXCHANS];
+static int gen_chans = 2;
+static int gen_rate = 1000000;
+static int tables_rate = 0;             /* rate the tables were built for; 0 to rebuild */
+static const char *gen_error = NULL;
+
+static Signal gen_sig[GEN_MAXCHANS];
+
+static int trigmode = 0;
+static int triglev;
+static int trigch;
+static Trigger trig;
+static History history[GEN_MAXCHANS];
+
+static int width = 0;
+static short *scratch[GEN_MAXCHANS];
+
+static int timer = -1;
+static long long t = 0;                 /* time, in samples, of the next one we generate */
+
+/* Real-time pacing: the time generation (re)started, and how many samples are due since */
+static struct timespec start;
+static long long played = 0;
+
+static long long samples_total = 0;     /* for the throughput on the status line */
+static long long samples_skipped = 0;
+
+static double since(const struct timespec *ts)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - ts->tv_sec) + (now.tv_nsec - ts->tv_nsec) / 1e9;
+}
+
+/* Open the timer, and start each channel out as a different waveform, at 1 kHz */
+
+static void init_gen(void)
+{
+    static int done = 0;
+    int i;
+
+    if (done) return;
+    done = 1;
+
+    if ((timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+        gen_error = strerror(errno);
+    }
+
+    for (i = 0; i < GEN_MAXCHANS; i++) {
+        gen[i].wave = i % NWAVES;
+        gen[i].freq = 1000;
+        snprintf(gen_sig[i].name, sizeof(gen_sig[i].name), "Gen %c", 'a' + i);
+        snprintf(gen_sig[i].savestr, sizeof(gen_sig[i].savestr), "%c", 'a' + i);
+    }
+}
+
+/* Make 'g' a slow wave, with a table of one period of 2^bits samples */
+
+static void slow_wave(GenChan *g, int bits)
+{
+    g->len = 1 << bits;
+    g->shift = 64 - bits;
+    g->inc = (guint64) ldexp(g->freq / gen_rate, 64);
+}
+
+/* A table of a whole number of periods of a sine or square wave, 'len' samples long */
+
+static void build_periodic(GenChan *g, int square)
+{
+    double period = gen_rate / g->freq;
+    double periods = floor(TABLE_LEN / period);
+    int i;
+    double s;
+
+    if (periods < 1) {
+        slow_wave(g, TABLE_BITS);
+        periods = 1;
+    } else {
+        g->len = (int) (periods * period + 0.5);
+        if (g->len < 2) g->len = 2;
+        g->shift = 0;
+    }
+    g->table = g_renew(short, g->table, g->len);
+
+    for (i = 0; i < g->len; i++) {
+        s = sin(2 * M_PI * periods * i / g->len);
+        if (square) {
+            g->table[i] = (s >= 0) ? AMPLITUDE : -AMPLITUDE;
+        } else {
+            g->table[i] = (short) (s * AMPLITUDE);
+        }
+    }
+}
+
+/* A linear sweep from DC up to 'freq', lasting a tenth of a second (or as long as fits) */
+
+static void build_chirp(GenChan *g)
+{
+    int i;
+    double ph;
+
+    g->len = gen_rate / 10;
+    if (g->len > CHIRP_LEN) g->len = CHIRP_LEN;
+    if (g->len < 1024) g->len = 1024;
+    g->shift = 0;
+    g->table = g_renew(short, g->table, g->len);
+
+    for (i = 0; i < g->len; i++) {
+        ph = M_PI * g->freq * (double) i * i / ((double) gen_rate * g->len);
+        g->table[i] = (short) (sin(ph) * AMPLITUDE);
+    }
+}
+
+/* Uniform white noise, from a small LCG so every run is the same */
+
+static void build_noise(GenChan *g, unsigned int seed)
+{
+    int i;
+
+    g->len = NOISE_LEN;
+    g->shift = 0;
+    g->table = g_renew(short, g->table, g->len);
+
+    for (i = 0; i < g->len; i++) {
+        seed = seed * 1103515245 + 12345;
+        g->table[i] = (short) ((int) ((seed >> 16) % (2 * AMPLITUDE + 1)) - AMPLITUDE);
+    }
+}
+
+/* An 8-bit counter, stepping through all of its values 'freq' times a second */
+
+static void build_digital(GenChan *g)
+{
+    int step, i;
+
+    if (gen_rate / g->freq > TABLE_LEN) {
+        slow_wave(g, 8);
+        step = 1;
+    } else {
+        step = (int) (gen_rate / g->freq / 256 + 0.5);
+        if (step < 1) step = 1;
+        g->len = 256 * step;
+        g->shift = 0;
+    }
+    g->table = g_renew(short, g->table, g->len);
+
+    for (i = 0; i < g->len; i++) {
+        g->table[i] = i / step;
+    }
+}
+
+static void build_tables(void)
+{
+    int i;
+
+    for (i = 0; i < gen_chans; i++) {
+        switch (gen[i].wave) {
+        case WAVE_SINE:
+            build_periodic(&gen[i], 0);
+            break;
+        case WAVE_SQUARE:
+            build_periodic(&gen[i], 1);
+            break;
+        case WAVE_CHIRP:
+            build_chirp(&gen[i]);
+            break;
+        case WAVE_NOISE:
+            build_noise(&gen[i], i + 1);
+            break;
+        case WAVE_DIGITAL:
+            build_digital(&gen[i]);
+            break;
+        }
+        gen_sig[i].bits = (gen[i].wave == WAVE_DIGITAL) ? 8 : 0;
+    }
+    tables_rate = gen_rate;
+}
+
+/* Copy 'n' samples of channel 'c', starting at time 'from', into 'dst' */
+
+static void generate(int c, short *dst, long long from, int n)
+{
+    const GenChan *g = &gen[c];
+    int ph = from % g->len;
+    guint64 phase;
+    int k;
+
+    if (g->shift) {
+        phase = (guint64) from * g->inc;        /* modulo 2^64: a whole number of periods */
+        for (k = 0; k < n; k++, phase += g->inc) {
+            dst[k] = g->table[phase >> g->shift];
+        }
+        return;
+    }
+
+    while (n > 0) {
+        k = g->len - ph;
+        if (k > n) k = n;
+        memcpy(dst, g->table + ph, k * sizeof(short));
+        dst += k;
+        n -= k;
+        ph = 0;
+    }
+}
+
+/* Start the clock, and the timer that wakes us up to look at it */
+
+static void start_timer(void)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = 1;
+    its.it_interval.tv_nsec = SND_QUERY_INTERVALL * 1000000;
+    if (timer >= 0) timerfd_settime(timer, 0, &its, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    played = 0;
+}
+
+/* (Re)allocate whatever depends on the width of a sweep */
+
+static void alloc_buffers(void)
+{
+    int i;
+
+    if (width == 0) return;
+
+    for (i = 0; i < GEN_MAXCHANS; i++) {
+        if (gen_sig[i].data == NULL || gen_sig[i].width != width) {
+            g_free(gen_sig[i].data);
+            gen_sig[i].data = g_new0(short, width);
+            gen_sig[i].width = width;
+            scratch[i] = g_renew(short, scratch[i], (width < TRIGGER_STEP) ? width : TRIGGER_STEP);
+            history_resize(&history[i], pretrigger_samples(width), sizeof(short));
+        }
+    }
+}
+
+static int nchans(void)
+{
+    init_gen();
+    return gen_chans;
+}
+
+static int fd(void)
+{
+    init_gen();
+    return timer;
+}
+
+static Signal * gen_chan(int chan)
+{
+    return (chan >= 0 && chan < gen_chans) ? &gen_sig[chan] : NULL;
+}
+
+/* The trigger level comes in the sound cards' units (-128 to 127).  Digital patterns are 0 to 255,
+ * and are triggered on as they are, so their level can go that high.
+ */
+
+static int trig_scale(void)
+{
+    return (gen[trigch].wave == WAVE_DIGITAL) ? 1 : 256;
+}
+
+static int set_trigger(int chan, int *levelp, int mode)
+{
+    if (chan >= gen_chans) return 0;
+
+    trigch = chan;
+    trigmode = mode;
+    triglev = *levelp;
+    if (gen[chan].wave == WAVE_DIGITAL) {
+        if (triglev > 255) triglev = *levelp = 255;
+        if (triglev < 0) triglev = *levelp = 0;
+    } else {
+        if (triglev > 127) triglev = *levelp = 127;
+        if (triglev < -128) triglev = *levelp = -128;
+    }
+    trigger_set(&trig, mode, triglev * trig_scale(), scope.trighyst * trig_scale());
+    return 1;
+}
+
+static void clear_trigger(void)
+{
+    trigmode = 0;
+    trigger_set(&trig, 0, 0, 0);
+}
+
+/* Rates go in a 1-2-5 sequence: ladder(0) is MIN_RATE, then twice, five times, ten times that... */
+
+static int ladder(int i)
+{
+    static const int mant[3] = { 1, 2, 5 };
+    int r = MIN_RATE * mant[i % 3];
+
+    for (; i >= 3; i -= 3) r *= 10;
+    return r;
+}
+
+static int change_rate(int dir)
+{
+    int i;
+
+    for (i = 0; ladder(i) < MAX_RATE && ladder(i + 1) <= gen_rate; i++);
+
+    if (dir > 0 && ladder(i + 1) <= MAX_RATE) {
+        gen_rate = ladder(i + 1);
+        return 1;
+    } else if (dir < 0 && gen_rate > MIN_RATE) {
+        gen_rate = (ladder(i) < gen_rate) ? ladder(i) : ladder(i - 1);
+        return 1;
+    }
+    return 0;
+}
+
+static void set_width(int w)
+{
+    width = w;
+    alloc_buffers();
+}
+
+static void reset(void)
+{
+    int i;
+
+    init_gen();
+    alloc_buffers();
+    if (tables_rate != gen_rate) build_tables();
+
+    for (i = 0; i < gen_chans; i++) {
+        gen_sig[i].rate = gen_rate;
+        gen_sig[i].num = 0;
+        gen_sig[i].frame ++;
+        gen_sig[i].volts = 0;
+        history_clear(&history[i]);
+    }
+
+    trigger_start(&trig, gen_rate);
+    start_timer();
+    in_progress = 0;
+}
+
+/* Hand the recorder 'n' samples of every channel, from time 'from' on.  They're generated again
+ * rather than copied, since most of them never go to the display, and that way the ones we skip to
+ * keep up with the clock get recorded too.
+ */
+
+static void record_generated(long long from, long long n)
+{
+    short *out[GEN_MAXCHANS];
+    void *wout[GEN_MAXCHANS];
+    int c, k;
+
+    if (!record_active()) return;
+
+    record_staging(gen_chans, 0, out, wout);
+    for (; n > 0; n -= k, from += k) {
+        k = (n < RECORD_STEP) ? n : RECORD_STEP;
+        for (c = 0; c < gen_chans; c++) {
+            generate(c, out[c], from, k);
+        }
+        record_samples(gen_sig[0].frame, gen_rate, SAMPLE_S16, (1u << gen_chans) - 1, out, wout,
+                       k);
+    }
+}
+
+/* Look for the trigger (if we're not in the middle of a sweep) and generate up to 'count' samples
+ * into the Signal arrays, like the other sources' process functions.  Returns 0 if we're still
+ * waiting for a trigger, otherwise 1, and sets '*used' to the number of samples we're done with.
+ */
+
+static int process_samples(int count, int *used)
+{
+    int capturing[GEN_MAXCHANS];
+    int c, i = 0, n, delay = 0;
+    int pre, from = 0, base = 0, k = 0;
+
+    if (count > width) {
+        count = width;
+    }
+    *used = count;
+
+    for (c = 0; c < gen_chans; c++) {
+        capturing[c] = (gen_sig[c].listeners > 0) || (trigmode && c == trigch);
+    }
+
+    if (!in_progress) {
+        if (trigmode) {
+            /* The trigger channel is generated into scratch[] a step at a time, and the others
+             * only as far as the history needs them
+             */
+            pre = pretrigger_samples(width);
+            for (c = 0; c < gen_chans; c++) {
+                if (capturing[c]) history_reserve(&history[c], pre, sizeof(short));
+            }
+
+            for (;;) {
+                if (i == base + k) {
+                    if (i >= count) {
+                        return 0;
+                    }
+                    base = i;
+                    k = (count - base < TRIGGER_STEP) ? count - base : TRIGGER_STEP;
+                    generate(trigch, scratch[trigch], t + base, k);
+                }
+                i += trigger_find(&trig, scratch[trigch] + i - base, base + k - i, &delay);
+                if (pre > 0) {
+                    for (c = 0; c < gen_chans; c++) {
+                        if (capturing[c]) {
+                            if (c != trigch) {
+                                generate(c, scratch[c] + from - base, t + from, i - from);
+                            }
+                            history_push(&history[c], scratch[c] + from - base, i - from);
+                        }
+                    }
+                    from = i;
+                }
+                if (i < base + k) {
+                    if (history[trigch].fill >= pre) {
+                        break;
+                    }
+                    trigger_skip(&trig, scratch[trigch] + i - base, 1);
+                    i ++;
+                }
+            }
+
+            for (c = 0; c < gen_chans; c++) {
+                if (capturing[c]) {
+                    history_copy(&history[c], gen_sig[c].data, pre);
+                }
+            }
+            in_progress = pre;
+        }
+
+        for (c = 0; c < gen_chans; c++) {
+            gen_sig[c].delay = delay;
+            gen_sig[c].frame ++;
+        }
+    }
+
+    /* Generate as much as we have, up to a full screen */
+
+    n = count - i;
+    if (n > width - in_progress) {
+        n = width - in_progress;
+    }
+
+    for (c = 0; c < gen_chans; c++) {
+        if (capturing[c]) {
+            generate(c, gen_sig[c].data + in_progress, t + i, n);
+        }
+    }
+
+    if (trigmode) {
+        trigger_skip(&trig, gen_sig[trigch].data + in_progress, n);
+        if (scope.trigpos > 0) {
+            for (c = 0; c < gen_chans; c++) {
+                if (capturing[c]) {
+                    history_push(&history[c], gen_sig[c].data + in_progress, n);
+                }
+            }
+        }
+    }
+
+    in_progress += n;
+    i += n;
+
+    for (c = 0; c < gen_chans; c++) {
+        gen_sig[c].num = in_progress;
+    }
+
+    if (in_progress >= width) {
+        in_progress = 0;
+    }
+    *used = i;
+
+    return 1;
+}
+
+static int get_data(void)
+{
+    unsigned long long ticks;
+    long long due;
+    int used, i, ret = 0;
+
+    if (timer < 0 || width == 0 || tables_rate == 0) return 0;
+
+    if (read(timer, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN) return 0;
+
+    due = (long long) (since(&start) * gen_rate) - played;
+
+    /* If we've fallen more than a screenful behind, skip ahead to keep up with the clock */
+
+    if (due > width) {
+        record_generated(t, due - width);
+        t += due - width;
+        played += due - width;
+        samples_skipped += due - width;
+        trigger_gap(&trig, due - width);
+        for (i = 0; i < gen_chans; i++) {
+            history_clear(&history[i]);
+        }
+        due = width;
+    }
+
+    while (due > 0) {
+        ret |= process_samples(due, &used);
+        record_generated(t, used);
+        t += used;
+        played += used;
+        samples_total += used;
+        due -= used;
+        if (ret && !in_progress) {              /* sweep complete; get_data() must return now */
+            break;
+        }
+    }
+
+    return ret;
+}
+
+static const char * status_str(int i)
+{
+    static char string[32];
+    static struct timespec then;
+    static long long total_then, skipped_then;
+    static double rate, lost;
+    double secs;
+
+    switch (i) {
+    case 0:
+        snprintf(string, sizeof(string), "%d x %.6g MS/s", gen_chans, gen_rate / 1e6);
+        return string;
+
+    case 1:
+        return "";
+
+    case 2:
+        return gen_error ? gen_error : "";
+
+    case 3:
+    case 4:
+        secs = since(&then);
+        if (secs >= 1.0) {
+            rate = (samples_total - total_then) / secs;
+            lost = (samples_skipped - skipped_then) / secs;
+            clock_gettime(CLOCK_MONOTONIC, &then);
+            total_then = samples_total;
+            skipped_then = samples_skipped;
+        }
+        if (i == 3) {
+            snprintf(string, sizeof(string), "%.2f MS/s swept", rate / 1e6);
+        } else if (lost > 0) {
+            snprintf(string, sizeof(string), "%.2f MS/s skipped", lost / 1e6);
+        } else {
+            return "";
+        }
+        return string;
+    }
+    return NULL;
+}
+
+/* Hand each item of a comma-separated list to 'set', for channel a, b, ...; the channels past
+ * the end of the list keep what they had
+ */
+
+static void parse_list(const char *list, void (*set)(int chan, const char *value))
+{
+    int c;
+
+    for (c = 0; c < GEN_MAXCHANS && *list != '\0'; c++) {
+        set(c, list);
+        list += strcspn(list, ",");
+        if (*list == ',') list ++;
+    }
+}
+
+static void set_wave(int chan, const char *value)
+{
+    int w;
+
+    for (w = 0; w < NWAVES; w++) {
+        if (strncmp(value, wave_names[w], strlen(wave_names[w])) == 0) {
+            gen[chan].wave = w;
+            return;
+        }
+    }
+    gen_error = "unknown waveform";
+}
+
+static void set_freq(int chan, const char *value)
+{
+    double f = atof(value);
+
+    if (f > MAX_RATE) f = MAX_RATE;
+    if (f > 0) gen[chan].freq = f;
+}
+
+static int set_option(char *option)
+{
+    int n;
+
+    init_gen();
+    gen_error = NULL;
+
+    if (strncmp(option, "rate=", 5) == 0) {
+        n = atoi(option + 5);
+        gen_rate = (n < MIN_RATE) ? MIN_RATE : (n > MAX_RATE) ? MAX_RATE : n;
+    } else if (strncmp(option, "chans=", 6) == 0) {
+        n = atoi(option + 6);
+        gen_chans = (n < 1) ? 1 : (n > GEN_MAXCHANS) ? GEN_MAXCHANS : n;
+    } else if (strncmp(option, "wave=", 5) == 0) {
+        parse_list(option + 5, set_wave);
+    } else if (strncmp(option, "freq=", 5) == 0) {
+        parse_list(option + 5, set_freq);
+    } else {
+        return 0;
+    }
+
+    tables_rate = 0;
+    return 1;
+}
+
+static char * save_option(int i)
+{
+    static char buf[GEN_MAXCHANS * 16 + 8];
+    int c, n;
+
+    switch (i) {
+    case 0:
+        snprintf(buf, sizeof(buf), "rate=%d", gen_rate);
+        return buf;
+
+    case 1:
+        snprintf(buf, sizeof(buf), "chans=%d", gen_chans);
+        return buf;
+
+    case 2:
+        n = snprintf(buf, sizeof(buf), "wave=");
+        for (c = 0; c < gen_chans; c++) {
+            n += snprintf(buf + n, sizeof(buf) - n, "%s%s", c ? "," : "", wave_names[gen[c].wave]);
+        }
+        return buf;
+
+    case 3:
+        n = snprintf(buf, sizeof(buf), "freq=");
+        for (c = 0; c < gen_chans; c++) {
+            n += snprintf(buf + n, sizeof(buf) - n, "%s%g", c ? "," : "", gen[c].freq);
+        }
+        return buf;
+
+    default:
+        return NULL;
+    }
+}
+
+DataSrc datasrc_gen = {
+    "Generator",
+    nchans,
+    gen_chan,
+    set_trigger,
+    clear_trigger,
+    change_rate,
+    set_width,
+    reset,
+    fd,
+    get_data,
+    status_str,
+    NULL,  /* option1, */
+    NULL,  /* option1str, */
+    NULL,  /* option2, */
+    NULL,  /* option2str, */
+    set_option,
+    save_option,
+    NULL,  /* gtk_options */
+    NULL,  /* poll_fds */
+    NULL,  /* poll_revents */
+};
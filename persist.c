@@ -0,0 +1,339 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the persistence display, which is what accumulate mode shows
+ *
+ * Accumulate mode used to leave every trace it drew in the databox, so a fast timebase piled up
+ * thousands of graphs until memory or the CPU gave out.  Now each channel gets a histogram of
+ * hits, one counter per pixel of the databox, and every frame that comes in is rasterized into
+ * it: each column the trace passes through gets one more hit in each row it covers.  The counts
+ * fade away exponentially, with a time constant of scope.persist ms (or not at all if that's 0).
+ * On expose, they're turned into one image, brighter where the trace has been more often, and drawn
+ * over the databox with only the newest trace drawn as a graph on top.  However many frames come
+ * in, it costs one image's worth of memory and drawing.
+ *
+ * The capture thread rasterizes frames from the data sources as they're completed, so the display
+ * shows every one of them, not just the ones the GUI got around to drawing.  Math and memory
+ * channels are rasterized by the GUI, from draw_data().  Either way, new hits go into a trace's
+ * 'fresh' histogram, under 'persist_lock'.  On expose, the GUI swaps that for an empty one and
+ * lets go of the lock before it adds the new hits to its own 'hits', fades them and draws them, so
+ * the capture thread (which holds driver_lock while it publishes) never waits for a redraw.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include <gtk/gtk.h>
+#include "xoscope.h"
+#include "persist.h"
+
+#define PERSIST_FLOOR   1e-3    /* hits that have faded below this are gone */
+
+typedef struct Trace {
+    Signal *signal;             /* NULL if this channel isn't persisting */
+    PersistView view;
+    GdkColor color;
+    float *hits;                /* view.width columns of view.height rows, for the GUI alone */
+    float *fresh;               /* ...hits since the last expose, under persist_lock */
+    float *spare;               /* ...an empty one to swap for 'fresh', for the GUI alone */
+    int frame;                  /* last frame added */
+    int counted;                /* ...if we've added one at all */
+    int captured;               /* the capture thread adds this signal's frames */
+} Trace;
+
+static Trace traces[CHANNELS];
+static GMutex persist_lock;
+static GdkPixbuf *image = NULL;
+static gint64 decayed = 0;      /* when the hits were last faded */
+
+/* Set up channel 'chan' to persist 'sig', as seen through 'view'.  Called by the GUI before every
+ * frame it draws, so this has to be cheap if nothing's changed.  Anything that moves the trace on
+ * the screen starts it over.
+ */
+
+void persist_set(int chan, Signal *sig, const PersistView *view, const GdkColor *color)
+{
+    Trace *t = &traces[chan];
+    size_t size = (size_t) view->width * view->height;
+
+    if (view->width <= 0 || view->height <= 0) {
+        persist_drop(chan);
+        return;
+    }
+
+    g_mutex_lock(&persist_lock);
+    if (t->signal != sig || memcmp(&t->view, view, sizeof(PersistView)) != 0) {
+        if (t->hits == NULL || t->view.width != view->width || t->view.height != view->height) {
+            g_free(t->hits);
+            g_free(t->fresh);
+            g_free(t->spare);
+            t->hits = g_new0(float, size);
+            t->fresh = g_new0(float, size);
+            t->spare = g_new0(float, size);
+        } else {
+            memset(t->hits, 0, size * sizeof(float));
+            memset(t->fresh, 0, size * sizeof(float));
+            memset(t->spare, 0, size * sizeof(float));
+        }
+        if (t->signal != sig) t->captured = 0;
+        t->signal = sig;
+        t->view = *view;
+        t->counted = 0;
+    }
+    t->color = *color;
+    g_mutex_unlock(&persist_lock);
+}
+
+/* Stop persisting channel 'chan' */
+
+void persist_drop(int chan)
+{
+    Trace *t = &traces[chan];
+
+    if (t->signal == NULL) return;
+
+    g_mutex_lock(&persist_lock);
+    g_free(t->hits);
+    g_free(t->fresh);
+    g_free(t->spare);
+    t->hits = t->fresh = t->spare = NULL;
+    t->signal = NULL;
+    t->captured = 0;
+    g_mutex_unlock(&persist_lock);
+}
+
+/* Forget everything that's been accumulated, but carry on accumulating */
+
+void persist_clear(void)
+{
+    int i;
+
+    g_mutex_lock(&persist_lock);
+    for (i = 0; i < CHANNELS; i++) {
+        Trace *t = &traces[i];
+        size_t size = (size_t) t->view.width * t->view.height;
+        if (t->hits != NULL) {
+            memset(t->hits, 0, size * sizeof(float));
+            memset(t->fresh, 0, size * sizeof(float));
+            memset(t->spare, 0, size * sizeof(float));
+        }
+        t->counted = 0;
+    }
+    g_mutex_unlock(&persist_lock);
+}
+
+/* Add a hit to rows 'lo' through 'hi' (fractional, in either order) of column 'col' */
+
+static void persist_span(Trace *t, int col, double lo, double hi)
+{
+    float *column;
+    int r0, r1;
+
+    if (col < 0 || col >= t->view.width) return;
+
+    if (lo > hi) {
+        double swap = lo;
+        lo = hi;
+        hi = swap;
+    }
+    if (hi < 0 || lo >= t->view.height) return;
+
+    r0 = (lo < 0) ? 0 : (int) lo;
+    r1 = (hi >= t->view.height) ? t->view.height - 1 : (int) hi;
+    column = t->fresh + (size_t) col * t->view.height;
+    while (r0 <= r1) {
+        column[r0++] += 1;
+    }
+}
+
+/* Rasterize 'num' samples into a trace's histogram.  We keep track of the rows the line between
+ * the samples covers in the current column, and when it moves on to the next column, find where
+ * it crosses between them, so the line stays continuous however many samples or columns apart the
+ * samples are.
+ */
+
+static void persist_rasterize(Trace *t, const short *data, int num)
+{
+    double x0 = t->view.x0, dx = t->view.dx;
+    double y0 = t->view.y0, dy = t->view.dy;
+    double x, y, px, py, cross, lo, hi;
+    int k, col, c;
+
+    if (dx <= 0 || num <= 0) return;
+
+    /* Skip the samples left of the window, keeping one to draw the line in from */
+
+    k = 0;
+    if (x0 < 0) {
+        if (-x0 / dx >= num) return;
+        k = (int) (-x0 / dx) - 1;
+        if (k < 0) k = 0;
+    }
+
+    px = x0 + k * dx;
+    py = y0 + data[k] * dy;
+    col = (int) floor(px);
+    lo = hi = py;
+
+    for (k++; k < num && col < t->view.width; k++) {
+        x = x0 + k * dx;
+        y = y0 + data[k] * dy;
+        c = (int) floor(x);
+
+        while (col < c && col < t->view.width) {
+            cross = py + (y - py) * (col + 1 - px) / (x - px);
+            if (cross < lo) lo = cross;
+            if (cross > hi) hi = cross;
+            persist_span(t, col, lo, hi);
+            col ++;
+            lo = hi = cross;
+        }
+        if (y < lo) lo = y;
+        if (y > hi) hi = y;
+        px = x;
+        py = y;
+    }
+    persist_span(t, col, lo, hi);
+}
+
+/* A frame of 'num' samples of 'sig' has been completed.  The capture thread calls this with
+ * 'captured' set, for the data sources' signals; from then on, the GUI's calls for them are
+ * ignored.  A frame is only counted once, however many times we're told about it.
+ */
+
+void persist_frame(Signal *sig, const short *data, int num, int frame, int captured)
+{
+    Trace *t;
+    int i;
+
+    g_mutex_lock(&persist_lock);
+    for (i = 0; i < CHANNELS; i++) {
+        t = &traces[i];
+        if (t->signal != sig || t->hits == NULL) continue;
+        if (captured) {
+            t->captured = 1;
+        } else if (t->captured) {
+            continue;
+        }
+        if (t->counted && t->frame == frame) continue;
+
+        persist_rasterize(t, data, num);
+        t->frame = frame;
+        t->counted = 1;
+    }
+    g_mutex_unlock(&persist_lock);
+}
+
+/* Fade the hits for the time since we last did, add the new ones (leaving 'spare' empty again),
+ * and find the most any pixel has
+ */
+
+static float persist_decay(Trace *t, double factor)
+{
+    size_t i, size = (size_t) t->view.width * t->view.height;
+    float *h = t->hits, *n = t->spare;
+    float most = 0;
+
+    for (i = 0; i < size; i++) {
+        if (factor < 1) {
+            h[i] *= factor;
+            if (h[i] < PERSIST_FLOOR) h[i] = 0;
+        }
+        h[i] += n[i];
+        n[i] = 0;
+        if (h[i] > most) most = h[i];
+    }
+    return most;
+}
+
+/* Connected (after the databox's own handler) to the databox's expose-event.  Each channel's hits
+ * become the alpha of its color, on a log scale so that a trace seen once in a thousand frames
+ * still shows, and the channels are laid over each other in order.
+ */
+
+gboolean persist_expose(GtkWidget *widget, GdkEventExpose *event, gpointer ignored)
+{
+    int width = widget->allocation.width, height = widget->allocation.height;
+    GdkRectangle all = {0, 0, width, height}, area;
+    float most[CHANNELS];
+    double factor = 1;
+    gint64 now = g_get_monotonic_time();
+    guchar *pixels, *p;
+    int stride, i, r, c, any = 0;
+    size_t at;
+    double a, ta, scale;
+    float *swap;
+
+    /* Take the new hits, and leave the capture thread an empty histogram for more */
+
+    g_mutex_lock(&persist_lock);
+    for (i = 0; i < CHANNELS; i++) {
+        Trace *t = &traces[i];
+        if (t->hits == NULL) continue;
+        swap = t->fresh;
+        t->fresh = t->spare;
+        t->spare = swap;
+    }
+    g_mutex_unlock(&persist_lock);
+
+    if (scope.persist > 0 && decayed != 0) {
+        factor = exp(-(now - decayed) / (1000.0 * scope.persist));
+    }
+    decayed = now;
+
+    for (i = 0; i < CHANNELS; i++) {
+        Trace *t = &traces[i];
+        most[i] = 0;
+        if (t->hits == NULL) continue;
+        if (t->view.width != width || t->view.height != height) continue;
+        most[i] = persist_decay(t, factor);
+        if (most[i] > 0) any = 1;
+    }
+
+    if (!any) return FALSE;
+
+    if (image == NULL
+        || gdk_pixbuf_get_width(image) != width || gdk_pixbuf_get_height(image) != height) {
+        if (image != NULL) g_object_unref(image);
+        image = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+    }
+    pixels = gdk_pixbuf_get_pixels(image);
+    stride = gdk_pixbuf_get_rowstride(image);
+
+    for (r = 0; r < height; r++) {
+        memset(pixels + r * stride, 0, width * 4);
+    }
+
+    for (i = 0; i < CHANNELS; i++) {
+        Trace *t = &traces[i];
+        double red = t->color.red / 257.0, green = t->color.green / 257.0;
+        double blue = t->color.blue / 257.0;
+
+        if (most[i] <= 0) continue;
+        scale = 1 / log1p(most[i]);
+
+        for (c = 0; c < width; c++) {
+            at = (size_t) c * height;
+            for (r = 0; r < height; r++) {
+                if (t->hits[at + r] == 0) continue;
+                ta = log1p(t->hits[at + r]) * scale;
+                p = pixels + r * stride + c * 4;
+                a = p[3] / 255.0 * (1 - ta);
+                p[0] = (red * ta + p[0] * a) / (ta + a);
+                p[1] = (green * ta + p[1] * a) / (ta + a);
+                p[2] = (blue * ta + p[2] * a) / (ta + a);
+                p[3] = (ta + a) * 255;
+            }
+        }
+    }
+
+    if (gdk_rectangle_intersect(&event->area, &all, &area)) {
+        gdk_draw_pixbuf(widget->window, NULL, image, area.x, area.y, area.x, area.y,
+                        area.width, area.height, GDK_RGB_DITHER_NONE, 0, 0);
+    }
+
+    return FALSE;
+}
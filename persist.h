@@ -0,0 +1,25 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * persistence display routines available outside of persist.c
+ *
+ */
+
+#include <gtk/gtk.h>
+
+/* Where a display channel's samples land in the databox: sample k with value v goes at column
+ * x0 + k * dx and row y0 + v * dy, counting pixels from the top left of a width x height window.
+ */
+
+typedef struct PersistView {
+    int width, height;
+    double x0, dx;
+    double y0, dy;
+} PersistView;
+
+void            persist_set(int chan, Signal *sig, const PersistView *view, const GdkColor *color);
+void            persist_drop(int chan);
+void            persist_clear(void);
+void            persist_frame(Signal *sig, const short *data, int num, int frame, int captured);
+gboolean        persist_expose(GtkWidget *widget, GdkEventExpose *event, gpointer ignored);
@@ -0,0 +1,343 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the recorder, which saves everything a data source captures to disk
+ *
+ * The memory channels only hold what's on the screen, and writefile() saves them as text.  The
+ * recorder is for keeping hours of raw acquisition instead: each data source hands it every block
+ * of samples it reads, for all its channels, before any of them go near the trigger, and tells it
+ * how many it skipped without reading.  It goes to disk in the binary format described in record.h.
+ *
+ * Capture must never wait for the disk, so the capture thread only ever copies samples into a
+ * chunk of memory.  A full chunk (or one that's been waiting RECORD_FLUSH seconds) is queued for
+ * the writer thread, which writes it out with an index after it and queues it back as empty.
+ * With RECORD_CHUNKS of them, one fills while the other is written.  If the writer still has all
+ * of them when the capture thread needs one, the block is dropped, counted, and reported; the
+ * next block that gets through says how many went missing, and its time shows the gap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <glib.h>
+#include "xoscope.h"
+#include "record.h"
+
+#define RECORD_CHUNK    (8 << 20)       /* bytes of blocks handed to the writer at a time */
+#define RECORD_CHUNKS   2               /* double buffered */
+#define RECORD_BLOCKS   4096            /* most blocks in a chunk (and so in an index) */
+#define RECORD_FLUSH    0.5             /* seconds a part-filled chunk waits for more */
+
+typedef struct Chunk {
+    char *buf;
+    size_t used;
+    int blocks;
+    RecordIndexEntry index[RECORD_BLOCKS];      /* offsets are into buf, until the writer has it */
+    gint64 started;                             /* when the first block went in */
+} Chunk;
+
+static Chunk chunks[RECORD_CHUNKS];
+static Chunk stop;                      /* queued to tell the writer to finish up */
+static GAsyncQueue *empty = NULL;       /* chunks for the capture thread to fill... */
+static GAsyncQueue *full = NULL;        /* ...and for the writer to write */
+static GThread *writer = NULL;
+
+static char record_path[256];
+static int record_fd = -1;
+static gint recording = 0;
+
+/* These belong to the capture thread */
+
+static Chunk *fill = NULL;              /* chunk we're filling, if any */
+static guint64 record_time = 0;         /* of the next sample */
+static guint32 record_drops = 0;        /* blocks dropped since the last one we kept */
+static short *stage[RECORD_MAXCHANS];   /* where the sources put samples for record_samples() */
+static void *wstage[RECORD_MAXCHANS];
+
+/* Counters, for the reports */
+
+static gint blocks_kept = 0;
+static gint blocks_dropped = 0;
+static guint64 bytes_written = 0;       /* the writer's */
+
+static int write_all(const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(record_fd, p, len)) < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static gpointer writer_thread(gpointer ignored)
+{
+    guint64 offset = sizeof(RecordHeader);
+    guint64 last = 0;
+    gint64 reported = 0;
+    int dropped = 0, failed = 0;
+    RecordIndex index;
+    RecordTrailer trailer;
+    Chunk *c;
+    int i;
+
+    while ((c = g_async_queue_pop(full)) != &stop) {
+
+        for (i = 0; i < c->blocks; i++) {
+            c->index[i].offset += offset;
+        }
+        index.magic = RECORD_INDEX;
+        index.count = c->blocks;
+        index.prev = last;
+
+        if (!failed) {
+            if (write_all(c->buf, c->used) && write_all(&index, sizeof(index))
+                && write_all(c->index, c->blocks * sizeof(RecordIndexEntry))) {
+                last = offset + c->used;
+                offset = last + sizeof(index) + c->blocks * sizeof(RecordIndexEntry);
+                bytes_written = offset;
+            } else {
+                fprintf(stderr, "record: %s: %s\n", record_path, strerror(errno));
+                failed = 1;
+            }
+        }
+
+        c->used = 0;
+        c->blocks = 0;
+        g_async_queue_push(empty, c);
+
+        /* Let them know about dropped blocks, but not more than once a second */
+
+        if (g_atomic_int_get(&blocks_dropped) != dropped
+            && g_get_monotonic_time() - reported >= G_USEC_PER_SEC) {
+            dropped = g_atomic_int_get(&blocks_dropped);
+            reported = g_get_monotonic_time();
+            fprintf(stderr, "record: %s: %d blocks dropped so far\n", record_path, dropped);
+        }
+    }
+
+    if (!failed && last != 0) {
+        trailer.magic = RECORD_END;
+        trailer.unused = 0;
+        trailer.last = last;
+        if (write_all(&trailer, sizeof(trailer))) {
+            bytes_written += sizeof(trailer);
+        }
+    }
+
+    return NULL;
+}
+
+/* Start recording to 'path', after stopping any recording already going.  Returns 0, having said
+ * why, if we can't.
+ */
+
+int record_open(const char *path)
+{
+    RecordHeader header;
+    int i;
+
+    record_close();
+
+    strncpy(record_path, path, sizeof(record_path) - 1);
+    record_path[strcspn(record_path, "\n")] = '\0';
+
+    if ((record_fd = open(record_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        fprintf(stderr, "record: %s: %s\n", record_path, strerror(errno));
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    header.version = RECORD_VERSION;
+    header.size = sizeof(header);
+    header.started = time(NULL);
+    if (!write_all(&header, sizeof(header))) {
+        fprintf(stderr, "record: %s: %s\n", record_path, strerror(errno));
+        close(record_fd);
+        record_fd = -1;
+        return 0;
+    }
+
+    empty = g_async_queue_new();
+    full = g_async_queue_new();
+    for (i = 0; i < RECORD_CHUNKS; i++) {
+        if (chunks[i].buf == NULL) chunks[i].buf = g_malloc(RECORD_CHUNK);
+        chunks[i].used = 0;
+        chunks[i].blocks = 0;
+        g_async_queue_push(empty, &chunks[i]);
+    }
+
+    fill = NULL;
+    record_time = 0;
+    record_drops = 0;
+    g_atomic_int_set(&blocks_kept, 0);
+    g_atomic_int_set(&blocks_dropped, 0);
+    bytes_written = 0;
+
+    writer = g_thread_new("record", writer_thread, NULL);
+    g_atomic_int_set(&recording, 1);
+
+    return 1;
+}
+
+/* Write out what we have and stop.  The capture thread must be done with record_samples() by now,
+ * which it is after acquire_close().
+ */
+
+void record_close(void)
+{
+    if (!g_atomic_int_get(&recording)) return;
+    g_atomic_int_set(&recording, 0);
+
+    if (fill != NULL) {
+        g_async_queue_push(full, fill);
+        fill = NULL;
+    }
+    g_async_queue_push(full, &stop);
+    g_thread_join(writer);
+    writer = NULL;
+
+    close(record_fd);
+    record_fd = -1;
+
+    g_async_queue_unref(empty);
+    g_async_queue_unref(full);
+    empty = full = NULL;
+
+    fprintf(stderr, "record: %s: %.1f MB, %d blocks kept, %d dropped\n", record_path,
+            bytes_written / 1e6, g_atomic_int_get(&blocks_kept),
+            g_atomic_int_get(&blocks_dropped));
+}
+
+/* Are we recording?  The data sources ask before they go to the trouble of staging samples. */
+
+int record_active(void)
+{
+    return g_atomic_int_get(&recording);
+}
+
+/* Point data[0..nchans) at room for RECORD_STEP samples each, and wdata[] at as many wide ones if
+ * 'wide' is set (or at NULL if not), for a data source to put samples in on their way to
+ * record_samples().  The room belongs to the capture thread, and stays until we exit.
+ */
+
+void record_staging(int nchans, int wide, short **data, void **wdata)
+{
+    int c;
+
+    for (c = 0; c < nchans && c < RECORD_MAXCHANS; c++) {
+        if (stage[c] == NULL) stage[c] = g_new(short, RECORD_STEP);
+        if (wide && wstage[c] == NULL) wstage[c] = g_malloc(RECORD_STEP * WIDE_SIZE);
+        data[c] = stage[c];
+        wdata[c] = wide ? wstage[c] : NULL;
+    }
+}
+
+/* Called by the capture thread when a data source skips 'n' samples without reading them */
+
+void record_gap(long long n)
+{
+    if (g_atomic_int_get(&recording) && n > 0) record_time += n;
+}
+
+/* Called by the capture thread with 'n' new samples of each channel in the 'chans' mask, channel c
+ * at data[c], and at wide[c] too unless 'format' is SAMPLE_S16.  A block too big for a chunk gets
+ * split across several.
+ */
+
+void record_samples(int frame, int rate, int format, unsigned int chans, short **data,
+                    void **wide, int n)
+{
+    RecordBlock block;
+    gint64 now;
+    char *p;
+    size_t bytes;
+    int nchans = 0, done = 0;
+    int c, k;
+
+    if (!g_atomic_int_get(&recording) || n <= 0) return;
+
+    for (c = 0; c < RECORD_MAXCHANS; c++) {
+        if (chans & (1u << c)) nchans ++;
+    }
+    if (nchans == 0) return;
+
+    bytes = nchans * (sizeof(short) + ((format != SAMPLE_S16) ? WIDE_SIZE : 0));
+
+    now = g_get_monotonic_time();
+
+    while (done < n) {
+
+        /* Pass on the chunk we have if there's no room left in it, or it's waited long enough */
+
+        if (fill != NULL && (fill->blocks == RECORD_BLOCKS
+                             || fill->used + sizeof(block) + bytes > RECORD_CHUNK
+                             || now - fill->started > RECORD_FLUSH * G_USEC_PER_SEC)) {
+            g_async_queue_push(full, fill);
+            fill = NULL;
+        }
+
+        /* The writer has all the others, so this block is lost rather than wait for the disk */
+
+        if (fill == NULL) {
+            if ((fill = g_async_queue_try_pop(empty)) == NULL) {
+                record_time += n - done;
+                record_drops ++;
+                g_atomic_int_inc(&blocks_dropped);
+                return;
+            }
+            fill->started = now;
+        }
+
+        k = (RECORD_CHUNK - fill->used - sizeof(block)) / bytes;
+        if (k > n - done) k = n - done;
+
+        block.magic = RECORD_BLOCK;
+        block.chans = chans;
+        block.rate = rate;
+        block.n = k;
+        block.time = record_time;
+        block.frame = frame;
+        block.dropped = record_drops;
+        block.format = format;
+        block.unused = 0;
+
+        fill->index[fill->blocks].time = record_time;
+        fill->index[fill->blocks].offset = fill->used;
+        fill->blocks ++;
+
+        p = fill->buf + fill->used;
+        memcpy(p, &block, sizeof(block));
+        p += sizeof(block);
+        for (c = 0; c < RECORD_MAXCHANS; c++) {
+            if (chans & (1u << c)) {
+                memcpy(p, data[c] + done, k * sizeof(short));
+                p += k * sizeof(short);
+            }
+        }
+        for (c = 0; c < RECORD_MAXCHANS && format != SAMPLE_S16; c++) {
+            if (chans & (1u << c)) {
+                memcpy(p, (char *) wide[c] + (size_t) done * WIDE_SIZE, k * WIDE_SIZE);
+                p += k * WIDE_SIZE;
+            }
+        }
+        fill->used = p - fill->buf;
+
+        record_time += k;
+        record_drops = 0;
+        done += k;
+        g_atomic_int_inc(&blocks_kept);
+    }
+}
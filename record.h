@@ -0,0 +1,76 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * recorder routines available outside of record.c, and the format of the files it writes
+ *
+ * A recording is a RecordHeader, followed by any number of blocks of samples and index records,
+ * and (if it was closed properly) a RecordTrailer.  Everything is in native byte order.
+ *
+ * Each block is a RecordBlock followed by 'n' shorts of each channel in 'chans', channel a first,
+ * and then, if 'format' isn't SAMPLE_S16, by 'n' wide samples (as in Signal.wide) of each channel.
+ * The data sources record every sample they read, of every channel they have, whether it gets
+ * triggered on, displayed or not.  'time' counts samples since the recording started, including
+ * any that were dropped here or that the source skipped without reading, so a block that doesn't
+ * start where the one before it ended follows a gap.
+ *
+ * After every chunk of blocks the writer adds a RecordIndex, listing the time and file offset of
+ * each block in the chunk, and linked to the index before it.  The trailer points at the last one,
+ * so a reader can find any time in the file without reading it all.
+ */
+
+#include <glib.h>
+
+#define RECORD_MAGIC    "XOSCREC\n"
+#define RECORD_VERSION  2
+
+#define RECORD_BLOCK    0x4b4c4258      /* "XBLK" */
+#define RECORD_INDEX    0x58444958      /* "XIDX" */
+#define RECORD_END      0x444e4558      /* "XEND" */
+
+#define RECORD_MAXCHANS 32              /* as many as fit in RecordBlock.chans */
+#define RECORD_STEP     4096            /* most samples of a channel a source stages at a time */
+
+typedef struct RecordHeader {
+    char magic[8];              /* RECORD_MAGIC */
+    guint32 version;            /* RECORD_VERSION */
+    guint32 size;               /* of this header, so later versions can add to it */
+    gint64 started;             /* when, in seconds since the epoch */
+} RecordHeader;
+
+typedef struct RecordBlock {
+    guint32 magic;              /* RECORD_BLOCK */
+    guint32 chans;              /* bit mask of the channels that follow, a = bit 0 */
+    guint32 rate;               /* samples per second */
+    guint32 n;                  /* samples per channel */
+    guint64 time;               /* of the first sample, in samples since the start */
+    guint32 frame;              /* the source's frame (sweep) number */
+    guint32 dropped;            /* blocks dropped just before this one */
+    guint32 format;             /* SAMPLE_S16, or the format of the wide samples that follow */
+    guint32 unused;
+} RecordBlock;
+
+typedef struct RecordIndexEntry {
+    guint64 time;
+    guint64 offset;             /* of the RecordBlock, from the start of the file */
+} RecordIndexEntry;
+
+typedef struct RecordIndex {
+    guint32 magic;              /* RECORD_INDEX */
+    guint32 count;              /* RecordIndexEntry's that follow */
+    guint64 prev;               /* offset of the previous index, 0 for the first */
+} RecordIndex;
+
+typedef struct RecordTrailer {
+    guint32 magic;              /* RECORD_END */
+    guint32 unused;
+    guint64 last;               /* offset of the last index */
+} RecordTrailer;
+
+int             record_open(const char *path);
+void            record_close(void);
+int             record_active(void);
+void            record_staging(int nchans, int wide, short **data, void **wdata);
+void            record_samples(int frame, int rate, int format, unsigned int chans, short **data,
+                               void **wide, int n);
+void            record_gap(long long n);
@@ -0,0 +1,482 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements a data source that replays a recorded capture
+ *
+ * A capture file is a raw stream (see stream.h) saved to disk: a header line, then interleaved
+ * frames.  The file is mapped into memory and played back, over and over, either at the rate it was
+ * recorded at (speed=real, the default) or as fast as we can draw it (speed=max), which makes for a
+ * repeatable benchmark with no hardware attached.  At full speed, the end of a pass through the
+ * file prints (at most once a second) how many sweeps were played and how many frames the display
+ * drew meanwhile.
+ *
+ * Playback is paced by a timerfd.  Every SND_QUERY_INTERVALL ms it wakes the capture thread, which
+ * works out from the clock how far into the file we should be by now.  At full speed the timer
+ * fires once and is never read, so its descriptor stays readable and we're called back right away.
+ *
+ * change_rate() works like a slower sample rate on a real device: it keeps every second, fourth,
+ * and so on frame, while the file still plays in real time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include "xoscope.h"            /* program defaults */
+#include "trigger.h"
+#include "record.h"
+#include "stream.h"
+
+#define MAX_DECIMATE 1024
+
+static char replay_file[256] = "";
+static int replay_max = 0;              /* speed=max */
+static const char *replay_error = NULL;
+static int replay_opened = 0;           /* t if open has at least been _attempted_ */
+
+static const char *map = NULL;          /* the whole file */
+static size_t map_size = 0;
+static const char *body = NULL;         /* the frames, after the header */
+static long nframes = 0;
+static long pos = 0;                    /* next frame to play */
+static int timer = -1;
+
+/* From the header */
+static int replay_chans = 0;
+static int replay_type = 0;
+static int replay_rate = 0;
+static int frame_bytes = 0;
+
+static int decimate = 1;                /* play every decimate'th frame */
+
+static Signal replay_sig[STREAM_MAXCHANS];
+static StreamSweep sweep = {0, 0, 0, replay_sig};
+
+static char *gather = NULL;             /* decimated frames, put together */
+static size_t gather_size = 0;
+static int gather_frames = 0;           /* ...up to a sweep, or TRIGGER_STEP, of them */
+
+/* Real-time pacing: the time playback (re)started, and how many frames it's played since */
+static struct timespec start;
+static long long played = 0;
+
+/* Benchmark, at full speed: passes through the file since the last report */
+static struct timespec pass_start;
+static int passes = 0;
+static int pass_sweeps = 0;
+static int pass_frames = 0;
+
+static double since(const struct timespec *t)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+static void close_replay(void)
+{
+    if (map != NULL) munmap((void *) map, map_size);
+    map = NULL;
+    if (timer >= 0) close(timer);
+    timer = -1;
+}
+
+static void open_replay(void)
+{
+    char line[80];
+    struct stat st;
+    const char *nl;
+    int fd, i;
+
+    close_replay();
+    replay_opened = 1;
+    replay_error = NULL;
+    replay_chans = 0;
+    sweep.chans = 0;
+
+    if (replay_file[0] == '\0') return;
+
+    if ((fd = open(replay_file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        replay_error = strerror(errno);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    map_size = st.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        replay_error = strerror(errno);
+        map = NULL;
+        return;
+    }
+    madvise((void *) map, map_size, MADV_SEQUENTIAL);
+
+    nl = memchr(map, '\n', map_size < sizeof(line) ? map_size : sizeof(line));
+    if (nl == NULL) {
+        replay_error = "no capture header";
+        close_replay();
+        return;
+    }
+    memcpy(line, map, nl - map);
+    line[nl - map] = '\0';
+    if ((replay_type = stream_parse_header(line, &replay_chans, &replay_rate)) < 0) {
+        replay_error = "bad capture header";
+        replay_type = 0;
+        replay_chans = 0;
+        close_replay();
+        return;
+    }
+
+    frame_bytes = replay_chans * stream_types[replay_type].bytes;
+    sweep.type = replay_type;
+    sweep.chans = replay_chans;
+    body = nl + 1;
+    nframes = (map_size - (body - map)) / frame_bytes;
+    if (nframes == 0) {
+        replay_error = "empty capture";
+        replay_chans = 0;
+        sweep.chans = 0;
+        close_replay();
+        return;
+    }
+    pos = 0;
+
+    if ((timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+        replay_error = strerror(errno);
+        replay_chans = 0;
+        sweep.chans = 0;
+        close_replay();
+        return;
+    }
+
+    for (i = 0; i < replay_chans; i++) {
+        snprintf(replay_sig[i].name, sizeof(replay_sig[i].name), "Input %d", i + 1);
+        snprintf(replay_sig[i].savestr, sizeof(replay_sig[i].savestr), "%c", 'a' + i);
+    }
+}
+
+/* Start the clock, and the timer that wakes us up to look at it */
+
+static void start_timer(void)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = 1;
+    if (!replay_max) {
+        its.it_interval.tv_nsec = SND_QUERY_INTERVALL * 1000000;
+    }
+    if (timer >= 0) timerfd_settime(timer, 0, &its, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    played = 0;
+    pass_start = start;
+    passes = 0;
+    pass_sweeps = 0;
+    pass_frames = g_atomic_int_get(&frames);
+}
+
+/* The sweep's buffers, and room to gather up decimated frames, a step at a time */
+
+static void alloc_buffers(void)
+{
+    int n = (sweep.width < TRIGGER_STEP) ? sweep.width : TRIGGER_STEP;
+    size_t size = (size_t) n * frame_bytes;
+
+    if (sweep.width == 0 || replay_chans == 0) return;
+
+    stream_alloc(&sweep);
+    if (gather_size != size) {
+        gather = g_realloc(gather, size);
+        gather_size = size;
+    }
+    gather_frames = n;
+}
+
+static int nchans(void)
+{
+    if (!replay_opened) open_replay();
+    return replay_chans;
+}
+
+static int fd(void)
+{
+    return timer;
+}
+
+static Signal * replay_chan(int chan)
+{
+    return (chan >= 0 && chan < STREAM_MAXCHANS) ? &replay_sig[chan] : NULL;
+}
+
+static int set_trigger(int chan, int *levelp, int mode)
+{
+    return stream_set_trigger(&sweep, chan, levelp, mode);
+}
+
+static void clear_trigger(void)
+{
+    stream_clear_trigger(&sweep);
+}
+
+static int change_rate(int dir)
+{
+    if (dir > 0 && decimate > 1) {
+        decimate /= 2;
+        return 1;
+    } else if (dir < 0 && decimate < MAX_DECIMATE) {
+        decimate *= 2;
+        return 1;
+    }
+    return 0;
+}
+
+static void set_width(int w)
+{
+    sweep.width = w;
+    alloc_buffers();
+}
+
+static void reset(void)
+{
+    alloc_buffers();
+    stream_start(&sweep, replay_rate / decimate);
+    start_timer();
+}
+
+/* Back to the start of the file, which is a break in the signal.  At full speed, that's the end of
+ * a benchmark pass; short files make many of those a second, so they're reported at most once a
+ * second.
+ */
+
+static void rewind_replay(void)
+{
+    double secs;
+    int drawn;
+
+    pos = 0;
+    stream_lost(&sweep, 0);
+
+    if (replay_max) {
+        passes ++;
+        secs = since(&pass_start);
+        if (secs < 1.0) return;
+        drawn = g_atomic_int_get(&frames) - pass_frames;
+        fprintf(stderr, "%s: %d passes, %d sweeps, %d frames drawn in %.2f s (%.1f fps)\n",
+                replay_file, passes, pass_sweeps, drawn, secs, drawn / secs);
+        clock_gettime(CLOCK_MONOTONIC, &pass_start);
+        passes = 0;
+        pass_sweeps = 0;
+        pass_frames += drawn;
+    }
+}
+
+/* Play up to 'due' frames of the file, or until the end of a sweep.  Returns what stream_process()
+ * did, and takes off 'due' what it played.
+ */
+
+static int play(long *due)
+{
+    const char *frames;
+    long n;
+    int i, used, ret;
+
+    n = (*due < (long) sweep.width * decimate) ? *due : (long) sweep.width * decimate;
+    if (n > nframes - pos) n = nframes - pos;
+
+    /* Decimated frames are gathered up first, so stream_process() sees them side by side */
+
+    if (decimate == 1) {
+        frames = body + pos * frame_bytes;
+    } else {
+        n /= decimate;
+        if (n == 0) n = 1;
+        if (n > gather_frames) n = gather_frames;
+        for (i = 0; i < n && pos + (long) i * decimate < nframes; i++) {
+            memcpy(gather + (size_t) i * frame_bytes,
+                   body + (pos + (long) i * decimate) * frame_bytes, frame_bytes);
+        }
+        n = i;
+        frames = gather;
+    }
+
+    ret = stream_process(&sweep, frames, (int) n, &used);
+    stream_record(&sweep, frames, used, replay_rate / decimate);
+
+    pos += (long) used * decimate;
+    *due -= (long) used * decimate;
+    if (pos >= nframes) rewind_replay();
+
+    return ret;
+}
+
+/* Hand 'n' frames of the file from 'pos' on (before decimation) to the recorder, when we're about to
+ * skip them, so a recording of a replay keeps up with the clock without any gaps
+ */
+
+static void record_skipped(long n)
+{
+    long at = pos, k;
+    int i;
+
+    if (!record_active()) return;
+
+    for (n /= decimate; n > 0; n -= k) {
+        k = (n < gather_frames) ? n : gather_frames;
+        if (decimate == 1) {
+            if (k > nframes - at) k = nframes - at;
+            stream_record(&sweep, body + at * frame_bytes, k, replay_rate);
+            at = (at + k) % nframes;
+        } else {
+            for (i = 0; i < k; i++, at = (at + decimate) % nframes) {
+                memcpy(gather + (size_t) i * frame_bytes, body + at * frame_bytes, frame_bytes);
+            }
+            stream_record(&sweep, gather, k, replay_rate / decimate);
+        }
+    }
+}
+
+static int get_data(void)
+{
+    unsigned long long ticks;
+    long due;
+    int ret = 0;
+
+    if (map == NULL || sweep.width == 0) return 0;
+
+    if (replay_max) {
+        due = nframes;
+    } else {
+        if (read(timer, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN) return 0;
+
+        due = (long long) (since(&start) * replay_rate) - played;
+
+        /* If we've fallen more than a screenful behind, skip ahead to keep up with the clock */
+
+        if (due > (long) sweep.width * decimate) {
+            record_skipped(due - (long) sweep.width * decimate);
+            played += due - (long) sweep.width * decimate;
+            pos = (pos + due - (long) sweep.width * decimate) % nframes;
+            stream_lost(&sweep, (due - (long) sweep.width * decimate) / decimate);
+            due = (long) sweep.width * decimate;
+        }
+        played += due;
+    }
+
+    while (due > 0) {
+        ret |= play(&due);
+        if (ret && !in_progress) {              /* sweep complete; get_data() must return now */
+            pass_sweeps ++;
+            break;
+        }
+    }
+
+    /* Whatever we didn't get to gets played next time */
+    if (!replay_max) played -= due;
+
+    return ret;
+}
+
+static const char * status_str(int i)
+{
+    static char string[32];
+
+    switch (i) {
+    case 0:
+        return replay_file;
+
+    case 1:
+        if (replay_chans > 0) {
+            snprintf(string, sizeof(string), "%d x %s", replay_chans,
+                     stream_types[replay_type].name);
+            return string;
+        } else {
+            return "";
+        }
+
+    case 2:
+        return replay_error ? replay_error : "";
+
+    case 3:
+        if (map != NULL) {
+            snprintf(string, sizeof(string), "%.1f of %.1f s",
+                     (double) pos / replay_rate, (double) nframes / replay_rate);
+            return string;
+        } else {
+            return "";
+        }
+
+    case 4:
+        return replay_max ? "full speed" : "";
+    }
+    return NULL;
+}
+
+static int set_option(char *option)
+{
+    if (strncmp(option, "file=", 5) == 0) {
+        strncpy(replay_file, option + 5, sizeof(replay_file) - 1);
+        replay_file[strcspn(replay_file, "\n")] = '\0';
+        open_replay();
+        alloc_buffers();
+        return 1;
+    } else if (strncmp(option, "speed=max", 9) == 0) {
+        replay_max = 1;
+        start_timer();
+        return 1;
+    } else if (strncmp(option, "speed=real", 10) == 0) {
+        replay_max = 0;
+        start_timer();
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static char * save_option(int i)
+{
+    static char buf[sizeof(replay_file) + 8];
+
+    switch (i) {
+    case 0:
+        snprintf(buf, sizeof(buf), "file=%s", replay_file);
+        return buf;
+
+    case 1:
+        return replay_max ? "speed=max" : "speed=real";
+
+    default:
+        return NULL;
+    }
+}
+
+DataSrc datasrc_replay = {
+    "Replay",
+    nchans,
+    replay_chan,
+    set_trigger,
+    clear_trigger,
+    change_rate,
+    set_width,
+    reset,
+    fd,
+    get_data,
+    status_str,
+    NULL,  /* option1, */
+    NULL,  /* option1str, */
+    NULL,  /* option2, */
+    NULL,  /* option2str, */
+    set_option,
+    save_option,
+    NULL,  /* gtk_options */
+    NULL,  /* poll_fds */
+    NULL,  /* poll_revents */
+};
@@ -0,0 +1,692 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements a data source that reads a raw stream of samples
+ *
+ * Custom acquisition hardware usually comes with a daemon that can write out the samples as they
+ * arrive.  This data source takes such a stream from standard input, a FIFO or a Unix domain
+ * socket, given with the input= option ("-" for standard input, unix:PATH for a socket, anything
+ * else is opened as a file).  The stream starts with a single line of text giving the number of
+ * channels, the sample type and the rate (see stream.h), followed by interleaved frames like a
+ * sound card's, and they get triggered on and swept exactly the same way.  The sweep and trigger
+ * state machine is kept here too, for the replay source to share (see stream.h).
+ *
+ * The stream is read a megabyte at a time.  Between sweeps, anything more than a screenful that has
+ * piled up in the pipe or socket is read and thrown away without being converted (unless it's
+ * being recorded), so a fast writer isn't held up and a new sweep starts close to real time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "xoscope.h"            /* program defaults */
+#include "convert.h"
+#include "trigger.h"
+#include "record.h"
+#include "stream.h"
+
+#define STREAM_BUFSZ (1024*1024)        /* bytes per read */
+#define HEADER_TIMEOUT 5000             /* ms to wait for the header line */
+
+const StreamType stream_types[] = {
+    {"u8", 1, SAMPLE_S16},
+    {"s16", 2, SAMPLE_S16},
+    {"s24", 4, SAMPLE_S32},
+    {"s32", 4, SAMPLE_S32},
+    {"float", 4, SAMPLE_FLOAT},
+    {NULL, 0, 0}
+};
+
+static char stream_input[256] = "";
+static int stream_fd = -1;
+static int stream_opened = 0;           /* t if open has at least been _attempted_ */
+static int stream_regular = 0;          /* a plain file - never skip any of it */
+static const char *stream_error = NULL;
+
+/* From the header */
+static int stream_chans = 0;
+static int stream_type = 0;             /* index into stream_types[] */
+static int stream_rate = 0;
+static int frame_bytes = 0;
+
+static Signal stream_sig[STREAM_MAXCHANS];
+static StreamSweep sweep = {0, 0, 0, stream_sig};
+
+/* Raw bytes read from the stream and not used yet */
+static char *buffer = NULL;
+static int bufvalid = 0;
+
+static long skipped_frames = 0;         /* frames skipped while waiting for the next sweep */
+static long sweep_skipped = 0;          /* ...and before the current sweep, for the status line */
+static long long bytes_total = 0;       /* for the throughput on the status line */
+
+static void close_stream(void)
+{
+    if (stream_fd >= 0) close(stream_fd);
+    stream_fd = -1;
+    bufvalid = 0;
+}
+
+/* Connect to a daemon listening on a Unix domain socket */
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Read the header a byte at a time, so none of the samples after it get read along with it.  The
+ * descriptor is non-blocking, so that opening a FIFO doesn't wait for a writer; we give the writer
+ * HEADER_TIMEOUT ms to come up with the line.
+ */
+
+static int read_header(char *line, int size)
+{
+    struct pollfd pfd;
+    int i = 0, n;
+
+    pfd.fd = stream_fd;
+    pfd.events = POLLIN;
+
+    while (i < size - 1) {
+        n = read(stream_fd, line + i, 1);
+        if (n == 1) {
+            if (line[i] == '\n') break;
+            i ++;
+        } else if (n == 0) {
+            return 0;
+        } else if (errno == EAGAIN || errno == EINTR) {
+            if (poll(&pfd, 1, HEADER_TIMEOUT) <= 0) return 0;
+        } else {
+            return 0;
+        }
+    }
+    line[i] = '\0';
+    return 1;
+}
+
+int stream_parse_header(const char *line, int *chans, int *rate)
+{
+    char type[16];
+    int i;
+
+    if (sscanf(line, "xoscope %d %15s %d", chans, type, rate) != 3
+        || *chans < 1 || *chans > STREAM_MAXCHANS || *rate <= 0) {
+        return -1;
+    }
+    for (i = 0; stream_types[i].name != NULL; i++) {
+        if (strcmp(type, stream_types[i].name) == 0) return i;
+    }
+    return -1;
+}
+
+void stream_deinterleave(int type, short **out, void **wout, const void *frames, int nchans, int n)
+{
+    switch (type) {
+    case 0:
+        deinterleave_u8(out, (const unsigned char *) frames, nchans, n);
+        break;
+    case 1:
+        deinterleave_s16(out, (const short *) frames, nchans, n);
+        break;
+    case 2:
+        deinterleave_s32(out, (int **) wout, (const int *) frames, nchans, n, 8);
+        break;
+    case 3:
+        deinterleave_s32(out, (int **) wout, (const int *) frames, nchans, n, 0);
+        break;
+    case 4:
+        deinterleave_float(out, (float **) wout, (const float *) frames, nchans, n);
+        break;
+    }
+}
+
+/* (Re)allocate whatever depends on the width of a sweep and the sample format */
+
+void stream_alloc(StreamSweep *s)
+{
+    int format = stream_types[s->type].format;
+    int step = (s->width < TRIGGER_STEP) ? s->width : TRIGGER_STEP;
+    int pre = pretrigger_samples(s->width);
+    int i;
+
+    if (s->width == 0) return;
+
+    for (i = 0; i < s->chans; i++) {
+        if (s->sig[i].data == NULL || s->sig[i].width != s->width) {
+            g_free(s->sig[i].data);
+            s->sig[i].data = g_new0(short, s->width);
+            s->sig[i].width = s->width;
+            g_free(s->sig[i].wide);
+            s->sig[i].wide = NULL;
+            s->scratch[i] = g_renew(short, s->scratch[i], step);
+            history_resize(&s->history[i], pre, sizeof(short));
+        }
+        if (format != SAMPLE_S16 && s->sig[i].wide == NULL) {
+            s->sig[i].wide = g_malloc((size_t) s->width * WIDE_SIZE);
+            s->wscratch[i] = g_realloc(s->wscratch[i], (size_t) step * WIDE_SIZE);
+            history_resize(&s->whistory[i], pre, WIDE_SIZE);
+        }
+        s->sig[i].format = format;
+    }
+}
+
+/* The trigger level comes in the sound cards' units (-128 to 127), and gets scaled to the shorts
+ * the trigger engine will see
+ */
+
+int stream_set_trigger(StreamSweep *s, int chan, int *levelp, int mode)
+{
+    int scale = (stream_types[s->type].bytes == 1) ? 1 : 256;
+
+    if (chan >= s->chans) return 0;
+
+    if (*levelp > 127) *levelp = 127;
+    if (*levelp < -128) *levelp = -128;
+    s->trigch = chan;
+    s->trigmode = mode;
+    trigger_set(&s->trig, mode, *levelp * scale, scope.trighyst * scale);
+    return 1;
+}
+
+void stream_clear_trigger(StreamSweep *s)
+{
+    s->trigmode = 0;
+    trigger_set(&s->trig, 0, 0, 0);
+}
+
+void stream_start(StreamSweep *s, int rate)
+{
+    int i;
+
+    for (i = 0; i < s->chans; i++) {
+        s->sig[i].rate = rate;
+        s->sig[i].num = 0;
+        s->sig[i].frame ++;
+        s->sig[i].volts = 0;
+    }
+
+    trigger_start(&s->trig, rate);
+    in_progress = 0;
+}
+
+/* Samples we'll never see break the stream, for the trigger engine and the pre-trigger history */
+
+void stream_lost(StreamSweep *s, long n)
+{
+    int i;
+
+    trigger_gap(&s->trig, n);
+    for (i = 0; i < s->chans; i++) {
+        history_clear(&s->history[i]);
+        history_clear(&s->whistory[i]);
+    }
+}
+
+void stream_record(StreamSweep *s, const char *frames, int n, int rate)
+{
+    short *out[STREAM_MAXCHANS];
+    void *wout[STREAM_MAXCHANS];
+    int format = stream_types[s->type].format;
+    int frame_bytes = s->chans * stream_types[s->type].bytes;
+    int k;
+
+    if (!record_active()) return;
+
+    record_staging(s->chans, format != SAMPLE_S16, out, wout);
+    for (; n > 0; n -= k, frames += (size_t) k * frame_bytes) {
+        k = (n < RECORD_STEP) ? n : RECORD_STEP;
+        stream_deinterleave(s->type, out, wout, frames, s->chans, k);
+        record_samples(s->sig[0].frame, rate, format, (1u << s->chans) - 1, out, wout, k);
+    }
+}
+
+/* The samples go through the trigger engine just like the ALSA source's do */
+
+int stream_process(StreamSweep *s, const char *frames, int count, int *used)
+{
+    short *out[STREAM_MAXCHANS];
+    void *wout[STREAM_MAXCHANS];
+    int capturing[STREAM_MAXCHANS];
+    int wide = (stream_types[s->type].format != SAMPLE_S16);
+    int frame_bytes = s->chans * stream_types[s->type].bytes;
+    int c, i = 0, n, delay = 0;
+    int pre, start = 0, base = 0, k = 0;
+
+    if (count > s->width) {
+        count = s->width;
+    }
+    *used = count;
+
+    for (c = 0; c < s->chans; c++) {
+        capturing[c] = (s->sig[c].listeners > 0) || (s->trigmode && c == s->trigch);
+    }
+
+    if (!in_progress) {
+        if (s->trigmode) {
+            pre = pretrigger_samples(s->width);
+            for (c = 0; c < s->chans; c++) {
+                out[c] = capturing[c] ? s->scratch[c] : NULL;
+                wout[c] = (capturing[c] && wide) ? s->wscratch[c] : NULL;
+                if (capturing[c]) {
+                    history_reserve(&s->history[c], pre, sizeof(short));
+                }
+                if (wout[c] != NULL) {
+                    history_reserve(&s->whistory[c], pre, WIDE_SIZE);
+                }
+            }
+
+            for (;;) {
+                if (i == base + k) {
+                    if (i >= count) {
+                        return 0;
+                    }
+                    base = i;
+                    k = (count - base < TRIGGER_STEP) ? count - base : TRIGGER_STEP;
+                    stream_deinterleave(s->type, out, wout, frames + (size_t) base * frame_bytes,
+                                        s->chans, k);
+                }
+                i += trigger_find(&s->trig, s->scratch[s->trigch] + i - base, base + k - i,
+                                  &delay);
+                if (pre > 0) {
+                    for (c = 0; c < s->chans; c++) {
+                        if (capturing[c]) {
+                            history_push(&s->history[c], s->scratch[c] + start - base,
+                                         i - start);
+                        }
+                        if (wout[c] != NULL) {
+                            history_push(&s->whistory[c],
+                                         (char *) wout[c] + (start - base) * WIDE_SIZE, i - start);
+                        }
+                    }
+                    start = i;
+                }
+                if (i < base + k) {
+                    if (s->history[s->trigch].fill >= pre) {
+                        break;
+                    }
+                    trigger_skip(&s->trig, s->scratch[s->trigch] + i - base, 1);
+                    i ++;
+                }
+            }
+
+            for (c = 0; c < s->chans; c++) {
+                if (capturing[c]) {
+                    history_copy(&s->history[c], s->sig[c].data, pre);
+                }
+                if (wout[c] != NULL) {
+                    history_copy(&s->whistory[c], s->sig[c].wide, pre);
+                }
+            }
+            in_progress = pre;
+        }
+
+        for (c = 0; c < s->chans; c++) {
+            s->sig[c].delay = delay;
+            s->sig[c].frame ++;
+        }
+    }
+
+    /* Copy as much as we have, up to a full screen */
+
+    n = count - i;
+    if (n > s->width - in_progress) {
+        n = s->width - in_progress;
+    }
+
+    for (c = 0; c < s->chans; c++) {
+        out[c] = capturing[c] ? s->sig[c].data + in_progress : NULL;
+        wout[c] = (capturing[c] && wide) ? (char *) s->sig[c].wide + in_progress * WIDE_SIZE
+            : NULL;
+    }
+    stream_deinterleave(s->type, out, wout, frames + (size_t) i * frame_bytes, s->chans, n);
+
+    if (s->trigmode) {
+        trigger_skip(&s->trig, s->sig[s->trigch].data + in_progress, n);
+        if (scope.trigpos > 0) {
+            for (c = 0; c < s->chans; c++) {
+                if (capturing[c]) {
+                    history_push(&s->history[c], out[c], n);
+                }
+                if (wout[c] != NULL) {
+                    history_push(&s->whistory[c], wout[c], n);
+                }
+            }
+        }
+    }
+
+    in_progress += n;
+    i += n;
+
+    for (c = 0; c < s->chans; c++) {
+        s->sig[c].num = in_progress;
+    }
+
+    if (in_progress >= s->width) {
+        in_progress = 0;
+    }
+    *used = i;
+
+    return 1;
+}
+
+static void open_stream(void)
+{
+    char line[80];
+    struct stat st;
+    int i;
+
+    close_stream();
+    stream_opened = 1;
+    stream_error = NULL;
+    stream_chans = 0;
+    sweep.chans = 0;
+
+    if (stream_input[0] == '\0') return;
+
+    if (strcmp(stream_input, "-") == 0) {
+        stream_fd = dup(0);
+    } else if (strncmp(stream_input, "unix:", 5) == 0) {
+        stream_fd = open_socket(stream_input + 5);
+    } else {
+        stream_fd = open(stream_input, O_RDONLY | O_NONBLOCK);
+    }
+    if (stream_fd < 0) {
+        stream_error = strerror(errno);
+        return;
+    }
+    fcntl(stream_fd, F_SETFL, fcntl(stream_fd, F_GETFL) | O_NONBLOCK);
+    stream_regular = (fstat(stream_fd, &st) == 0) && S_ISREG(st.st_mode);
+
+    if (!read_header(line, sizeof(line))) {
+        stream_error = "no stream header";
+        close_stream();
+        return;
+    }
+    if ((stream_type = stream_parse_header(line, &stream_chans, &stream_rate)) < 0) {
+        stream_error = "bad stream header";
+        stream_type = 0;
+        stream_chans = 0;
+        sweep.chans = 0;
+        close_stream();
+        return;
+    }
+    frame_bytes = stream_chans * stream_types[stream_type].bytes;
+    sweep.type = stream_type;
+    sweep.chans = stream_chans;
+
+    for (i = 0; i < stream_chans; i++) {
+        snprintf(stream_sig[i].name, sizeof(stream_sig[i].name), "Input %d", i + 1);
+        snprintf(stream_sig[i].savestr, sizeof(stream_sig[i].savestr), "%c", 'a' + i);
+    }
+}
+
+static void alloc_buffers(void)
+{
+    if (buffer == NULL) buffer = g_malloc(STREAM_BUFSZ);
+    stream_alloc(&sweep);
+}
+
+static int nchans(void)
+{
+    if (!stream_opened) open_stream();
+    return stream_chans;
+}
+
+static int fd(void)
+{
+    return stream_fd;
+}
+
+static Signal * stream_chan(int chan)
+{
+    return (chan >= 0 && chan < STREAM_MAXCHANS) ? &stream_sig[chan] : NULL;
+}
+
+static int set_trigger(int chan, int *levelp, int mode)
+{
+    return stream_set_trigger(&sweep, chan, levelp, mode);
+}
+
+static void clear_trigger(void)
+{
+    stream_clear_trigger(&sweep);
+}
+
+/* The rate is whatever the writer says it is */
+
+static int change_rate(int dir)
+{
+    return 0;
+}
+
+static void set_width(int w)
+{
+    sweep.width = w;
+    alloc_buffers();
+}
+
+/* A FIFO or socket that went away (or was never there) gets another try */
+
+static void reset(void)
+{
+    if (stream_fd < 0 && stream_input[0] != '\0') open_stream();
+    alloc_buffers();
+
+    stream_start(&sweep, stream_rate);
+    skipped_frames = 0;
+    sweep_skipped = 0;
+}
+
+/* Called before looking for a trigger.  Throws away all but the last screenful of what we've
+ * buffered and what's waiting in the pipe or socket, reading it in big blocks without converting
+ * any of it, unless we're recording it.  Plain files are left alone; there, every sample is as
+ * fresh as the next.
+ */
+
+static void skip_stale(void)
+{
+    long keep = (long) sweep.width * frame_bytes;
+    long drop, k;
+    int avail = 0, n;
+
+    if (stream_regular || ioctl(stream_fd, FIONREAD, &avail) < 0) return;
+
+    drop = bufvalid + avail - keep;
+    drop -= drop % frame_bytes;
+    if (drop <= 0) return;
+
+    skipped_frames += drop / frame_bytes;
+    stream_lost(&sweep, drop / frame_bytes);
+
+    /* FIONREAD says it's all there, so the reads only come up short at the end of the stream */
+
+    while (drop > 0) {
+        k = (bufvalid < drop) ? bufvalid : drop;
+        k -= k % frame_bytes;
+        if (k > 0) {
+            stream_record(&sweep, buffer, k / frame_bytes, stream_rate);
+            bufvalid -= k;
+            memmove(buffer, buffer + k, bufvalid);
+            drop -= k;
+            continue;
+        }
+        k = (drop - bufvalid < STREAM_BUFSZ - bufvalid) ? drop - bufvalid : STREAM_BUFSZ - bufvalid;
+        n = read(stream_fd, buffer + bufvalid, k);
+        if (n > 0) {
+            bytes_total += n;
+            bufvalid += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            break;
+        }
+    }
+}
+
+/* Read whatever the stream has for us and run it through stream_process(), returning at the end of
+ * a sweep.  Whatever follows the sweep stays in the buffer for next time.
+ */
+
+static int get_data(void)
+{
+    int ret = 0;
+    int n, used, started, swept;
+
+    if (stream_fd < 0 || sweep.width == 0) return 0;
+
+    if (!in_progress) skip_stale();
+
+    for (;;) {
+        n = read(stream_fd, buffer + bufvalid, STREAM_BUFSZ - bufvalid);
+        if (n > 0) {
+            bytes_total += n;
+            bufvalid += n;
+        } else if (n == 0 && bufvalid < STREAM_BUFSZ) {
+            stream_error = "end of stream";
+            close(stream_fd);
+            stream_fd = -1;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            stream_error = strerror(errno);
+            close(stream_fd);
+            stream_fd = -1;
+        }
+
+        if (bufvalid < frame_bytes) break;
+
+        started = !in_progress;
+        swept = stream_process(&sweep, buffer, bufvalid / frame_bytes, &used);
+        stream_record(&sweep, buffer, used, stream_rate);
+        ret |= swept;
+        if (started && swept) {
+            sweep_skipped = skipped_frames;
+            skipped_frames = 0;
+        }
+        bufvalid -= used * frame_bytes;
+        memmove(buffer, buffer + used * frame_bytes, bufvalid);
+
+        if (ret && !in_progress) break;         /* sweep complete; get_data() must return now */
+        if (n <= 0 || stream_fd < 0) break;
+    }
+
+    return ret;
+}
+
+static const char * status_str(int i)
+{
+    static char string[32];
+    static struct timeval then;
+    static long long bytes_then;
+    static double rate;
+    struct timeval now;
+    double secs;
+
+    switch (i) {
+    case 0:
+        return stream_input;
+
+    case 1:
+        if (stream_chans > 0) {
+            snprintf(string, sizeof(string), "%d x %s", stream_chans,
+                     stream_types[stream_type].name);
+            return string;
+        } else {
+            return "";
+        }
+
+    case 2:
+        return stream_error ? stream_error : "";
+
+    case 3:
+        if (sweep_skipped > 0) {
+            snprintf(string, sizeof(string), "%ld skipped", sweep_skipped);
+            return string;
+        } else {
+            return "";
+        }
+
+    case 4:
+        if (stream_fd < 0) return "";
+        gettimeofday(&now, NULL);
+        secs = (now.tv_sec - then.tv_sec) + (now.tv_usec - then.tv_usec) / 1e6;
+        if (secs >= 1.0) {
+            rate = (bytes_total - bytes_then) / secs;
+            then = now;
+            bytes_then = bytes_total;
+        }
+        snprintf(string, sizeof(string), "%.1f MB/s", rate / 1e6);
+        return string;
+    }
+    return NULL;
+}
+
+static int set_option(char *option)
+{
+    if (strncmp(option, "input=", 6) == 0) {
+        strncpy(stream_input, option + 6, sizeof(stream_input) - 1);
+        stream_input[strcspn(stream_input, "\n")] = '\0';
+        open_stream();
+        alloc_buffers();
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static char * save_option(int i)
+{
+    static char buf[sizeof(stream_input) + 8];
+
+    switch (i) {
+    case 0:
+        snprintf(buf, sizeof(buf), "input=%s", stream_input);
+        return buf;
+
+    default:
+        return NULL;
+    }
+}
+
+DataSrc datasrc_stream = {
+    "Stream",
+    nchans,
+    stream_chan,
+    set_trigger,
+    clear_trigger,
+    change_rate,
+    set_width,
+    reset,
+    fd,
+    get_data,
+    status_str,
+    NULL,  /* option1, */
+    NULL,  /* option1str, */
+    NULL,  /* option2, */
+    NULL,  /* option2str, */
+    set_option,
+    save_option,
+    NULL,  /* gtk_options */
+    NULL,  /* poll_fds */
+    NULL,  /* poll_revents */
+};
@@ -0,0 +1,79 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * raw sample stream routines available outside of stream.c
+ *
+ */
+
+#define STREAM_MAXCHANS 26
+
+/* A stream (or a capture file) starts with a line of text
+ *
+ *      xoscope CHANNELS TYPE RATE
+ *
+ * followed by interleaved frames of CHANNELS samples of one of these types.  s24 is 24 bits in the
+ * low three bytes of 32-bit words, and float is +/-1.0 full scale, all in native byte order.
+ * 'format' is what Signal.wide holds for the type.
+ */
+
+typedef struct StreamType {
+    const char *name;
+    int bytes;
+    int format;
+} StreamType;
+
+extern const StreamType stream_types[];
+
+/* Parses a header line (without its newline).  Returns the index of the sample type in
+ * stream_types[] and sets '*chans' and '*rate', or returns -1 if it isn't a valid header.
+ */
+int             stream_parse_header(const char *line, int *chans, int *rate);
+
+/* Splits 'n' frames of 'type' samples up into out[], and at full resolution into wout[], as the
+ * deinterleave routines in convert.h do
+ */
+void            stream_deinterleave(int type, short **out, void **wout, const void *frames,
+                                    int nchans, int n);
+
+/* The sweep and trigger state machine the stream and replay sources share.  Each keeps one of
+ * these, points 'sig' at its Signals, and fills in 'type', 'chans' and 'width' as it learns them.
+ */
+
+typedef struct StreamSweep {
+    int type;                   /* index into stream_types[] */
+    int chans;
+    int width;                  /* samples per sweep */
+    Signal *sig;                /* 'chans' of them */
+    int trigmode;
+    int trigch;
+    Trigger trig;
+    History history[STREAM_MAXCHANS];  /* as long as the pre-trigger part of a sweep */
+    History whistory[STREAM_MAXCHANS];
+    short *scratch[STREAM_MAXCHANS];    /* TRIGGER_STEP samples at most, for the trigger search */
+    void *wscratch[STREAM_MAXCHANS];
+} StreamSweep;
+
+/* (Re)allocates whatever depends on the width of a sweep and the sample format */
+void            stream_alloc(StreamSweep *s);
+
+/* The DataSrc set_trigger() and clear_trigger() functions, for a sweep */
+int             stream_set_trigger(StreamSweep *s, int chan, int *levelp, int mode);
+void            stream_clear_trigger(StreamSweep *s);
+
+/* Starts a new stream of samples at 'rate', as a DataSrc's reset() does */
+void            stream_start(StreamSweep *s, int rate);
+
+/* Tells the trigger engine and the pre-trigger history that 'n' frames went by that they'll never
+ * see.  The recorder still gets any that were read, from stream_record().
+ */
+void            stream_lost(StreamSweep *s, long n);
+
+/* Hands 'n' interleaved frames to the recorder, every channel of them, as sampled at 'rate' */
+void            stream_record(StreamSweep *s, const char *frames, int n, int rate);
+
+/* Looks for the trigger (if we're not in the middle of a sweep) and copies samples from 'count'
+ * interleaved frames into the Signals.  Returns 0 if we're still waiting for a trigger, otherwise
+ * 1, and sets '*used' to the number of frames we're done with.
+ */
+int             stream_process(StreamSweep *s, const char *frames, int count, int *used);
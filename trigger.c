@@ -0,0 +1,386 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements triggering
+ *
+ * There are two parts.  The trigger engine (trigger_find() and friends) is what the DataSrcs use
+ * to decide where a sweep starts.  It's a small state machine - waiting to arm, armed, and holding
+ * off - whose state survives from one read to the next, so that it doesn't matter where the reads
+ * happen to split the stream.  Most of its time goes into looking for the next sample past some
+ * threshold, which the SSE2 version does 16 samples at a time with a compare and a movemask.
+ *
+ * trigger_search() is the older noise-filtered crossing search that the frequency measurement in
+ * func.c uses: threshold crossings that are followed by more than 5 out of 10 samples moving
+ * further in the same direction.  Done the obvious way, that's a 10 sample look-ahead loop for
+ * every crossing, which on a noisy signal (one that crosses the threshold every other sample) means
+ * about 5 comparisons per sample.  Here, the SSE2 version turns 16 threshold compares into a bit
+ * mask, so that crossings are simply the bits set in the mask but not in the mask shifted by one.
+ * Each crossing is then confirmed with a single vector compare of the 10 samples that follow it
+ * against the crossing sample, again turned into a mask and counted with popcount.  Either way
+ * it's a fixed amount of work per 16 samples, however noisy the signal.
+ *
+ * Last come the pre-trigger History rings, which are just a way to remember the samples that went
+ * by while we were looking for the trigger, without copying them around more than once.
+ *
+ * The plain C versions get used on CPUs without SSE2, for the samples left over at the end, and
+ * when a threshold is outside the range of a short.
+ */
+
+#include <stdlib.h>             /* for abs() */
+#include <string.h>
+#include <limits.h>
+#include "xoscope.h"
+#include "trigger.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+/* Is 'a' beyond 'b', in direction 'dir'? */
+#define BEYOND(a, b, dir) ((dir) > 0 ? (a) > (b) : (a) < (b))
+
+static int (* search)(const short *data, int n, int level, int dir, int prev) = NULL;
+static int (* find)(const short *data, int n, int thresh, int dir) = NULL;
+
+static int confirm_scalar(const short *data, int n, int i, int dir)
+{
+    int k, count = 0;
+
+    for (k = i + 1; k < i + 11 && k < n; k++) {
+        if (BEYOND(data[k], data[i], dir)) {
+            count++;
+        }
+    }
+    return count > 5;
+}
+
+static int search_scalar(const short *data, int n, int level, int dir, int prev)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (BEYOND(data[i], level, dir) && !BEYOND(prev, level, dir)) {
+            if (confirm_scalar(data, n, i, dir)) {
+                return i;
+            }
+        }
+        prev = data[i];
+    }
+    return n;
+}
+
+/* Index of the first sample in data[0..n) at or above (dir > 0) or at or below (dir < 0) 'thresh',
+ * or n.  'thresh' has to be within the range of a short, and not SHRT_MIN or SHRT_MAX respectively.
+ */
+
+static int find_scalar(const short *data, int n, int thresh, int dir)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (BEYOND(data[i], thresh - dir, dir)) {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef X86_KERNELS
+
+/* Bit mask of which of the 16 shorts at p are beyond the 8 copies of a short in v */
+
+#define BEYOND_MASK_SSE2(p, v, dir)                                             \
+    ((dir) > 0                                                                  \
+     ? _mm_movemask_epi8(_mm_packs_epi16(                                       \
+             _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *) (p)), v),        \
+             _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *) ((p) + 8)), v))) \
+     : _mm_movemask_epi8(_mm_packs_epi16(                                       \
+             _mm_cmpgt_epi16(v, _mm_loadu_si128((const __m128i *) (p))),        \
+             _mm_cmpgt_epi16(v, _mm_loadu_si128((const __m128i *) ((p) + 8))))))
+
+__attribute__ ((target("sse2")))
+static int search_sse2(const short *data, int n, int level, int dir, int prev)
+{
+    const __m128i lv = _mm_set1_epi16(level);
+    unsigned int beyond, cross, carry;
+    int i, c;
+
+    carry = BEYOND(prev, level, dir);
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        beyond = BEYOND_MASK_SSE2(data + i, lv, dir);
+        cross = beyond & ~((beyond << 1) | carry);
+        carry = beyond >> 15;
+
+        while (cross) {
+            c = i + __builtin_ctz(cross);
+            if (c + 17 <= n) {
+                /* the 10 samples after c, plus 6 more we mask off */
+                __m128i cv = _mm_set1_epi16(data[c]);
+                if (__builtin_popcount(BEYOND_MASK_SSE2(data + c + 1, cv, dir) & 0x3ff) > 5) {
+                    return c;
+                }
+            } else if (confirm_scalar(data, n, c, dir)) {
+                return c;
+            }
+            cross &= cross - 1;
+        }
+    }
+
+    if (i == n) {
+        return n;
+    }
+    c = search_scalar(data + i, n - i, level, dir, (i > 0) ? data[i - 1] : prev);
+    return i + c;
+}
+
+__attribute__ ((target("sse2")))
+static int find_sse2(const short *data, int n, int thresh, int dir)
+{
+    const __m128i tv = _mm_set1_epi16(thresh - dir);
+    unsigned int beyond;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        beyond = BEYOND_MASK_SSE2(data + i, tv, dir);
+        if (beyond) {
+            return i + __builtin_ctz(beyond);
+        }
+    }
+    return i + find_scalar(data + i, n - i, thresh, dir);
+}
+
+#endif /* X86_KERNELS */
+
+/* Pick the best kernels this CPU can run.  'search' gets set last, and is what the callers check,
+ * so it doesn't hurt if two threads happen to get here at once.
+ */
+
+static void select_kernels(void)
+{
+    int (* best)(const short *, int, int, int, int) = search_scalar;
+
+    find = find_scalar;
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        best = search_sse2;
+        find = find_sse2;
+    }
+#endif
+    search = best;
+}
+
+int trigger_search(const short *data, int n, int level, int dir, int prev)
+{
+    if (search == NULL) select_kernels();
+
+    if (level < SHRT_MIN || level > SHRT_MAX) {
+        return search_scalar(data, n, level, dir, prev);
+    }
+    return search(data, n, level, dir, prev);
+}
+
+/* The trigger engine */
+
+/* find(), for any threshold */
+
+static int find_any(const short *data, int n, int thresh, int dir)
+{
+    if ((dir > 0) ? (thresh > SHRT_MAX) : (thresh < SHRT_MIN)) {
+        return n;               /* never */
+    }
+    if ((dir > 0) ? (thresh <= SHRT_MIN) : (thresh >= SHRT_MAX)) {
+        return 0;               /* always */
+    }
+    return find(data, n, thresh, dir);
+}
+
+static void advance(Trigger *t, const short *data, int n)
+{
+    if (n > 0) {
+        t->pos += n;
+        t->last = data[n - 1];
+        t->have_last = 1;
+    }
+}
+
+/* Run the state machine over data[0..n).  If 'delay' isn't NULL, stop at the first sample that
+ * triggers and return its index, otherwise (or if nothing triggers) return n.
+ */
+
+static int scan(Trigger *t, const short *data, int n, int *delay)
+{
+    int dir = (t->mode == 1) ? 1 : -1;
+    int i = 0, j, prev, cur;
+    long long at, width;
+
+    if (search == NULL) select_kernels();
+
+    while (i < n) {
+        if (t->armed_at < 0) {
+            /* waiting for the signal to go past the hysteresis band, the other way */
+            j = i + find_any(data + i, n - i, t->level - dir * (t->hysteresis + 1), -dir);
+            if (j >= n) {
+                break;
+            }
+            t->armed_at = t->pos + j;
+            i = j + 1;
+            continue;
+        }
+
+        /* armed, and waiting for the signal to reach the level */
+        j = i + find_any(data + i, n - i, t->level, dir);
+        if (j >= n) {
+            break;
+        }
+        at = t->pos + j;
+        width = at - t->armed_at;
+        t->armed_at = -1;
+        i = j + 1;
+
+        if ((delay != NULL) && (at >= t->holdoff_end) && (width >= t->min_width)
+            && ((t->max_width == 0) || (width <= t->max_width))) {
+
+            /* Interpolate between the sample before the trigger (which is always on the other
+             * side of the level) and the trigger sample, to find where the signal crossed.
+             */
+            *delay = 0;
+            cur = data[j];
+            if ((j > 0) || t->have_last) {
+                prev = (j > 0) ? data[j - 1] : t->last;
+                if (cur != prev) {
+                    *delay = abs(10000 * (cur - t->level) / (cur - prev));
+                }
+            }
+
+            t->holdoff_end = at + t->holdoff;
+            advance(t, data, j);
+            return j;
+        }
+    }
+
+    advance(t, data, n);
+    return n;
+}
+
+void trigger_set(Trigger *t, int mode, int level, int hysteresis)
+{
+    t->mode = mode;
+    t->level = level;
+    t->hysteresis = (hysteresis > 0) ? hysteresis : 0;
+    t->armed_at = -1;
+}
+
+void trigger_start(Trigger *t, int rate)
+{
+    t->holdoff = (long long) scope.trighold * rate / 1000000;
+    t->min_width = (long long) scope.trigwmin * rate / 1000000;
+    t->max_width = (long long) scope.trigwmax * rate / 1000000;
+    if ((scope.trigwmax > 0) && (t->max_width == 0)) {
+        t->max_width = 1;
+    }
+
+    t->pos = 0;
+    t->armed_at = -1;
+    t->holdoff_end = 0;
+    t->have_last = 0;
+}
+
+int trigger_find(Trigger *t, const short *data, int n, int *delay)
+{
+    *delay = 0;
+    if (t->mode == 0) {
+        return 0;               /* freerun - everything triggers */
+    }
+    return scan(t, data, n, delay);
+}
+
+void trigger_skip(Trigger *t, const short *data, int n)
+{
+    if (t->mode == 0) {
+        advance(t, data, n);
+    } else {
+        scan(t, data, n, NULL);
+    }
+}
+
+void trigger_gap(Trigger *t, long long n)
+{
+    t->pos += n;
+    t->armed_at = -1;
+    t->have_last = 0;
+}
+
+/* Pre-trigger history */
+
+void history_resize(History *h, int size, int elsize)
+{
+    if (size != h->size || elsize != h->elsize) {
+        h->data = g_realloc(h->data, (size_t) size * elsize);
+        h->size = size;
+        h->elsize = elsize;
+    }
+    history_clear(h);
+}
+
+void history_reserve(History *h, int size, int elsize)
+{
+    if (size > h->size || elsize != h->elsize) {
+        history_resize(h, size, elsize);
+    }
+}
+
+void history_clear(History *h)
+{
+    h->head = 0;
+    h->fill = 0;
+}
+
+void history_push(History *h, const void *data, int n)
+{
+    int k;
+
+    if (h->size == 0 || n <= 0) {
+        return;
+    }
+    if (n > h->size) {
+        data = (const char *) data + (n - h->size) * h->elsize;
+        n = h->size;
+    }
+
+    k = h->size - h->head;
+    if (k > n) {
+        k = n;
+    }
+    memcpy(h->data + h->head * h->elsize, data, k * h->elsize);
+    memcpy(h->data, (const char *) data + k * h->elsize, (n - k) * h->elsize);
+
+    h->head = (h->head + n) % h->size;
+    h->fill = (h->fill + n > h->size) ? h->size : h->fill + n;
+}
+
+void history_copy(History *h, void *out, int n)
+{
+    int start, k;
+
+    if (n <= 0) {
+        return;
+    }
+    start = (h->head - n + h->size) % h->size;
+    k = h->size - start;
+    if (k > n) {
+        k = n;
+    }
+    memcpy(out, h->data + start * h->elsize, k * h->elsize);
+    memcpy((char *) out + k * h->elsize, h->data, (n - k) * h->elsize);
+}
+
+int pretrigger_samples(int width)
+{
+    int pre = (long long) width * scope.trigpos / 100;
+
+    return (pre < width || width == 0) ? pre : width - 1;
+}
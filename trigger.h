@@ -0,0 +1,96 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * trigger search routines available outside of trigger.c
+ *
+ */
+
+/* Find the first rising (dir > 0) or falling (dir < 0) crossing of 'level' in data[0..n).  A
+ * sample crosses if it's beyond the level while the sample before it (or 'prev', for the first
+ * one) isn't, and to filter out noise, more than 5 of the (up to) 10 samples after it have to be
+ * further beyond it still.  Returns the index of the crossing, or n if there isn't one.
+ */
+int             trigger_search(const short *data, int n, int level, int dir, int prev);
+
+/* The trigger engine.  Each DataSrc keeps one of these, and feeds it the samples of the channel it
+ * triggers on, converted to shorts, in the order they arrive - both while it's looking for a
+ * trigger (trigger_find) and while it's capturing a sweep (trigger_skip).  Since it remembers where
+ * it left off, a crossing that straddles two reads is found like any other.
+ *
+ * A rising trigger arms when the signal goes below level - hysteresis, and fires at the first
+ * sample after that at or above the level (falling is the same, upside down).  It is only accepted
+ * if at least 'holdoff' samples have gone by since the last one, and if the time it spent armed
+ * (the width of the pulse before the edge) is within min_width and max_width.  Either way, a
+ * crossing disarms the trigger.
+ */
+
+typedef struct Trigger {
+    int mode;                   /* 0 - freerun, 1 - rising, 2 - falling */
+    int level;                  /* in sample values */
+    int hysteresis;             /* in sample values */
+    long long holdoff;          /* in samples, from trigger_start() */
+    long long min_width;        /* in samples; 0 for no limit */
+    long long max_width;        /* in samples; 0 for no limit */
+
+    long long pos;              /* stream position of the next sample we'll be given */
+    long long armed_at;         /* stream position where we armed, or -1 */
+    long long holdoff_end;      /* no triggers before this stream position */
+    int have_last;              /* TRUE if 'last' is the sample just before 'pos' */
+    short last;
+} Trigger;
+
+/* Called from a DataSrc's set_trigger() and clear_trigger() (mode 0) */
+void            trigger_set(Trigger *t, int mode, int level, int hysteresis);
+
+/* Called from a DataSrc's reset(), to start a new stream.  Picks up the holdoff and pulse width
+ * settings from the Scope structure, converting them to samples at 'rate'.
+ */
+void            trigger_start(Trigger *t, int rate);
+
+/* The most samples a DataSrc converts at a time to look for a trigger in, so that what it converts
+ * them into needn't be as long as a sweep
+ */
+#define TRIGGER_STEP    65536
+
+/* Looks for a trigger in data[0..n).  Returns its index and sets '*delay' (ten-thousandths of a
+ * sample, as in Signal.delay) to where between it and the sample before it the signal actually
+ * crossed the level.  Returns n if there's no trigger.  The samples from the returned index on
+ * haven't been looked at yet, and should be passed to trigger_skip() or trigger_find() next.
+ */
+int             trigger_find(Trigger *t, const short *data, int n, int *delay);
+
+/* Tells the engine about samples that can't trigger, because they're part of a sweep */
+void            trigger_skip(Trigger *t, const short *data, int n);
+
+/* Tells the engine that 'n' samples went by that it will never see */
+void            trigger_gap(Trigger *t, long long n);
+
+/* Pre-trigger history.  While it's looking for a trigger, a DataSrc pushes the samples it has gone
+ * past into one of these per channel, along with the samples of each sweep, so that once it finds a
+ * trigger, the samples leading up to it are still at hand.  It holds the last 'size' samples, of
+ * 'elsize' bytes each - shorts for Signal.data, or WIDE_SIZE for Signal.wide.  That only needs to
+ * be as many as pretrigger_samples() asks for, not a whole sweep.
+ */
+
+typedef struct History {
+    char *data;
+    int size;                   /* size of data[] in samples */
+    int elsize;                 /* size of a sample in bytes */
+    int head;                   /* where the next sample goes */
+    int fill;                   /* how many samples are valid */
+} History;
+
+void            history_resize(History *h, int size, int elsize);
+
+/* Resizes 'h' (starting it over) only if it can't already hold 'size' samples of 'elsize' bytes */
+void            history_reserve(History *h, int size, int elsize);
+
+void            history_clear(History *h);
+void            history_push(History *h, const void *data, int n);
+
+/* Copies the last n samples pushed into out[0..n), oldest first.  n can't be more than h->fill. */
+void            history_copy(History *h, void *out, int n);
+
+/* How many of a sweep's 'width' samples come from before the trigger, per scope.trigpos */
+int             pretrigger_samples(int width);
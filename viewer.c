@@ -0,0 +1,775 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements a data source for looking through a long recording
+ *
+ * readfile() parses a saved file into the memory channels, and Replay plays a capture back in
+ * time, but neither is any use for finding something in an hour-long, multi-gigabyte recording
+ * made with -k.  The Viewer maps the recording (see record.h) into memory and shows one screenful
+ * of it at a time, at whatever timebase is selected; '*' and '^' page forwards and backwards, and
+ * "-o pos=SECONDS" jumps anywhere.
+ *
+ * A screen never gets more than VIEW_POINTS points.  When the timebase covers more samples than
+ * that, each pair of points is the minimum and maximum of the samples it covers, so narrow spikes
+ * still show.  Those come from a pyramid of minimums and maximums over 1:16, 1:256, 1:4096... of
+ * the samples, built the first time a recording is opened and kept next to it in a sidecar file
+ * (the recording's name plus MIP_SUFFIX).  Drawing a screen reads only the level of the pyramid
+ * that matches the timebase, a few thousand entries at most, so zooming out over an hour of data
+ * takes about as long as zooming in on a millisecond of it.
+ *
+ * Each block is shown at its time in the recording, so where a source skipped samples or the
+ * recorder dropped blocks, the trace runs along the center line instead of joining the samples on
+ * either side as if nothing was missing.  Only the channels in the recording's first block are
+ * shown, at that block's rate; blocks with other channels or another rate (the sample rate changed
+ * while recording) are left out, and the status line says how many.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xoscope.h"            /* program defaults */
+#include "record.h"
+
+#define VIEW_MAXCHANS   26
+#define VIEW_POINTS     4096    /* most points on a screen */
+
+#define MIP_SHIFT       4       /* each level has 1/16 the buckets of the one below it */
+#define MIP_LEVELS      5       /* 1:16 up to 1:1048576 */
+#define MIP_MAGIC       "XOSCMIP\n"
+#define MIP_VERSION     2
+#define MIP_SUFFIX      ".mip"
+
+/* The sidecar: this header, then for each level, for each channel, the level's buckets as pairs
+ * of shorts, the minimum first.  A bucket with no samples in it, in a gap, has its minimum above
+ * its maximum.
+ */
+
+typedef struct MipHeader {
+    char magic[8];              /* MIP_MAGIC */
+    guint32 version;            /* MIP_VERSION */
+    guint32 nchans;
+    guint64 source_size;        /* of the recording it was built from... */
+    gint64 source_mtime;        /* ...and when that was last modified */
+    guint64 nsamples;
+    guint64 level[MIP_LEVELS];  /* offset of each level */
+} MipHeader;
+
+typedef struct MinMax {
+    short min;
+    short max;
+} MinMax;
+
+static char view_file[256] = "";
+static const char *view_error = NULL;
+static int view_opened = 0;             /* t if open has at least been _attempted_ */
+
+static const char *map = NULL;          /* the recording */
+static size_t map_size = 0;
+static char *mip = NULL;                /* the pyramid */
+static size_t mip_size = 0;
+static guint64 mip_level[MIP_LEVELS];   /* where each level starts in it */
+
+/* The recording's blocks with our channels in them, in order */
+
+static guint64 *blk_offset = NULL;      /* of the RecordBlock in the file */
+static guint64 *blk_start = NULL;       /* sample number of its first sample */
+static guint32 *blk_n = NULL;
+static long nblocks = 0;
+static long gaps = 0;                   /* blocks that don't follow on from the one before */
+static long dropped = 0;                /* blocks the recorder dropped */
+static long left_out = 0;               /* blocks we can't show with the rest */
+
+static unsigned int view_mask = 0;      /* channels we show, as in RecordBlock.chans */
+static int view_chans = 0;
+static int view_rate = 0;
+static guint64 view_start = 0;          /* RecordBlock.time of our sample 0 */
+static guint64 nsamples = 0;            /* ...and of the end of the last block, from there */
+
+static Signal view_sig[VIEW_MAXCHANS];
+static int width = 0;
+
+static double pos = 0;                  /* sample number at the left of the screen */
+static int out_rate = 0;                /* rate of the points we draw */
+static double span = 1;                 /* samples per pair of points, if we're drawing minmax */
+static int level = -1;                  /* pyramid level they come from, 0 for samples, -1 if raw */
+static int dirty = 0;                   /* a new screen needs drawing */
+
+static guint64 level_buckets(int k)
+{
+    return (nsamples + (1ULL << (MIP_SHIFT * k)) - 1) >> (MIP_SHIFT * k);
+}
+
+static MinMax * level_data(int k, int chan)
+{
+    return (MinMax *) (mip + mip_level[k - 1]) + (guint64) chan * level_buckets(k);
+}
+
+static void close_view(void)
+{
+    if (map != NULL) munmap((void *) map, map_size);
+    if (mip != NULL) munmap(mip, mip_size);
+    map = NULL;
+    mip = NULL;
+    g_free(blk_offset);
+    g_free(blk_start);
+    g_free(blk_n);
+    blk_offset = blk_start = NULL;
+    blk_n = NULL;
+    nblocks = 0;
+    gaps = dropped = left_out = 0;
+    nsamples = 0;
+    view_chans = 0;
+}
+
+/* Add a block at its place in time.  Blocks that start before the one before them ended can only
+ * come from a change of rate, and are left out along with those that have other channels.
+ */
+
+static void add_block(guint64 offset)
+{
+    const RecordBlock *b = (const RecordBlock *) (map + offset);
+    static long room = 0;
+
+    if (b->n == 0) return;
+
+    if (nblocks == 0) {
+        room = 0;
+        view_mask = b->chans;
+        view_rate = b->rate;
+        view_start = b->time;
+    }
+    dropped += b->dropped;
+    if (b->chans != view_mask || b->rate != (guint32) view_rate
+        || b->time < view_start + nsamples) {
+        left_out ++;
+        return;
+    }
+    if (b->time > view_start + nsamples) gaps ++;
+
+    if (nblocks == room) {
+        room = room ? room * 2 : 1024;
+        blk_offset = g_renew(guint64, blk_offset, room);
+        blk_start = g_renew(guint64, blk_start, room);
+        blk_n = g_renew(guint32, blk_n, room);
+    }
+    blk_offset[nblocks] = offset;
+    blk_start[nblocks] = b->time - view_start;
+    blk_n[nblocks] = b->n;
+    nblocks ++;
+    nsamples = blk_start[nblocks - 1] + b->n;
+}
+
+/* The size of a block, samples and all; the shorts are followed by wide samples if it has them */
+
+static guint64 block_bytes(const RecordBlock *b)
+{
+    int c, nchans = 0;
+
+    for (c = 0; c < RECORD_MAXCHANS; c++) {
+        if (b->chans & (1u << c)) nchans ++;
+    }
+    return sizeof(RecordBlock) + (guint64) b->n * nchans
+        * (sizeof(short) + ((b->format != SAMPLE_S16) ? WIDE_SIZE : 0));
+}
+
+static int block_fits(guint64 offset)
+{
+    const RecordBlock *b = (const RecordBlock *) (map + offset);
+
+    if (offset + sizeof(RecordBlock) > map_size || b->magic != RECORD_BLOCK) return 0;
+    return offset + block_bytes(b) <= map_size;
+}
+
+/* Find the blocks.  A recording that was closed properly has a trailer pointing at a chain of
+ * indexes, so we needn't touch every block; otherwise walk through them all from the start.
+ */
+
+static void find_blocks(void)
+{
+    const RecordTrailer *trailer = (const RecordTrailer *) (map + map_size - sizeof(RecordTrailer));
+    const RecordIndex *index;
+    const RecordIndexEntry *entry;
+    guint64 at, *chain = NULL;
+    long nchain = 0, i;
+    guint32 k;
+
+    if (map_size >= sizeof(RecordHeader) + sizeof(RecordTrailer) && trailer->magic == RECORD_END) {
+
+        /* The chain runs backwards; follow it, then (if it's all there) add the blocks front to
+         * back
+         */
+
+        for (at = trailer->last; at != 0 && at + sizeof(RecordIndex) <= map_size; ) {
+            index = (const RecordIndex *) (map + at);
+            if (index->magic != RECORD_INDEX || index->prev >= at
+                || at + sizeof(RecordIndex) + index->count * sizeof(RecordIndexEntry) > map_size) {
+                break;
+            }
+            if ((nchain & (nchain - 1)) == 0) {
+                chain = g_renew(guint64, chain, nchain ? nchain * 2 : 1);
+            }
+            chain[nchain++] = at;
+            at = index->prev;
+        }
+        for (i = (at == 0) ? nchain - 1 : -1; i >= 0; i--) {
+            index = (const RecordIndex *) (map + chain[i]);
+            entry = (const RecordIndexEntry *) (index + 1);
+            for (k = 0; k < index->count; k++) {
+                if (block_fits(entry[k].offset)) add_block(entry[k].offset);
+            }
+        }
+        g_free(chain);
+        if (nblocks > 0) return;
+    }
+
+    for (at = sizeof(RecordHeader); at + sizeof(guint32) <= map_size; ) {
+        if (block_fits(at)) {
+            add_block(at);
+            at += block_bytes((const RecordBlock *) (map + at));
+        } else if (at + sizeof(RecordIndex) <= map_size
+                   && ((const RecordIndex *) (map + at))->magic == RECORD_INDEX) {
+            at += sizeof(RecordIndex)
+                + ((const RecordIndex *) (map + at))->count * sizeof(RecordIndexEntry);
+        } else {
+            break;              /* the end, or the middle of a block cut short */
+        }
+    }
+}
+
+/* Channel 'chan''s samples in block 'b' */
+
+static const short * block_samples(long b, int chan)
+{
+    return (const short *) (map + blk_offset[b] + sizeof(RecordBlock)) + (guint64) chan * blk_n[b];
+}
+
+/* The block that sample 's' is in */
+
+static long find_block(guint64 s)
+{
+    long lo = 0, hi = nblocks - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (blk_start[mid] <= s) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/* Copy 'n' samples of channel 'chan', from sample 's' on.  Nothing was recorded in a gap, so we
+ * show the center line there.
+ */
+
+static void read_samples(int chan, guint64 s, int n, short *out)
+{
+    long b = find_block(s);
+    guint64 k;
+
+    while (n > 0) {
+        if (b < nblocks && s >= blk_start[b] + blk_n[b]) {
+            b ++;
+            continue;
+        }
+        if (b < nblocks && s >= blk_start[b]) {
+            k = blk_start[b] + blk_n[b] - s;
+            if (k > (guint64) n) k = n;
+            memcpy(out, block_samples(b, chan) + (s - blk_start[b]), k * sizeof(short));
+        } else {
+            k = (b < nblocks) ? blk_start[b] - s : (guint64) n;
+            if (k > (guint64) n) k = n;
+            memset(out, 0, k * sizeof(short));
+        }
+        out += k;
+        n -= k;
+        s += k;
+    }
+}
+
+/* Build the pyramid into 'mip': level 1 from the samples, a block at a time, and every level
+ * after that from the one below it.  Level 1 starts out empty, which is what stays in the gaps.
+ */
+
+static void build_pyramid(void)
+{
+    MinMax *out, *m;
+    const short *p;
+    const MinMax *in;
+    guint64 j, nb, from, to;
+    int c, k;
+    long b;
+    guint32 i;
+    short mn, mx;
+
+    for (c = 0; c < view_chans; c++) {
+        out = level_data(1, c);
+        for (j = 0; j < level_buckets(1); j++) {
+            out[j].min = SHRT_MAX;
+            out[j].max = SHRT_MIN;
+        }
+    }
+
+    for (b = 0; b < nblocks; b++) {
+        for (c = 0; c < view_chans; c++) {
+            p = block_samples(b, c);
+            out = level_data(1, c);
+            for (i = 0; i < blk_n[b]; i++) {
+                m = &out[(blk_start[b] + i) >> MIP_SHIFT];
+                if (p[i] < m->min) m->min = p[i];
+                if (p[i] > m->max) m->max = p[i];
+            }
+        }
+    }
+
+    for (k = 2; k <= MIP_LEVELS; k++) {
+        nb = level_buckets(k);
+        for (c = 0; c < view_chans; c++) {
+            in = level_data(k - 1, c);
+            out = level_data(k, c);
+            for (j = 0; j < nb; j++) {
+                from = j << MIP_SHIFT;
+                to = from + (1 << MIP_SHIFT);
+                if (to > level_buckets(k - 1)) to = level_buckets(k - 1);
+                mn = SHRT_MAX;
+                mx = SHRT_MIN;
+                for (; from < to; from++) {
+                    if (in[from].min < mn) mn = in[from].min;
+                    if (in[from].max > mx) mx = in[from].max;
+                }
+                out[j].min = mn;
+                out[j].max = mx;
+            }
+        }
+    }
+}
+
+/* Map the sidecar if it's there and matches the recording; otherwise (re)build it.  If we can't
+ * write one, build the pyramid in memory - it'll just have to be done again next time.
+ */
+
+static void open_pyramid(const struct stat *st)
+{
+    char path[sizeof(view_file) + sizeof(MIP_SUFFIX)];
+    struct stat mst;
+    MipHeader header, *h;
+    guint64 off;
+    int fd, k;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MIP_MAGIC, sizeof(header.magic));
+    header.version = MIP_VERSION;
+    header.nchans = view_chans;
+    header.source_size = st->st_size;
+    header.source_mtime = st->st_mtime;
+    header.nsamples = nsamples;
+    off = sizeof(header);
+    for (k = 1; k <= MIP_LEVELS; k++) {
+        header.level[k - 1] = mip_level[k - 1] = off;
+        off += level_buckets(k) * view_chans * sizeof(MinMax);
+    }
+    mip_size = off;
+
+    snprintf(path, sizeof(path), "%s%s", view_file, MIP_SUFFIX);
+
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        mip = MAP_FAILED;
+        if (fstat(fd, &mst) == 0 && mst.st_size == (off_t) mip_size) {
+            mip = mmap(NULL, mip_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mip != MAP_FAILED && memcmp(mip, &header, sizeof(header)) == 0) return;
+        if (mip != MAP_FAILED) munmap(mip, mip_size);
+    }
+
+    fprintf(stderr, "%s: building min/max index...\n", view_file);
+
+    mip = MAP_FAILED;
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666)) >= 0) {
+        if (ftruncate(fd, mip_size) == 0) {
+            mip = mmap(NULL, mip_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mip == MAP_FAILED) unlink(path);
+    }
+    if (mip == MAP_FAILED) {
+        mip = mmap(NULL, mip_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mip == MAP_FAILED) {
+        view_error = strerror(errno);
+        mip = NULL;
+        return;
+    }
+
+    /* The header goes in last, so a sidecar that didn't get finished won't match */
+
+    h = (MipHeader *) mip;
+    memset(h, 0, sizeof(header));
+    build_pyramid();
+    memcpy(h, &header, sizeof(header));
+    msync(mip, mip_size, MS_ASYNC);
+}
+
+static void open_view(void)
+{
+    struct stat st;
+    int fd, c;
+
+    close_view();
+    view_opened = 1;
+    view_error = NULL;
+
+    if (view_file[0] == '\0') return;
+
+    if ((fd = open(view_file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        view_error = strerror(errno);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    map_size = st.st_size;
+    map = (map_size > 0) ? mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        view_error = map_size ? strerror(errno) : "empty recording";
+        map = NULL;
+        return;
+    }
+
+    if (map_size < sizeof(RecordHeader) || memcmp(map, RECORD_MAGIC, 8) != 0) {
+        view_error = "not a recording";
+        close_view();
+        return;
+    }
+    if (((const RecordHeader *) map)->version != RECORD_VERSION) {
+        view_error = "recording from another version";
+        close_view();
+        return;
+    }
+
+    find_blocks();
+    if (nsamples == 0) {
+        view_error = "empty recording";
+        close_view();
+        return;
+    }
+
+    for (c = 0; c < 32; c++) {
+        if ((view_mask & (1u << c)) && view_chans < VIEW_MAXCHANS) {
+            snprintf(view_sig[view_chans].name, sizeof(view_sig[0].name), "Rec %c", 'a' + c);
+            snprintf(view_sig[view_chans].savestr, sizeof(view_sig[0].savestr), "%c",
+                     'a' + view_chans);
+            view_chans ++;
+        }
+    }
+
+    open_pyramid(&st);
+    if (mip == NULL) {
+        close_view();
+        return;
+    }
+
+    pos = 0;
+}
+
+static int nchans(void)
+{
+    if (!view_opened) open_view();
+    return view_chans;
+}
+
+static int fd(void)
+{
+    return -1;
+}
+
+static Signal * view_chan(int chan)
+{
+    return (chan >= 0 && chan < VIEW_MAXCHANS) ? &view_sig[chan] : NULL;
+}
+
+static void set_width(int w)
+{
+    int i;
+
+    width = w;
+    for (i = 0; i < VIEW_MAXCHANS; i++) {
+        if (view_sig[i].width != width) {
+            g_free(view_sig[i].data);
+            view_sig[i].data = g_new0(short, width);
+            view_sig[i].width = width;
+        }
+    }
+}
+
+/* How many of the recording's samples fit on the screen at the current timebase */
+
+static double screen_samples(void)
+{
+    return (double) view_rate * 10 * scope.scale / 1000;
+}
+
+/* Keep the screen within the recording */
+
+static void clamp_pos(void)
+{
+    double last = nsamples - screen_samples();
+
+    if (pos > last) pos = last;
+    if (pos < 0) pos = 0;
+}
+
+/* Work out, for the current timebase, whether we show samples or pairs of minmax points, and how
+ * far apart they are.  The display asks for a screen's worth at out_rate, which is never more
+ * than VIEW_POINTS.
+ */
+
+static void reset(void)
+{
+    double secs = 10 * scope.scale / 1000;
+    int i;
+
+    if (screen_samples() <= VIEW_POINTS) {
+        out_rate = view_rate;
+        level = -1;
+    } else {
+        out_rate = (int) (VIEW_POINTS / secs) & ~1;
+        if (out_rate < 2) out_rate = 2;
+        span = 2.0 * view_rate / out_rate;
+        for (level = 0; level < MIP_LEVELS && (1 << (MIP_SHIFT * (level + 1))) <= span; level++);
+    }
+
+    for (i = 0; i < view_chans; i++) {
+        view_sig[i].rate = out_rate;
+        view_sig[i].num = 0;
+        view_sig[i].frame ++;
+        view_sig[i].volts = 0;
+    }
+
+    clamp_pos();
+    dirty = 1;
+    in_progress = 0;
+}
+
+/* Minimum and maximum of channel 'chan' over samples 'from' to 'to', from pyramid level 'k' */
+
+static void minmax(int chan, int k, guint64 from, guint64 to, short *mn, short *mx)
+{
+    short buf[1 << MIP_SHIFT];
+    const MinMax *m;
+    guint64 i;
+    int n;
+
+    *mn = SHRT_MAX;
+    *mx = SHRT_MIN;
+
+    if (k == 0) {
+        n = to - from;
+        read_samples(chan, from, n, buf);
+        for (i = 0; i < (guint64) n; i++) {
+            if (buf[i] < *mn) *mn = buf[i];
+            if (buf[i] > *mx) *mx = buf[i];
+        }
+    } else {
+        m = level_data(k, chan);
+        to = (to + (1ULL << (MIP_SHIFT * k)) - 1) >> (MIP_SHIFT * k);
+        for (i = from >> (MIP_SHIFT * k); i < to; i++) {
+            if (m[i].min < *mn) *mn = m[i].min;
+            if (m[i].max > *mx) *mx = m[i].max;
+        }
+    }
+
+    /* All gap; show the center line, as read_samples() does */
+
+    if (*mn > *mx) {
+        *mn = *mx = 0;
+    }
+}
+
+/* Draw a screen, all at once, whenever something's changed */
+
+static int get_data(void)
+{
+    guint64 from, to;
+    int c, j, n = 0;
+
+    if (!dirty || map == NULL || width == 0) return 0;
+    dirty = 0;
+
+    for (c = 0; c < view_chans; c++) {
+        if (view_sig[c].listeners <= 0) continue;
+        if (level < 0) {
+            n = width;
+            if ((guint64) pos + n > nsamples) n = nsamples - (guint64) pos;
+            read_samples(c, (guint64) pos, n, view_sig[c].data);
+        } else {
+            for (n = 0; n + 1 < width; n += 2) {
+                j = n / 2;
+                from = pos + j * span;
+                to = pos + (j + 1) * span;
+                if (from >= nsamples) break;
+                if (to > nsamples) to = nsamples;
+                if (to <= from) to = from + 1;
+                minmax(c, level, from, to, &view_sig[c].data[n], &view_sig[c].data[n + 1]);
+            }
+        }
+    }
+
+    for (c = 0; c < view_chans; c++) {
+        view_sig[c].num = n;
+        view_sig[c].delay = 0;
+        view_sig[c].frame ++;
+    }
+    in_progress = 0;
+
+    return 1;
+}
+
+/* '*' and '^' page forwards and backwards by a screen */
+
+static int page(int dir)
+{
+    if (map == NULL) return 0;
+    pos += dir * screen_samples();
+    clamp_pos();
+    return 1;
+}
+
+static int option1(void)
+{
+    return page(1);
+}
+
+static const char * option1str(void)
+{
+    return "NEXT PAGE";
+}
+
+static int option2(void)
+{
+    return page(-1);
+}
+
+static const char * option2str(void)
+{
+    return "PREV PAGE";
+}
+
+static const char * status_str(int i)
+{
+    static char string[48];
+
+    switch (i) {
+    case 0:
+        return view_file;
+
+    case 1:
+        if (view_chans > 0) {
+            snprintf(string, sizeof(string), "%d x %d S/s", view_chans, view_rate);
+            return string;
+        } else {
+            return "";
+        }
+
+    case 2:
+        if (view_error) {
+            return view_error;
+        } else if (left_out > 0) {
+            snprintf(string, sizeof(string), "%ld blocks left out", left_out);
+            return string;
+        } else if (gaps > 0) {
+            snprintf(string, sizeof(string), "%ld gaps, %ld blocks dropped", gaps, dropped);
+            return string;
+        } else {
+            return "";
+        }
+
+    case 3:
+        if (map != NULL) {
+            snprintf(string, sizeof(string), "%.3f of %.3f s", pos / view_rate,
+                     (double) nsamples / view_rate);
+            return string;
+        } else {
+            return "";
+        }
+
+    case 4:
+        if (map == NULL) {
+            return "";
+        } else if (level < 0) {
+            return "samples";
+        } else if (level == 0) {
+            return "min/max of samples";
+        } else {
+            snprintf(string, sizeof(string), "min/max 1:%d", 1 << (MIP_SHIFT * level));
+            return string;
+        }
+    }
+    return NULL;
+}
+
+static int set_option(char *option)
+{
+    if (strncmp(option, "file=", 5) == 0) {
+        strncpy(view_file, option + 5, sizeof(view_file) - 1);
+        view_file[strcspn(view_file, "\n")] = '\0';
+        open_view();
+        return 1;
+    } else if (strncmp(option, "pos=", 4) == 0) {
+        pos = atof(option + 4) * view_rate;
+        clamp_pos();
+        dirty = 1;
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static char * save_option(int i)
+{
+    static char buf[sizeof(view_file) + 8];
+
+    switch (i) {
+    case 0:
+        snprintf(buf, sizeof(buf), "file=%s", view_file);
+        return buf;
+
+    case 1:
+        snprintf(buf, sizeof(buf), "pos=%.6f", view_rate ? pos / view_rate : 0.0);
+        return buf;
+
+    default:
+        return NULL;
+    }
+}
+
+DataSrc datasrc_viewer = {
+    "Viewer",
+    nchans,
+    view_chan,
+    NULL,  /* set_trigger, */
+    NULL,  /* clear_trigger, */
+    NULL,  /* change_rate, */
+    set_width,
+    reset,
+    fd,
+    get_data,
+    status_str,
+    option1,
+    option1str,
+    option2,
+    option2str,
+    set_option,
+    save_option,
+    NULL,  /* gtk_options */
+    NULL,  /* poll_fds */
+    NULL,  /* poll_revents */
+};
@@ -17,6 +17,8 @@
 #include "display.h"            /* display routines */
 #include "func.h"               /* signal math functions */
 #include "file.h"               /* file I/O functions */
+#include "acquire.h"            /* acquisition thread */
+#include "record.h"             /* the recorder */
 
 /* global program structures */
 Scope scope;
@@ -30,6 +32,10 @@ extern DataSrc datasrc_esd;
 #ifdef HAVE_LIBCOMEDI
 extern DataSrc datasrc_comedi;
 #endif
+extern DataSrc datasrc_stream;
+extern DataSrc datasrc_replay;
+extern DataSrc datasrc_gen;
+extern DataSrc datasrc_viewer;
 
 DataSrc *datasrcs[] = {
 #ifdef HAVE_LIBCOMEDI
@@ -39,8 +45,12 @@ DataSrc *datasrcs[] = {
     &datasrc_esd,
 #endif
 #ifdef HAVE_LIBASOUND
-    &datasrc_sc
+    &datasrc_sc,
 #endif
+    &datasrc_stream,
+    &datasrc_replay,
+    &datasrc_gen,
+    &datasrc_viewer
 };
 
 int ndatasrcs = sizeof(datasrcs)/sizeof(DataSrc *);
@@ -55,9 +65,10 @@ char version[] = VERSION;       /* version of the program, from Makefile */
 char error[256];                /* buffer for "one-line" error messages */
 int clip = 0;                   /* whether we're maxed out or not */
 char *filename;                 /* default file name */
-int frames = 0;                 /* # of frames (full or partial) captured */
-int in_progress = 0;            /* frame collection in progress?
+int frames = 0;                 /* # of frames (full or partial) drawn */
+__thread int in_progress = 0;   /* frame collection in progress?
                                  *   if so, this is index of next sample
+                                 *   (thread-local: the capture thread has its own, see acquire.c)
                                  */
 
 const char * datasrc_names(void)
@@ -97,13 +108,17 @@ Startup Options  Description (defaults)               version %s\n\
 -a <channel>     set the Active channel: 1-%d                  (%d)\n\
 -s <scale>       time Scale: 1/500000-2000/1 where 1=1ms/div  (1/%d)\n\
 -t <trigger>     Trigger level[:type[:channel]]               (%s)\n\
+                   [:hysteresis[:holdoff[:minwidth[:maxwidth]]]] (us)\n\
+-w <percent>     hoW much of the sweep is before the trigger  (0)\n\
 -l <cursors>     cursor Line positions: first[:second[:on?]]  (%s)\n\
 -f <font name>   the Font name as-in %s\n\
 -p <type>        Plot mode: 0.=point .0=sweep                 (%02d)\n\
                             1.=line  .1=accumulate\n\
                             2.=step  .2=strip-chart\n\
+-e <ms>          pErsistence in accumulate mode, 0=forever    (1000)\n\
 -g <style>       Graticule: 0=none,  1=minor, 2=major         (%d)\n\
 -i <min interv>  Minimum display update interval (ms)         (50)\n\
+-k <file>        Keep a recording of everything captured in file\n\
 -b               %s Behind instead of in front of %s\n\
 -v               turn Verbose key help display %s\n\
 file             %s file to load to restore settings and memory\n\
@@ -131,8 +146,8 @@ void parse_args(int argc, char **argv)
 {
     const char     *flags = "Hh"
         "1:2:3:4:5:6:7:8:"
-        "a:r:s:t:l:c:m:d:f:p:g:o:i:bvxyz"
-        "A:R:S:T:L:C:M:D:F:P:G:o:I:BVXYZ";
+        "a:r:s:t:w:l:c:m:d:f:p:e:g:o:i:k:bvxyz"
+        "A:R:S:T:W:L:C:M:D:F:P:E:G:o:I:K:BVXYZ";
     int c;
 
     /* If a data source, data source option, or ALSA device name was specified on the command line,
@@ -165,6 +180,8 @@ void parse_args(int argc, char **argv)
 /* cleanup before exiting due to error or program end */
 void cleanup(void)
 {
+    acquire_close();
+    record_close();
     cleanup_math();
 }
 
@@ -184,6 +201,8 @@ void init_scope(void)
     scope.select = DEF_A - 1;
     scope.verbose = DEF_V;
     scope.min_interval = 50;
+    scope.trigpos = 0;
+    scope.persist = 1000;
 }
 
 /* initialize the signals */
@@ -197,6 +216,7 @@ void init_channels(void)
     }
     first = 0;
     for (i = 0 ; i < CHANNELS ; i++) {
+        g_free(ch[i].planes);
         bzero(&ch[i], sizeof(Channel));
         ch[i].signal = NULL;
         ch[i].scale = 1.0;
@@ -213,20 +233,22 @@ void init_channels(void)
  * samples/sec) to get samples per screen, and add one so rounding doesn't make us end a capture
  * before the end of the screen.
  *
- * XXX MAXWID is defined (in configure.ac) as: 1024*256=262144
- * On long time basis, this results in a sweep that does not fill the screen.
- * Under "worst conditions" - 44,1 kHz sampling rate and 2s/div - we need 882000 samples
- * for a full screen.
+ * Under "worst conditions" - 384 kHz sampling rate and 2s/div - we need 7680000 samples for a
+ * full screen, so work it out in double precision before we clip it.  The clip is MAXSWEEP (in
+ * configure.ac), which only guards against silly rates; it used to be MAXWID, which cut long
+ * timebases short of the end of the screen.  A sweep's memory is only taken up as its samples
+ * arrive, and each channel keeps no more than three sweeps of it (see acquire.c), plus the part
+ * before the trigger.
  */
 
 int samples(int rate)
 {
-    static unsigned long int r;
+    double r;
 
-    r = rate * 10 * scope.scale / 1000 + 1;
+    r = (double) rate * 10 * scope.scale / 1000 + 1;
 
-    if (r > MAXWID) {
-        r = MAXWID;
+    if (r > MAXSWEEP) {
+        r = MAXSWEEP;
     }
 
     return r;
@@ -365,6 +387,8 @@ void datasrc_close(void)
         }
     }
 
+    acquire_close();
+
     datasrc = NULL;
     datasrci = -1;
 }
@@ -378,12 +402,14 @@ int datasrc_open(DataSrc *new_datasrc)
 
         datasrc_close();
 
-        datasrc = new_datasrc;
-
         for (i=0; i<limit; i++) {
-            if (datasrc == datasrcs[i]) datasrci = i;
+            if (new_datasrc == datasrcs[i]) datasrci = i;
         }
 
+        /* Capture on a separate thread; from here on, datasrc is a proxy for new_datasrc */
+
+        datasrc = acquire_open(new_datasrc);
+
         /* All data sources have at least one channel.  Show it. */
 
         if (ch[0].signal == NULL) {
@@ -414,16 +440,16 @@ void datasrc_force_open(DataSrc *new_datasrc)
 
     datasrc_close();
 
-    datasrc = new_datasrc;
-
-    if (datasrc == NULL) {
+    if (new_datasrc == NULL) {
         return;
     }
 
     for (i=0; i<limit; i++) {
-        if (datasrc == datasrcs[i]) datasrci = i;
+        if (new_datasrc == datasrcs[i]) datasrci = i;
     }
 
+    datasrc = acquire_open(new_datasrc);
+
     /* If data sources has a channel, show it. */
 
     /* XXX problem here - if data source requires options to be set before it can open properly,
@@ -444,6 +470,20 @@ void datasrc_force_open(DataSrc *new_datasrc)
 
 }
 
+/* Have the display call animate() when the data source has data for us.  Sources with poll_fds()
+ * are captured by acquire.c's thread, which polls them itself; what the display sees is its
+ * proxy, whose fd() is readable when a sweep has been published.  Returns 1 if we're waiting on a
+ * file descriptor.
+ */
+
+int datasrc_listen(void)
+{
+    int fd = datasrc ? datasrc->fd() : -1;
+
+    setinputfd(fd);
+    return (fd != -1);
+}
+
 /* Find the first valid datasrc; should only be called once return TRUE if successful; FALSE if no
  * valid datasrcs were found
  */
@@ -839,7 +879,7 @@ void handle_key(unsigned char c)
             scope.run = 0;
         }
         if ((scope.run == 1) && datasrc) {
-            setinputfd(datasrc->fd());  /* were stopped, so now start */
+            datasrc_listen();           /* were stopped, so now start */
         }
         update_text();
         break;
@@ -8,6 +8,7 @@
  *
  */
 
+#include <poll.h>               /* need struct pollfd below */
 #include <gtk/gtk.h>            /* need GdkPoint below */
 #include <gtkdatabox_graph.h>
 
@@ -24,7 +25,8 @@ extern char error[256];
 extern int quit_key_pressed;
 extern int clip;
 extern char *filename;
-extern int in_progress;
+extern int frames;               /* frames (full or partial) drawn by show_data() */
+extern __thread int in_progress; /* one per thread; see acquire.c */
 
 typedef struct Scope {          /* The oscilloscope */
     int plot_mode;              /* 0 - point; 1 - line; 2 - step */
@@ -38,10 +40,16 @@ typedef struct Scope {          /* The oscilloscope */
     int trigch;
     int trige;
     int trig;
+    int trighyst;               /* trigger hysteresis, in the same units as trig */
+    int trighold;               /* trigger holdoff, in microseconds */
+    int trigwmin;               /* trigger pulse width limits, in microseconds; 0 - none */
+    int trigwmax;
+    int trigpos;                /* how much of a sweep comes before the trigger, in percent */
     int curs;
     int cursa;
     int cursb;
     int min_interval;
+    int persist;                /* accumulate mode's decay time constant, in ms; 0 - forever */
 } Scope;
 extern Scope scope;
 
@@ -66,8 +74,26 @@ typedef struct Signal {
     int bits;                   /* number of valid bits - 0 for analog sig */
     int width;                  /* size of data[] in samples */
     short *data;                /* the data samples */
+    int format;                 /* SAMPLE_S16, or the format of wide[] */
+    void *wide;                 /* the same samples at full resolution, unless SAMPLE_S16 */
 } Signal;
 
+/* Sample formats.  Every Signal has its samples in data[], as shorts, and that's what gets
+ * triggered on, drawn in digital mode and saved to files.  A Signal from a source with more
+ * resolution than that also has them in wide[], with the same 'width', in the same units as data[]
+ * (so 'volts' applies to both), but with a fraction:
+ *
+ * SAMPLE_S32   - ints, with 16 bits of fraction; data[i] is wide[i] >> 16
+ * SAMPLE_FLOAT - floats; data[i] is wide[i] rounded towards zero and clipped to a short
+ *
+ * Math on wide Signals makes SAMPLE_FLOAT results, which don't overflow.
+ */
+#define SAMPLE_S16      0
+#define SAMPLE_S32      1
+#define SAMPLE_FLOAT    2
+
+#define WIDE_SIZE       4       /* bytes per wide[] sample, in either format */
+
 extern Signal mem[26];          /* Memory channels */
 
 typedef struct DataSrc {        /* A source of data samples */
@@ -171,6 +197,21 @@ typedef struct DataSrc {        /* A source of data samples */
      */
     void                (* gtk_options)(void);
 
+    /* Like fd(), but for data sources that have more than one file descriptor to poll on, or need
+     * poll events other than POLLIN (ALSA's poll descriptors, for example).  Fills in at most 'max'
+     * pollfd structures and returns how many it filled in; zero means no active signal capturing.
+     * Can be NULL, in which case fd() is used instead.  Always gets called after a reset()
+     */
+    int                 (* poll_fds)(struct pollfd *pfds, int max);
+
+    /* Goes with poll_fds(), for data sources whose poll descriptors don't say by themselves whether
+     * there's data: called with the pollfd structures poll_fds() filled in, after poll(2) returns
+     * some events for them, it returns the events they really mean (POLLIN when get_data() has
+     * something to read, POLLERR when it has an error to see to).  Can be NULL, in which case any
+     * event on the descriptors means get_data() should be called.
+     */
+    unsigned short      (* poll_revents)(struct pollfd *pfds, int n);
+
 } DataSrc;
 
 extern DataSrc *datasrc;
@@ -181,11 +222,26 @@ typedef GdkPoint Point;
 
 typedef struct SignalLine {
     int next_point;
+    int next_sample;            /* how many samples the points so far were made from */
+    int bucket;                 /* samples per min/max pair of points, or 1 for every sample */
+    int edges;                  /* digital trace with points only either side of its edges */
+    int last_edge;              /* ...the last edge it has points for */
+    int tail;                   /* ...the last point is only there because it's the last sample */
+    int size;                   /* points X, Y, data and index have room for */
+    int roll;                   /* stripchart mode: Y is a ring of 'size' points (see display.c) */
+    int filled;                 /* ...points in it so far, up to 'size' */
+    int frame;                  /* ...frame next_sample counts samples of */
+    int fill;                   /* ...samples so far in the bucket being filled */
+    gfloat lo, hi;              /* ...the smallest and largest of them */
+    int lo_first;               /* ...and which came first */
     struct SignalLine *next;    /* keep a linked list */
     GtkDataboxGraph *graph;
+    int graph_mode;             /* scope.plot_mode the graph was made for */
+    int graph_from;             /* first point the graph shows */
     gfloat *X;
     gfloat *Y;
     short *data;
+    int *index;                 /* which sample each point is */
     double x_offset;
     double y_offset;
     double y_scale;
@@ -200,6 +256,9 @@ typedef struct Channel {        /* The display channels */
     gfloat pos;                 /* Location of zero line on scope display;
                                  * 0 is center; 1 is top; -1 is bottom */
     int old_frame;              /* last frame number plotted */
+    guint32 *planes;            /* digital mode: the frame's samples as bit-planes (bitplane.h) */
+    int plane_words;            /* ...words per plane */
+    int plane_samples;          /* ...samples packed so far */
     int color;
     int show;
     int bits;
@@ -219,6 +278,7 @@ const char *    split_field(const char *, int, int);
 
 int     datasrc_byname(char *);
 void    datasrc_force_open(DataSrc *);
+int     datasrc_listen(void);
 
 double  roundoff(double, double);
 
@@ -27,6 +27,7 @@
 #include "func.h"
 #include "file.h"
 #include "xoscope_gtk.h"
+#include "persist.h"
 
 #include "builtins.h"
 
@@ -646,6 +647,27 @@ void set_trigger_level(GtkWidget *w, guint data)
     clear();
 }
 
+/* How far the signal has to go back past the level before the next edge counts */
+
+void set_trigger_hyst(GtkWidget *w, guint data)
+{
+    if (fixing_widgets) return;
+    scope.trighyst = data;
+    change_trigger(scope.trigch, scope.trig, scope.trige);
+
+    clear();
+}
+
+/* How much of the sweep comes from before the trigger */
+
+void set_trigger_pos(GtkWidget *w, guint data)
+{
+    if (fixing_widgets) return;
+    scope.trigpos = data;
+
+    clear();
+}
+
 void setposition(GtkWidget *w, guint data)
 {
     ch[scope.select].pos = data;
@@ -998,6 +1020,20 @@ static GtkItemFactoryEntry menu_items[] = {
     {"/Trigger/Position Negative/-112", NULL, set_trigger_level, -112, NULL},
     {"/Trigger/Position Negative/-120", NULL, set_trigger_level, -120, NULL},
     {"/Trigger/Position Negative/-128", NULL, set_trigger_level, -128, NULL},
+    {"/Trigger/Hysteresis", NULL, NULL, 0, "<Branch>"},
+    {"/Trigger/Hysteresis/Off", NULL, set_trigger_hyst, 0, "<RadioItem>"},
+    {"/Trigger/Hysteresis/1", NULL, set_trigger_hyst, 1, "/Trigger/Hysteresis/Off"},
+    {"/Trigger/Hysteresis/2", NULL, set_trigger_hyst, 2, "/Trigger/Hysteresis/Off"},
+    {"/Trigger/Hysteresis/4", NULL, set_trigger_hyst, 4, "/Trigger/Hysteresis/Off"},
+    {"/Trigger/Hysteresis/8", NULL, set_trigger_hyst, 8, "/Trigger/Hysteresis/Off"},
+    {"/Trigger/Hysteresis/16", NULL, set_trigger_hyst, 16, "/Trigger/Hysteresis/Off"},
+    {"/Trigger/Pre-trigger", NULL, NULL, 0, "<Branch>"},
+    {"/Trigger/Pre-trigger/0%", NULL, set_trigger_pos, 0, "<RadioItem>"},
+    {"/Trigger/Pre-trigger/10%", NULL, set_trigger_pos, 10, "/Trigger/Pre-trigger/0%"},
+    {"/Trigger/Pre-trigger/25%", NULL, set_trigger_pos, 25, "/Trigger/Pre-trigger/0%"},
+    {"/Trigger/Pre-trigger/50%", NULL, set_trigger_pos, 50, "/Trigger/Pre-trigger/0%"},
+    {"/Trigger/Pre-trigger/75%", NULL, set_trigger_pos, 75, "/Trigger/Pre-trigger/0%"},
+    {"/Trigger/Pre-trigger/90%", NULL, set_trigger_pos, 90, "/Trigger/Pre-trigger/0%"},
 
     {"/Scope", NULL, NULL, 0, "<Branch>"},
     {"/Scope/Run", NULL, runmode, 1, "<RadioItem>"},
@@ -1082,6 +1118,26 @@ void fix_widgets(void)
              (gtk_item_factory_get_item(factory, q->path)), TRUE);
     }
 
+    if ((p = finditem("/Trigger/Hysteresis/Off"))) {
+        for (q = p; q->callback == set_trigger_hyst; q++) {
+            if (q->callback_action == scope.trighyst) {
+                gtk_check_menu_item_set_active
+                    (GTK_CHECK_MENU_ITEM
+                     (gtk_item_factory_get_item(factory, q->path)), TRUE);
+            }
+        }
+    }
+
+    if ((p = finditem("/Trigger/Pre-trigger/0%"))) {
+        for (q = p; q->callback == set_trigger_pos; q++) {
+            if (q->callback_action == scope.trigpos) {
+                gtk_check_menu_item_set_active
+                    (GTK_CHECK_MENU_ITEM
+                     (gtk_item_factory_get_item(factory, q->path)), TRUE);
+            }
+        }
+    }
+
     /* The trigger channels.  There are eight of them defined, but we only show as many as
      * datasrc->nchans() indicate are available.  (We assume datasrc->nchans() is <= 8).  Set their
      * labels to the names in the Signal arrays; make them all insensitive if triggering is turned
@@ -1148,6 +1204,11 @@ void fix_widgets(void)
             (GTK_WIDGET(gtk_item_factory_get_item(factory, p->path)),
              scope.trige != 0);
     }
+    if ((p = finditem("/Trigger/Pre-trigger"))) {
+        gtk_widget_set_sensitive
+            (GTK_WIDGET(gtk_item_factory_get_item(factory, p->path)),
+             scope.trige != 0);
+    }
 
     if ((p = finditem("/Scope/Stop")) && scope.run == 0) {
         gtk_check_menu_item_set_active
@@ -1524,6 +1585,10 @@ void init_widgets(void)
     gtk_databox_set_adjustment_x (GTK_DATABOX (databox),
                                   gtk_range_get_adjustment (GTK_RANGE (LU("databox_hscrollbar"))));
 
+    /* Accumulate mode's persistence is drawn over whatever the databox draws */
+
+    g_signal_connect_after(G_OBJECT(databox), "expose-event", G_CALLBACK(persist_expose), NULL);
+
     gtk_widget_show(glade_window);
 
 #if 0